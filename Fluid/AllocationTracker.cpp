@@ -0,0 +1,111 @@
+#include "AllocationTracker.h"
+
+#ifdef FLUID_TRACK_ALLOCATIONS
+
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+// Constant initialized, so counting works for allocations made before main 
+static std::atomic<unsigned long long> s_Count(0);
+static std::atomic<unsigned long long> s_Bytes(0);
+
+static void* TrackedAlloc(std::size_t size)
+{
+	s_Count.fetch_add(1, std::memory_order_relaxed);
+	s_Bytes.fetch_add(size, std::memory_order_relaxed);
+
+	return std::malloc(size == 0 ? 1 : size);
+}
+
+void* operator new(std::size_t size)
+{
+	void* ptr = TrackedAlloc(size);
+	if (ptr == nullptr)
+		throw std::bad_alloc();
+
+	return ptr;
+}
+
+void* operator new[](std::size_t size)
+{
+	void* ptr = TrackedAlloc(size);
+	if (ptr == nullptr)
+		throw std::bad_alloc();
+
+	return ptr;
+}
+
+void* operator new(std::size_t size, const std::nothrow_t&) noexcept
+{
+	return TrackedAlloc(size);
+}
+
+void* operator new[](std::size_t size, const std::nothrow_t&) noexcept
+{
+	return TrackedAlloc(size);
+}
+
+void operator delete(void* ptr) noexcept
+{
+	std::free(ptr);
+}
+
+void operator delete[](void* ptr) noexcept
+{
+	std::free(ptr);
+}
+
+void operator delete(void* ptr, std::size_t) noexcept
+{
+	std::free(ptr);
+}
+
+void operator delete[](void* ptr, std::size_t) noexcept
+{
+	std::free(ptr);
+}
+
+void operator delete(void* ptr, const std::nothrow_t&) noexcept
+{
+	std::free(ptr);
+}
+
+void operator delete[](void* ptr, const std::nothrow_t&) noexcept
+{
+	std::free(ptr);
+}
+
+bool AllocationTracker::IsEnabled()
+{
+	return true;
+}
+
+unsigned long long AllocationTracker::GetCount()
+{
+	return s_Count.load(std::memory_order_relaxed);
+}
+
+unsigned long long AllocationTracker::GetBytes()
+{
+	return s_Bytes.load(std::memory_order_relaxed);
+}
+
+#else
+
+bool AllocationTracker::IsEnabled()
+{
+	return false;
+}
+
+unsigned long long AllocationTracker::GetCount()
+{
+	return 0;
+}
+
+unsigned long long AllocationTracker::GetBytes()
+{
+	return 0;
+}
+
+#endif
\ No newline at end of file
@@ -0,0 +1,24 @@
+#pragma once
+
+// Debug builds always track, so the allocation check has something to
+// measure without touching the project settings. Define
+// FLUID_NO_TRACK_ALLOCATIONS to turn it off, or FLUID_TRACK_ALLOCATIONS to
+// turn it on in other builds 
+#if defined(_DEBUG) && !defined(FLUID_NO_TRACK_ALLOCATIONS) && !defined(FLUID_TRACK_ALLOCATIONS)
+#define FLUID_TRACK_ALLOCATIONS
+#endif
+
+/// <summary>
+/// Counts heap allocations made through operator new. The global operators
+/// are only replaced when FLUID_TRACK_ALLOCATIONS is defined, otherwise
+/// nothing is counted, every count stays at zero and IsEnabled is false
+/// </summary>
+class AllocationTracker
+{
+public:
+	static bool IsEnabled();
+
+	// Totals since the program started, from every thread 
+	static unsigned long long GetCount();
+	static unsigned long long GetBytes();
+};
\ No newline at end of file
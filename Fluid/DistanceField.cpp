@@ -0,0 +1,240 @@
+#include "DistanceField.h"
+
+#include <iostream>
+#include <algorithm>
+
+#include "stb_image.h"
+
+// Stands in for infinity in the distance transform, squared distances stay far below it 
+static const float FAR = 1e20f;
+
+// Texels either side of the surface that hold a real distance, anything
+// further is clamped. Wider than a particle so collisions always see a gradient 
+static const int BANDTEXELS = 8;
+
+/// <summary>
+/// Exact 1D squared distance transform of Felzenszwalb and Huttenlocher.
+/// Every output is the lowest (q - p)^2 + f[p] over all p
+/// </summary>
+static void Transform(const float* f, float* d, int n, int* v, float* z)
+{
+	int k = 0;
+	v[0] = 0;
+	z[0] = -FAR;
+	z[1] = FAR;
+
+	// Lower envelope of the parabolas rooted at every sample 
+	for (int q = 1; q < n; q++)
+	{
+		float s = ((f[q] + q * q) - (f[v[k]] + v[k] * v[k])) / (2 * q - 2 * v[k]);
+		while (s <= z[k])
+		{
+			k--;
+			s = ((f[q] + q * q) - (f[v[k]] + v[k] * v[k])) / (2 * q - 2 * v[k]);
+		}
+
+		k++;
+		v[k] = q;
+		z[k] = s;
+		z[k + 1] = FAR;
+	}
+
+	k = 0;
+	for (int q = 0; q < n; q++)
+	{
+		while (z[k + 1] < q)
+			k++;
+
+		d[q] = (q - v[k]) * (q - v[k]) + f[v[k]];
+	}
+}
+
+DistanceField::DistanceField()
+	:resolution(0), texelSize(1.0f)
+{
+}
+
+bool DistanceField::LoadMask(const std::string& path, float size, int _resolution)
+{
+	// Bottom row first, the same way up as the simulation 
+	int width, height, channels;
+	stbi_set_flip_vertically_on_load(1);
+	unsigned char* pixels = stbi_load(path.c_str(), &width, &height, &channels, 2);
+
+	if (pixels == nullptr)
+	{
+		std::cout << "[DistanceField] Could not load " << path << ": " << stbi_failure_reason() << std::endl;
+		return false;
+	}
+
+	// Nearest pixel to the centre of every texel, grey and alpha 
+	std::vector<unsigned char> solid(_resolution * _resolution);
+	for (int y = 0; y < _resolution; y++)
+	{
+		int py = glm::min((int)((y + 0.5f) * height / _resolution), height - 1);
+		for (int x = 0; x < _resolution; x++)
+		{
+			int px = glm::min((int)((x + 0.5f) * width / _resolution), width - 1);
+			const unsigned char* pixel = pixels + (py * width + px) * 2;
+			solid[y * _resolution + x] = pixel[0] >= 128 && pixel[1] >= 128;
+		}
+	}
+
+	stbi_image_free(pixels);
+
+	Build(solid.data(), size, _resolution);
+	return true;
+}
+
+void DistanceField::Build(const unsigned char* solid, float size, int _resolution)
+{
+	resolution = _resolution;
+	texelSize = size / resolution;
+
+	mask = std::vector<unsigned char>(solid, solid + resolution * resolution);
+	distances = std::vector<float>(resolution * resolution);
+	Recompute(0, 0, resolution, resolution);
+}
+
+void DistanceField::Clear(float size, int _resolution)
+{
+	resolution = _resolution;
+	texelSize = size / resolution;
+
+	mask = std::vector<unsigned char>(resolution * resolution, 0);
+	distances = std::vector<float>(resolution * resolution, BANDTEXELS * texelSize);
+}
+
+bool DistanceField::Paint(glm::vec2 center, float radius, bool solid, glm::vec2& dirtyMin, glm::vec2& dirtyMax)
+{
+	int xMin = glm::max((int)((center.x - radius) / texelSize), 0);
+	int yMin = glm::max((int)((center.y - radius) / texelSize), 0);
+	int xMax = glm::min((int)((center.x + radius) / texelSize) + 1, resolution);
+	int yMax = glm::min((int)((center.y + radius) / texelSize) + 1, resolution);
+
+	bool changed = false;
+	for (int y = yMin; y < yMax; y++)
+	{
+		for (int x = xMin; x < xMax; x++)
+		{
+			glm::vec2 texel = (glm::vec2(x, y) + glm::vec2(0.5f)) * texelSize;
+			if (glm::distance(texel, center) > radius)
+				continue;
+
+			unsigned char& value = mask[y * resolution + x];
+			changed |= value != (unsigned char)solid;
+			value = solid;
+		}
+	}
+
+	if (!changed)
+		return false;
+
+	// Only texels within the band of a changed texel can get a new clamped distance 
+	xMin = glm::max(xMin - BANDTEXELS - 1, 0);
+	yMin = glm::max(yMin - BANDTEXELS - 1, 0);
+	xMax = glm::min(xMax + BANDTEXELS + 1, resolution);
+	yMax = glm::min(yMax + BANDTEXELS + 1, resolution);
+	Recompute(xMin, yMin, xMax, yMax);
+
+	dirtyMin = glm::vec2(xMin, yMin) * texelSize;
+	dirtyMax = glm::vec2(xMax, yMax) * texelSize;
+	return true;
+}
+
+void DistanceField::Recompute(int xMin, int yMin, int xMax, int yMax)
+{
+	// Anything that can be within the band of the region has to be seen 
+	int x0 = glm::max(xMin - BANDTEXELS - 1, 0);
+	int y0 = glm::max(yMin - BANDTEXELS - 1, 0);
+	int width = glm::min(xMax + BANDTEXELS + 1, resolution) - x0;
+	int height = glm::min(yMax + BANDTEXELS + 1, resolution) - y0;
+
+	SquaredDistances(x0, y0, width, height, true, toSolid);
+	SquaredDistances(x0, y0, width, height, false, toEmpty);
+
+	// Distances are between texel centres, the surface sits half a texel 
+	// from the last texel on either side 
+	float band = (float)BANDTEXELS;
+	for (int y = yMin; y < yMax; y++)
+	{
+		for (int x = xMin; x < xMax; x++)
+		{
+			int window = (y - y0) * width + (x - x0);
+			float texels = mask[y * resolution + x] ? -(glm::sqrt(toEmpty[window]) - 0.5f) : glm::sqrt(toSolid[window]) - 0.5f;
+			distances[y * resolution + x] = glm::clamp(texels, -band, band) * texelSize;
+		}
+	}
+}
+
+void DistanceField::SquaredDistances(int x0, int y0, int width, int height, bool solid, std::vector<float>& out)
+{
+	int longest = glm::max(width, height);
+	if ((int)out.size() < width * height)
+		out.resize(width * height);
+	if ((int)lineIn.size() < longest)
+	{
+		lineIn.resize(longest);
+		lineOut.resize(longest);
+		lineRoots.resize(longest);
+		lineBounds.resize(longest + 1);
+	}
+
+	for (int y = 0; y < height; y++)
+	{
+		for (int x = 0; x < width; x++)
+		{
+			bool isSolid = mask[(y0 + y) * resolution + x0 + x] != 0;
+			out[y * width + x] = isSolid == solid ? 0.0f : FAR;
+		}
+	}
+
+	for (int x = 0; x < width; x++)
+	{
+		for (int y = 0; y < height; y++)
+			lineIn[y] = out[y * width + x];
+
+		Transform(lineIn.data(), lineOut.data(), height, lineRoots.data(), lineBounds.data());
+
+		for (int y = 0; y < height; y++)
+			out[y * width + x] = lineOut[y];
+	}
+
+	for (int y = 0; y < height; y++)
+	{
+		Transform(&out[y * width], lineOut.data(), width, lineRoots.data(), lineBounds.data());
+		std::copy(lineOut.begin(), lineOut.begin() + width, out.begin() + y * width);
+	}
+}
+
+float DistanceField::At(int x, int y) const
+{
+	x = glm::clamp(x, 0, resolution - 1);
+	y = glm::clamp(y, 0, resolution - 1);
+	return distances[y * resolution + x];
+}
+
+float DistanceField::Sample(glm::vec2 pos) const
+{
+	// Texel centres sit half a texel in 
+	glm::vec2 texel = pos / texelSize - glm::vec2(0.5f);
+	glm::vec2 base = glm::floor(texel);
+	glm::vec2 f = texel - base;
+
+	int x = (int)base.x;
+	int y = (int)base.y;
+
+	float bottom = glm::mix(At(x, y), At(x + 1, y), f.x);
+	float top = glm::mix(At(x, y + 1), At(x + 1, y + 1), f.x);
+	return glm::mix(bottom, top, f.y);
+}
+
+glm::vec2 DistanceField::Gradient(glm::vec2 pos) const
+{
+	glm::vec2 dx = glm::vec2(texelSize, 0.0f);
+	glm::vec2 dy = glm::vec2(0.0f, texelSize);
+
+	return glm::vec2(
+		Sample(pos + dx) - Sample(pos - dx),
+		Sample(pos + dy) - Sample(pos - dy)) / (2.0f * texelSize);
+}
\ No newline at end of file
@@ -0,0 +1,88 @@
+#pragma once
+#include "glm/glm.hpp"
+
+#include <string>
+#include <vector>
+
+/// <summary>
+/// Signed distance to static obstacles over a square area, negative inside.
+/// Built from a mask, after which any query is a single bilinear lookup
+/// however complicated the obstacles are. Distances are clamped to a narrow
+/// band around the surface, so painting the mask only has to recompute the
+/// texels within a band of the brush
+/// </summary>
+class DistanceField
+{
+private:
+	// Distance at the centre of each texel and whether it is solid, row by
+	// row from the bottom 
+	std::vector<float> distances;
+	std::vector<unsigned char> mask;
+	int resolution;
+	float texelSize;
+
+	// Kept between updates so painting does not allocate every stroke 
+	std::vector<float> toSolid;
+	std::vector<float> toEmpty;
+	std::vector<float> lineIn;
+	std::vector<float> lineOut;
+	std::vector<float> lineBounds;
+	std::vector<int> lineRoots;
+
+	float At(int x, int y) const;
+
+	/// <summary>
+	/// Squared distance in texels from every texel of a window of the mask to
+	/// the nearest texel in the window that is solid or empty as asked 
+	/// </summary>
+	void SquaredDistances(int x0, int y0, int width, int height, bool solid, std::vector<float>& out);
+
+	/// <summary>
+	/// Recompute the distances of the texels from min up to but not including max 
+	/// </summary>
+	void Recompute(int xMin, int yMin, int xMax, int yMax);
+
+public:
+	DistanceField();
+
+	/// <summary>
+	/// Load a PNG and build the field from it. Bright opaque pixels are solid,
+	/// the image is stretched over the whole area
+	/// </summary>
+	/// <param name="size">Side length of the area in world units</param>
+	/// <param name="_resolution">Texels per side of the field</param>
+	/// <returns>False if the image could not be loaded</returns>
+	bool LoadMask(const std::string& path, float size, int _resolution);
+
+	/// <summary>
+	/// Build from a resolution by resolution mask, non zero is solid
+	/// </summary>
+	void Build(const unsigned char* solid, float size, int _resolution);
+
+	/// <summary>
+	/// Start with no obstacles at all 
+	/// </summary>
+	void Clear(float size, int _resolution);
+
+	/// <summary>
+	/// Make a disc solid or empty and update the distances it changed 
+	/// </summary>
+	/// <param name="dirtyMin">Lower corner of the area whose distances changed</param>
+	/// <param name="dirtyMax">Upper corner of the area whose distances changed</param>
+	/// <returns>False when the disc was already painted that way</returns>
+	bool Paint(glm::vec2 center, float radius, bool solid, glm::vec2& dirtyMin, glm::vec2& dirtyMax);
+
+	/// <summary>
+	/// Distance from pos to the nearest obstacle surface. Outside the area
+	/// the nearest edge texel is used
+	/// </summary>
+	float Sample(glm::vec2 pos) const;
+
+	/// <summary>
+	/// Direction the distance grows fastest, points out of obstacles
+	/// </summary>
+	glm::vec2 Gradient(glm::vec2 pos) const;
+
+	inline bool IsEmpty() const { return distances.empty(); }
+	inline int GetResolution() const { return resolution; }
+};
\ No newline at end of file
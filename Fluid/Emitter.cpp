@@ -0,0 +1,290 @@
+#include "Emitter.h"
+#include "Fluid.h"
+#include "PoissonSampler.h"
+
+/// <summary>
+/// Distance from a point to the segment between a and b 
+/// </summary>
+static float DistanceToSegment(glm::vec2 pos, glm::vec2 a, glm::vec2 b)
+{
+	glm::vec2 ab = b - a;
+	float lengthSq = glm::dot(ab, ab);
+	float t = lengthSq > 0.0f ? glm::clamp(glm::dot(pos - a, ab) / lengthSq, 0.0f, 1.0f) : 0.0f;
+	return glm::distance(pos, a + ab * t);
+}
+
+bool Emitter::Contains(glm::vec2 pos) const
+{
+	switch (shape)
+	{
+	case Rect:
+		return pos.x >= start.x && pos.y >= start.y && pos.x <= end.x && pos.y <= end.y;
+	case Disc:
+		return glm::distance(pos, start) <= radius;
+	default:
+		return DistanceToSegment(pos, start, end) <= radius;
+	}
+}
+
+void Emitter::GetBounds(glm::vec2& min, glm::vec2& max) const
+{
+	switch (shape)
+	{
+	case Rect:
+		min = start;
+		max = end;
+		break;
+	case Disc:
+		min = start - glm::vec2(radius);
+		max = start + glm::vec2(radius);
+		break;
+	default:
+		min = glm::min(start, end) - glm::vec2(radius);
+		max = glm::max(start, end) + glm::vec2(radius);
+		break;
+	}
+}
+
+EmitterSystem::EmitterSystem(float _spacing, unsigned int maxBatch)
+	:spacing(_spacing)
+{
+	emitters = std::vector<Emitter>();
+
+	spawnBatch = std::vector<glm::vec2>();
+	spawnBatch.reserve(maxBatch);
+	spawnVelocities = std::vector<glm::vec2>();
+	spawnVelocities.reserve(maxBatch);
+	killBatch = std::vector<unsigned int>();
+	killBatch.reserve(maxBatch);
+	candidates = std::vector<unsigned int>(maxBatch * 4);
+}
+
+int EmitterSystem::Add(Emitter emitter)
+{
+	emitter.enabled = true;
+	emitter.patternRadius = emitter.radius;
+	emitter.patternCursor = 0;
+	emitter.pending = 0.0f;
+	emitter.rotation = 0.0f;
+
+	if (!emitter.isSink)
+	{
+		// Sample the shape once, emitting then just walks through the pattern.
+		// Rects are sampled in place, discs and strokes around the origin 
+		glm::vec2 min;
+		glm::vec2 max;
+		if (emitter.shape == Emitter::Rect)
+		{
+			emitter.GetBounds(min, max);
+		}
+		else
+		{
+			min = glm::vec2(-emitter.radius);
+			max = glm::vec2(emitter.radius);
+		}
+
+		std::vector<glm::vec2> samples;
+		PoissonSampler::SampleRect(min, max, spacing, emitters.size() + 1, samples);
+
+		for (unsigned int i = 0; i < samples.size(); i++)
+		{
+			if (emitter.shape == Emitter::Rect || glm::length(samples[i]) <= emitter.radius)
+			{
+				emitter.pattern.push_back(emitter.shape == Emitter::Rect ? samples[i] - min : samples[i]);
+			}
+		}
+
+		if (emitter.pattern.empty())
+		{
+			emitter.pattern.push_back(glm::vec2(0));
+		}
+	}
+
+	emitters.push_back(emitter);
+	return emitters.size() - 1;
+}
+
+int EmitterSystem::AddRect(glm::vec2 min, glm::vec2 max, float rate, glm::vec2 velocity)
+{
+	Emitter emitter;
+	emitter.shape = Emitter::Rect;
+	emitter.isSink = false;
+	emitter.start = min;
+	emitter.end = max;
+	emitter.radius = 0.0f;
+	emitter.rate = rate;
+	emitter.velocity = velocity;
+	return Add(emitter);
+}
+
+int EmitterSystem::AddDisc(glm::vec2 center, float radius, float rate, glm::vec2 velocity)
+{
+	Emitter emitter;
+	emitter.shape = Emitter::Disc;
+	emitter.isSink = false;
+	emitter.start = center;
+	emitter.end = center;
+	emitter.radius = radius;
+	emitter.rate = rate;
+	emitter.velocity = velocity;
+	return Add(emitter);
+}
+
+int EmitterSystem::AddStroke(glm::vec2 start, glm::vec2 end, float radius, float rate, glm::vec2 velocity)
+{
+	Emitter emitter;
+	emitter.shape = Emitter::Stroke;
+	emitter.isSink = false;
+	emitter.start = start;
+	emitter.end = end;
+	emitter.radius = radius;
+	emitter.rate = rate;
+	emitter.velocity = velocity;
+	return Add(emitter);
+}
+
+int EmitterSystem::AddRectSink(glm::vec2 min, glm::vec2 max, float rate)
+{
+	Emitter emitter;
+	emitter.shape = Emitter::Rect;
+	emitter.isSink = true;
+	emitter.start = min;
+	emitter.end = max;
+	emitter.radius = 0.0f;
+	emitter.rate = rate;
+	emitter.velocity = glm::vec2(0);
+	return Add(emitter);
+}
+
+int EmitterSystem::AddDiscSink(glm::vec2 center, float radius, float rate)
+{
+	Emitter emitter;
+	emitter.shape = Emitter::Disc;
+	emitter.isSink = true;
+	emitter.start = center;
+	emitter.end = center;
+	emitter.radius = radius;
+	emitter.rate = rate;
+	emitter.velocity = glm::vec2(0);
+	return Add(emitter);
+}
+
+void EmitterSystem::Update(Fluid& fluid, float timeStep)
+{
+	// Gather this steps spawns from every emitter 
+	spawnBatch.clear();
+	spawnVelocities.clear();
+	for (unsigned int e = 0; e < emitters.size(); e++)
+	{
+		Emitter& emitter = emitters[e];
+		if (!emitter.enabled || emitter.isSink)
+			continue;
+
+		emitter.pending += emitter.rate * timeStep;
+		int count = (int)emitter.pending;
+		emitter.pending -= count;
+		if (count == 0)
+			continue;
+
+		// Golden angle, so no two steps line the pattern up the same way 
+		float cosine = 1.0f;
+		float sine = 0.0f;
+		if (emitter.shape != Emitter::Rect)
+		{
+			emitter.rotation += 2.399963f;
+			if (emitter.rotation > 6.283185f)
+			{
+				emitter.rotation -= 6.283185f;
+			}
+			cosine = glm::cos(emitter.rotation);
+			sine = glm::sin(emitter.rotation);
+		}
+
+		for (int i = 0; i < count && spawnBatch.size() < spawnBatch.capacity(); i++)
+		{
+			// Points outside the current radius are skipped, at most one lap 
+			glm::vec2 offset = emitter.pattern[emitter.patternCursor];
+			emitter.patternCursor = (emitter.patternCursor + 1) % emitter.pattern.size();
+			if (emitter.shape != Emitter::Rect && emitter.radius < emitter.patternRadius)
+			{
+				for (unsigned int j = 1; j < emitter.pattern.size() && glm::length(offset) > emitter.radius; j++)
+				{
+					offset = emitter.pattern[emitter.patternCursor];
+					emitter.patternCursor = (emitter.patternCursor + 1) % emitter.pattern.size();
+				}
+
+				// Radius is below the spacing, the centre is all that is left 
+				if (glm::length(offset) > emitter.radius)
+				{
+					offset = glm::vec2(0);
+				}
+			}
+			offset = glm::vec2(cosine * offset.x - sine * offset.y, sine * offset.x + cosine * offset.y);
+
+			glm::vec2 origin = emitter.start;
+			if (emitter.shape == Emitter::Stroke)
+			{
+				// Spread along the stroke with a low discrepancy step 
+				float t = glm::fract(emitter.patternCursor * 0.618034f);
+				origin = emitter.start + (emitter.end - emitter.start) * t;
+			}
+
+			spawnBatch.push_back(origin + offset);
+			spawnVelocities.push_back(emitter.velocity);
+		}
+	}
+
+	if (!spawnBatch.empty())
+	{
+		fluid.SpawnParticles(&spawnBatch[0], &spawnVelocities[0], spawnBatch.size());
+	}
+
+	// Gather this steps removals from every sink 
+	killBatch.clear();
+	for (unsigned int e = 0; e < emitters.size(); e++)
+	{
+		Emitter& emitter = emitters[e];
+		if (!emitter.enabled || !emitter.isSink)
+			continue;
+
+		int limit = killBatch.capacity() - killBatch.size();
+		if (emitter.rate > 0.0f)
+		{
+			emitter.pending += emitter.rate * timeStep;
+			limit = glm::min(limit, (int)emitter.pending);
+		}
+
+		glm::vec2 min;
+		glm::vec2 max;
+		emitter.GetBounds(min, max);
+
+		// Only the cells under the sink are looked at. A sink bigger than the
+		// buffer removes the rest over the next steps 
+		unsigned int candidateCount = fluid.CollectParticlesInRect(min, max, candidates.data(), candidates.size());
+
+		View<glm::vec2> positions = fluid.GetPositionView();
+
+		int removed = 0;
+		for (unsigned int i = 0; i < candidateCount && removed < limit; i++)
+		{
+			if (emitter.Contains(positions[candidates[i]]))
+			{
+				killBatch.push_back(candidates[i]);
+				removed++;
+			}
+		}
+
+		if (emitter.rate > 0.0f)
+		{
+			// Nothing is owed once the sink has run dry, a full buffer only means
+			// there was more than fit 
+			bool dry = removed < limit && candidateCount < candidates.size();
+			emitter.pending = dry ? glm::fract(emitter.pending) : emitter.pending - removed;
+		}
+	}
+
+	if (!killBatch.empty())
+	{
+		fluid.KillParticles(&killBatch[0], killBatch.size());
+	}
+}
\ No newline at end of file
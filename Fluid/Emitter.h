@@ -0,0 +1,86 @@
+#pragma once
+#include "glm/glm.hpp"
+
+#include <vector>
+
+class Fluid;
+
+/// <summary>
+/// Adds particles inside a shape at a steady rate, or removes them when used as a sink 
+/// </summary>
+struct Emitter
+{
+	enum Shape
+	{
+		Rect = 0,
+		Disc = 1,
+		Stroke = 2 // Disc swept from start to end, used by the brush
+	};
+
+	Shape shape;
+	bool isSink;
+	bool enabled;
+
+	// Rect: min and max corners. Disc: centre in start. Stroke: both ends 
+	glm::vec2 start;
+	glm::vec2 end;
+	float radius;
+
+	// Particles per second. A sink with a rate of zero removes everything inside 
+	float rate;
+	glm::vec2 velocity;
+
+	// Blue noise points relative to the shape that emitted particles are taken from.
+	// Discs and strokes are sampled out to the radius they were added with, so
+	// radius can be lowered later without changing the spacing 
+	std::vector<glm::vec2> pattern;
+	float patternRadius;
+	unsigned int patternCursor;
+	float pending;
+
+	// Discs and strokes turn the pattern a little every step they emit, so
+	// the same points are not filled again and again 
+	float rotation;
+
+	bool Contains(glm::vec2 pos) const;
+	void GetBounds(glm::vec2& min, glm::vec2& max) const;
+};
+
+/// <summary>
+/// Runs every emitter and sink once per step. All spawns of a step go into
+/// the fluid as one batch, and so do all removals
+/// </summary>
+class EmitterSystem
+{
+private:
+	std::vector<Emitter> emitters;
+
+	// Reused every step 
+	std::vector<glm::vec2> spawnBatch;
+	std::vector<glm::vec2> spawnVelocities;
+	std::vector<unsigned int> killBatch;
+
+	// Particles in the bounds of a sink, sized once since the bounds also
+	// hold particles outside the shape 
+	std::vector<unsigned int> candidates;
+
+	float spacing;
+
+	int Add(Emitter emitter);
+public:
+	/// <param name="_spacing">Distance kept between emitted particles</param>
+	/// <param name="maxBatch">Most particles spawned or removed in one step</param>
+	EmitterSystem(float _spacing, unsigned int maxBatch);
+
+	int AddRect(glm::vec2 min, glm::vec2 max, float rate, glm::vec2 velocity);
+	int AddDisc(glm::vec2 center, float radius, float rate, glm::vec2 velocity);
+	/// <param name="radius">Largest radius the stroke will be given, the radius can be changed up to it</param>
+	int AddStroke(glm::vec2 start, glm::vec2 end, float radius, float rate, glm::vec2 velocity);
+
+	int AddRectSink(glm::vec2 min, glm::vec2 max, float rate);
+	int AddDiscSink(glm::vec2 center, float radius, float rate);
+
+	inline Emitter& Get(int index) { return emitters[index]; }
+
+	void Update(Fluid& fluid, float timeStep);
+};
\ No newline at end of file
@@ -1,150 +1,195 @@
 #include "Fluid.h"
+#include "Morton.h"
+#include "Parallel.h"
 #include <iostream>
-Fluid::Fluid(float _gravity, glm::vec3 startVel, float _cellSize, int _sideLength, int particleCount, float particleSize)
-	:gravity(_gravity), cellSize(_cellSize), sideLength(_sideLength)
+#include <algorithm>
+#include <functional>
+#include <cstring>
+#include <cfloat>
+
+/// <summary>
+/// Address of a face or nullptr for faces that do not exist 
+/// </summary>
+static float* FaceAt(std::vector<float>& faces, int index)
 {
-	// Set up vectors 
-	particles = std::vector<Particle>(particleCount);
-	particleEntity = std::vector<Entity>();
-	positions = std::vector<glm::vec3>(particleCount);
+	return index < 0 ? nullptr : &faces[index];
+}
 
-	cells = std::vector<Cell>();
+// Resolution of obstacles painted onto a fluid that was given none 
+static const int OBSTACLETEXELSPERCELL = 4;
 
-	velField = std::vector<std::vector<Cell>>();
+// Particles advected together by AdvectBlock, small enough for the stack 
+static const int ADVECTIONBLOCK = 64;
 
+// In narrow band mode a cell without particles is liquid when the advected
+// level set puts it at least this deep. The surface layer itself only
+// exists where there are particles, so it can drain 
+static const float INTERIORPHI = -1.5f;
+
+Fluid::Fluid(float _gravity, glm::vec3 startVel, float _cellSize, int _sideLength, int particleCount, int maxParticleCount, float particleSize, GridLayout::Mode layout)
+	:particles(glm::max(particleCount, maxParticleCount)), cellListsDirty(true), blocksPerSide((_sideLength + BLOCKSIZE) / BLOCKSIZE), activeBlockCount(0), activeCellCount(0), quadLeafCount(0), maxLeafSize(1), surfaceBand(2), narrowBand(0), bandSeeds(4), bandCulls(0), bandSeedings(0), sleepSteps(0), sleepSpeed(1.0f), sleepDivergence(1.0f), sleepingBlockCount(0), extrapolationLayers(2), wallThickness(1), stencilEpoch(0), stencilCount(0), positionEpoch(1), sorter(glm::max(particleCount, maxParticleCount)), sortThreshold(0.25f), disorder(0.0f), sortCount(0), fuseParticleUpdate(true), resampleInterval(0), resampleMin(0), resampleMax(0), stepsSinceResample(0), resampleMerges(0), resampleSeeds(0), transferMode(Flip), stencilMode(Flip), advectionMode(EulerAdvection), flipBlend(1.0f), generation(0), changeDepth(0), gravity(_gravity), cellSize(_cellSize), sideLength(_sideLength), particleHalfSize(particleSize / 2.0f)
+{
 	if(cellSize < 5)
 		cellSize = 5;
 
 
-	// Setup all particles & entities 
+	// Setup all particles 
 	for (unsigned int i = 0; i < particleCount; i++)
 	{
-		particles[i] = Particle(i, &positions[i], glm::vec3(0), particleSize / 2.0f);
-		particleEntity.push_back(Entity(positions[i], particleSize));
-
-		particles[i].SetVel(startVel);
+		particles.Spawn(glm::vec2(0), glm::vec2(startVel));
 	}
 
-	// These represent the velocity field that surrond the 
-	// current cell 
-	float* xQLess = nullptr;
-	float* xQMore = nullptr;
-	float* yQLess = nullptr;
-	float* yQMore = nullptr;
+	// Only orders the cells and faces within a page 
+	cellLayout = GridLayout(layout, BLOCKSIZE, BLOCKSIZE);
 
-	float* xRLess = nullptr;
-	float* xRMore = nullptr;
-	float* yRLess = nullptr;
-	float* yRMore = nullptr;
+	// Cell lists can hold the whole pool, so no amount of crowding grows them 
+	cellParticles = std::vector<unsigned int>(particles.GetCapacity());
 
-	float* xPLess = nullptr;
-	float* xPMore = nullptr;
-	float* yPLess = nullptr;
-	float* yPMore = nullptr;
+	blockSlots = std::vector<int>(blocksPerSide * blocksPerSide, -1);
+	blockPages = std::vector<int>(blockSlots.size(), 0);
+	blockOccupied = std::vector<unsigned char>(blockSlots.size(), 0);
+	blockLiquid = std::vector<unsigned char>(blockSlots.size(), 0);
+	blockAsleep = std::vector<unsigned char>(blockSlots.size(), 0);
+	blockCalmSteps = std::vector<unsigned short>(blockSlots.size(), 0);
+	blockParticles = std::vector<unsigned int>(blockSlots.size(), 0);
+	lastBlockParticles = std::vector<unsigned int>(blockSlots.size(), 0);
+	activeBlocks = std::vector<unsigned int>(blockSlots.size());
 
-	// Setup cells
-	for (unsigned int x = 0; x < sideLength; x++)
-	{
-		bool isXEdge = (x == 0 || x == sideLength - 1);
+	// Every block could hold a page, so giving them back never grows the list 
+	freePages.reserve(blockSlots.size());
 
-		// Previous edge is set
-		xQLess = xQMore;
-		xRLess = xRMore;
-		xPLess = xPMore;
+	// The rest page, cells and faces grow a page at a time from here 
+	TakePage();
 
-		// Check if next is out of bounds or curent is edge 
-		if (x + 1 >= sideLength - 1)
-		{
-			// next cell over is null 
-			xQMore = nullptr;
-			xRMore = nullptr;
-			xPMore = nullptr;
-		}
-		else
-		{
-			xQMore = new float(0.0f);
-			xRMore = new float(0.0f);
-			xPMore = new float(0.0f);
-		}
+	stencils = std::vector<TransferStencil>(particles.GetCapacity());
+	staggeredStencils = std::vector<StaggeredStencil>(particles.GetCapacity());
+
+	killList = std::vector<unsigned int>(particles.GetCapacity());
 
+	sortKeys = std::vector<unsigned int>(particles.GetCapacity());
+	sortOrder = std::vector<unsigned int>(particles.GetCapacity());
+	RebuildCellLists();
+	ClassifyCells();
+}
 
+Fluid::~Fluid()
+{
+}
 
+void Fluid::SetGravity(float g)
+{
+	if (g != gravity)
+	{
+		WakeAll();
+	}
+	gravity = g;
+}
 
-		// Reset y 
-		yQLess = nullptr;
-		yQMore = nullptr;
+void Fluid::SetObstacles(const DistanceField& field)
+{
+	BeginChange();
 
-		yRLess = nullptr;
-		yRMore = nullptr;
+	obstacles = field;
 
-		yPLess = nullptr;
-		yPMore = nullptr;
+	// Pages taken later sample the field when they are set up 
+	for (unsigned int block = 0; block < blockPages.size(); block++)
+	{
+		if (blockPages[block] == 0)
+			continue;
 
-		for (unsigned int y = 0; y < sideLength; y++)
+		glm::ivec2 min, max;
+		BlockBounds(block, sideLength, sideLength, min, max);
+		for (int x = min.x; x < max.x; x++)
 		{
-			bool isYEdge = (y == 0 || y == sideLength - 1);
-			//std::cout << isXEdge << std::endl;
+			for (int y = min.y; y < max.y; y++)
+			{
+				obstacleCells[CellIndex(x, y)] = CellInObstacle(x, y);
+			}
+		}
+	}
+	RestCells(glm::ivec2(0), glm::ivec2(sideLength));
+	WakeAll();
+	ClassifyCells();
+	CloseSolidFaces();
+
+	EndChange();
+}
 
-			// Previous edge is set
-			yQLess = yQMore;
-			yRLess = yRMore;
-			yPLess = yPMore;
+void Fluid::PaintObstacle(glm::vec2 center, float radius, bool solid)
+{
+	if (obstacles.IsEmpty())
+	{
+		if (!solid)
+			return;
+		obstacles.Clear(sideLength * cellSize, sideLength * OBSTACLETEXELSPERCELL);
+	}
 
+	glm::vec2 dirtyMin, dirtyMax;
+	if (!obstacles.Paint(center, radius, solid, dirtyMin, dirtyMax))
+		return;
 
-			// Check if next is out of bounds or curent is edge 
-			if (y + 1 >= sideLength - 1)
-			{
-				// next cell over is null 
-				yQMore = nullptr;
-				yRMore = nullptr;
-				yPMore = nullptr;
-			}
-			else
+	BeginChange();
+
+	// Only cells under the changed distances can have changed. The solver
+	// picks up the active ones when the next step classifies the cells, and
+	// cells without a page sample the field once they get one 
+	int xMin = glm::max((int)(dirtyMin.x / cellSize), 0);
+	int yMin = glm::max((int)(dirtyMin.y / cellSize), 0);
+	int xMax = glm::min((int)(dirtyMax.x / cellSize), sideLength - 1);
+	int yMax = glm::min((int)(dirtyMax.y / cellSize), sideLength - 1);
+	for (int x = xMin; x <= xMax; x++)
+	{
+		for (int y = yMin; y <= yMax; y++)
+		{
+			int c = CellIndex(x, y);
+			if (!IsRestCell(c))
 			{
-				yQMore = new float(0.0f);
-				yRMore = new float(0.0f);
-				yPMore = new float(0.0f);
+				obstacleCells[c] = CellInObstacle(x, y);
 			}
-			
+		}
+	}
+	RestCells(glm::ivec2(xMin, yMin), glm::ivec2(xMax + 1, yMax + 1));
+	WakeRegion(dirtyMin, dirtyMax);
 
-			// Check if on an edge 
-			bool isSolid = isXEdge || isYEdge;
+	// Deep inside the wall the field is flat, so there is nothing to push
+	// buried particles out with 
+	if (solid)
+	{
+		UpdateCellLists();
 
-			Cell::PushDirections pushDir = Cell::None;
-			if (isSolid)
+		unsigned int killCount = 0;
+		for (int x = xMin; x <= xMax; x++)
+		{
+			for (int y = yMin; y <= yMax; y++)
 			{
-				// Whether to set to push horizontally
-				// or vertically 
-				pushDir = isXEdge ? Cell::XAxis : Cell::YAxis;
+				const Cell& cell = cells[CellIndex(x, y)];
+				for (int i = 0; i < cell.GetParticleCount(); i++)
+				{
+					unsigned int particle = cell.GetParticle(i);
+					if (obstacles.Sample(particles.Position(particle)) < 0.0f)
+					{
+						killList[killCount++] = particle;
+					}
+				}
 			}
+		}
 
-			cells.push_back(Cell(x, y, _cellSize, isSolid, 
-				xQLess, xQMore, yQLess, yQMore, 
-				xRLess, xRMore, yRLess, yRMore, 
-				xPLess, xPMore, yPLess, yPMore, 
-				pushDir));
-
+		if (killCount > 0)
+		{
+			KillParticles(killList.data(), killCount);
 		}
 	}
-}
-
-Fluid::~Fluid()
-{
-	//delete particles;
-	//delete particleEntity;
-	//delete positions;
-
-	//delete velField;
-}
 
-void Fluid::SetGravity(float g)
-{
-	gravity = g;
+	EndChange();
 }
 
 void Fluid::SetParticlePosition(unsigned int index, glm::vec3 pos)
 {
-	positions[index] = pos;
+	BeginChange();
+	particles.Position(index) = glm::vec2(pos);
+	cellListsDirty = true;
+	positionEpoch++;
+	EndChange();
 }
 
 /// <summary>
@@ -154,44 +199,81 @@ void Fluid::SetParticlePosition(unsigned int index, glm::vec3 pos)
 glm::mat4 Fluid::GetModel(int index)
 {
 	// Create a model matrix 
-	return glm::translate(glm::mat4(1.0f), *particles[index].pos);
+	return glm::translate(glm::mat4(1.0f), glm::vec3(particles.Position(index), 0.0f));
 }
 
 /// <summary>
-/// Get a particle based on the given index 
+/// Get what cell this world position is in if possible
 /// </summary>
-/// <returns></returns>
-Particle* Fluid::GetParticle(int index)
+/// <returns>Index of the cell, in the rest page for a block without a page, or -1 outside the grid</returns>
+int Fluid::PosToCellIndex(glm::vec2 pos) const
 {
-	return &particles[index];
+	int xCell = pos.x / cellSize;
+	int yCell = pos.y / cellSize;
+
+	if (xCell < 0 || yCell < 0 || xCell >= sideLength || yCell >= sideLength)
+		return -1;
+
+	return CellIndex(xCell, yCell);
 }
 
 /// <summary>
-/// Get a entity based on the given index 
+/// Block of the cell this world position is in, whether it has a page or not 
 /// </summary>
-/// <returns></returns>
-Entity Fluid::GetEntity(int index)
+/// <returns>Block or -1 outside the grid</returns>
+int Fluid::PosToBlock(glm::vec2 pos) const
 {
-	return particleEntity[index];
+	int xCell = pos.x / cellSize;
+	int yCell = pos.y / cellSize;
+
+	if (xCell < 0 || yCell < 0 || xCell >= sideLength || yCell >= sideLength)
+		return -1;
+
+	return BlockAt(xCell, yCell);
 }
 
 /// <summary>
-/// Get what cell this world position is in if possible
+/// Cells of blocks without a page are the shared cells of the rest page 
 /// </summary>
-/// <returns>Address to cell or nullptr</returns>
 Cell* Fluid::PosToCell(glm::vec2 pos, float trueCellSize)
 {
 	// Get the index of cell this particle is in 
-	int xCell = pos.y / trueCellSize;
-	int yCell = pos.x / trueCellSize;
+	int xCell = pos.x / trueCellSize;
+	int yCell = pos.y / trueCellSize;
+
+	if (xCell < 0 || yCell < 0 || xCell >= sideLength || yCell >= sideLength)
+		return nullptr;
 
+	return &cells[CellIndex(xCell, yCell)];
+}
 
-	int cellIndex = xCell + sideLength * yCell;
+unsigned int Fluid::CollectParticlesInRect(glm::vec2 min, glm::vec2 max, unsigned int* out, unsigned int capacity)
+{
+	int xMin = glm::max(0, (int)(min.x / cellSize));
+	int yMin = glm::max(0, (int)(min.y / cellSize));
+	int xMax = glm::min(sideLength - 1, (int)(max.x / cellSize));
+	int yMax = glm::min(sideLength - 1, (int)(max.y / cellSize));
 
-	if (cellIndex >= cells.size())
-		return nullptr;
+	UpdateCellLists();
+
+	unsigned int written = 0;
+	for (int x = xMin; x <= xMax; x++)
+	{
+		for (int y = yMin; y <= yMax; y++)
+		{
+			Cell& cell = cells[CellIndex(x, y)];
+
+			int count = cell.GetParticleCount();
+			for (int i = 0; i < count; i++)
+			{
+				if (written == capacity)
+					return written;
 
-	return &cells[cellIndex];
+				out[written++] = cell.GetParticle(i);
+			}
+		}
+	}
+	return written;
 }
 
 /// <summary>
@@ -213,7 +295,7 @@ glm::vec3 Fluid::GetCellPos(int xIndex, int yIndex)
 /// </summary>
 /// <param name="cell"></param>
 /// <returns></returns>
-glm::vec2 Fluid::GetCellVel(Cell cell)
+glm::vec2 Fluid::GetCellVel(const Cell& cell) const
 {
 	float x = 0.0f; 
 	if (cell.q1 != nullptr)
@@ -240,560 +322,2835 @@ glm::vec2 Fluid::GetCellVel(Cell cell)
 	return glm::vec2(x, y) / 2.0f;
 }
 
-/// <summary>
-/// Get the cells that make up the grid 
-/// </summary>
-/// <returns></returns>
-std::vector<Cell> Fluid::GetCells()
-{
-	return cells;
-}
-
-void Fluid::AddParticleToCell(Particle* particle)
+float Fluid::GetMaxParticleSpeed() const
 {
-	// Particle update parent 
-
-	Cell* cell = PosToCell(*particle->pos, cellSize);
-	if (cell == nullptr)
-	{
-		// Particle might have been pushed out by user 
-		particle->vel = glm::vec3(0);
-		return;
-	}
+	// Bits of a positive float sort like the float, so chunks can combine
+	// their results with an integer compare and swap 
+	std::atomic<unsigned int> fastest(0);
 
-	if (!cell->ContainsParticle(particle))
+	Parallel::For(0, particles.GetCount(), 4096, [&](int begin, int end)
 	{
-		// FIND OLD CELL BASED ON X AND Y INDEX 
-		Cell* oldCell = PosToCell((cellSize + 0.5f) * particle->parentIndex, cellSize);
+		float chunkFastest = 0.0f;
+		for (int i = begin; i < end; i++)
+		{
+			const glm::vec2& vel = particles.Velocity(i);
+			chunkFastest = glm::max(chunkFastest, glm::dot(vel, vel));
+		}
 
-		// ADD CURRENT PARTICLE TO NEW CELL PARENT 
-		cell->AddParticle(particle);
+		unsigned int bits;
+		std::memcpy(&bits, &chunkFastest, sizeof(bits));
 
-		if (oldCell != nullptr)
+		unsigned int current = fastest.load(std::memory_order_relaxed);
+		while (bits > current && !fastest.compare_exchange_weak(current, bits, std::memory_order_relaxed))
 		{
-			// REMOVE CURRENT PARTICLE FROM THAT CELLS LIST 
-			oldCell->RemoveParticle(particle);
 		}
-	}
+	});
+
+	unsigned int bits = fastest.load(std::memory_order_relaxed);
+	float fastestSq;
+	std::memcpy(&fastestSq, &bits, sizeof(fastestSq));
+	return glm::sqrt(fastestSq);
 }
 
-/// <summary>
-/// Used to make sure that the particle is within the bounds 
-/// of the grid and that there is no overlap for the particles 
-/// </summary>
-/// <param name="particle"></param>
-/// <param name="trueCellSize"></param>
-/// <param name="cellWallThickness"></param>
-void Fluid::CorrectParticlePos(Particle* particle, float trueCellSize, int cellWallThickness)
+float Fluid::GetStableTimeStep(float cfl) const
 {
-	// Keep particle in bounds  
-
-	// Get the size of the grid. Don't correct based on collision cells but just if it goes out of range
-	// on each axis
-
-	float axisLimt = (sideLength - cellWallThickness) * trueCellSize;
-	float axisMin = cellWallThickness * trueCellSize;
+	float speed = GetMaxParticleSpeed() + glm::sqrt(cellSize * glm::abs(gravity));
+	if (speed <= 0.0f)
+		return FLT_MAX;
 
-	// The following checks have "magic numbers" used to help reduce the speeding up of diagonal
-	// particles. This occurs because at the bottom particles can speed really fast after meeting
-	// with their friends and then reflect in the opposite direction. This keeps happening which 
-	// eventually causes the particles to speed wayyyyy too fast. A better solution would probably
-	// be conserving momentum. 
+	return cfl * cellSize / speed;
+}
 
-	// X Check
-	if (particle->pos->x <= axisMin)
-	{
-		*particle->pos = glm::vec3(axisMin + particle->GetHalfSize(), particle->pos->y, 0.0f);
-		particle->SetVel(glm::vec3(-particle->vel.x / 2.0f, particle->vel.y / 2.0f, 0.0f));
-	}
-	else if (particle->pos->x >= axisLimt)
+/// <summary>
+/// Writers call these around anything that changes particles or the grid.
+/// Nested calls only count once 
+/// </summary>
+void Fluid::BeginChange()
+{
+	if (changeDepth++ == 0)
 	{
-		*particle->pos = glm::vec3(axisLimt - particle->GetHalfSize(), particle->pos->y, 0.0f);
-		particle->SetVel(glm::vec3(-particle->vel.x / 2.0f, particle->vel.y / 2.0f, 0.0f));
+		generation.fetch_add(1, std::memory_order_acq_rel);
 	}
+}
 
-	// Y Check
-	if (particle->pos->y <= axisMin)
-	{
-		*particle->pos = glm::vec3(particle->pos->x, axisMin + particle->GetHalfSize(), 0.0f);
-		particle->SetVel(glm::vec3(particle->vel.x / 2.0f, -particle->vel.y / 4.0f, 0.0f));
-	}
-	else if (particle->pos->y >= axisLimt)
+void Fluid::EndChange()
+{
+	if (--changeDepth == 0)
 	{
-		*particle->pos = glm::vec3(particle->pos->x, axisLimt - particle->GetHalfSize(), 0.0f);
-		particle->SetVel(glm::vec3(particle->vel.x / 2.0f, -particle->vel.y / 4.0f, 0.0f));
+		generation.fetch_add(1, std::memory_order_release);
 	}
+}
 
+View<glm::vec2> Fluid::GetPositionView() const
+{
+	return View<glm::vec2>(particles.GetPositions(), particles.GetCount(), GetGeneration());
+}
 
+View<glm::vec2> Fluid::GetVelocityView() const
+{
+	return View<glm::vec2>(particles.GetVelocities(), particles.GetCount(), GetGeneration());
+}
 
-
-	// Particle update parent 
-	AddParticleToCell(particle);
+View<unsigned int> Fluid::GetIdView() const
+{
+	return View<unsigned int>(particles.GetIds(), particles.GetCount(), GetGeneration());
 }
 
 /// <summary>
-/// Move the particles based on their velocity
-/// Also makes sure that particles stay within bounds 
+/// Get the cells that make up the grid 
 /// </summary>
-void Fluid::SimulateParticles(float timeStep, int maxParticleChecks, int cellWallThickness, glm::vec3 mousePos, const float& MOUSERADIUS, int paintMode, float particleSize)
+/// <returns></returns>
+View<Cell> Fluid::GetCellView() const
 {
-	// Spawn particles 
-	if (paintMode == 1)
-	{
-		particles.resize(particles.size() + 1);
+	return View<Cell>(cells.data(), cells.size(), GetGeneration());
+}
 
-		//std::cout << "Spawn Particles" << std::endl;
-		glm::vec3 nextPos = glm::vec3(((double)rand() / (RAND_MAX)) * MOUSERADIUS, ((double)rand() / (RAND_MAX)) * MOUSERADIUS, 0);
-		positions.push_back(nextPos);
+/// <summary>
+/// How many particles are listed in each cell, in the same order as the cells 
+/// </summary>
+View<unsigned int> Fluid::GetOccupancyView() const
+{
+	return View<unsigned int>(cellOccupancy.data(), cellOccupancy.size(), GetGeneration());
+}
 
-		int index = particles.size() - 1;
-		Particle* particle = new Particle(index, &positions[positions.size() - 1], glm::vec3(0), particleSize / 2.0f);
-		//particles.push_back(*particle);
+/// <summary>
+/// Faces page by page, see faceVelocities 
+/// </summary>
+View<float> Fluid::GetFaceVelocityView() const
+{
+	return View<float>(faceVelocities.data(), faceVelocities.size(), GetGeneration());
+}
 
-		particles[particles.size() - 1] = *particle;
-		particle->SetVel(glm::vec3(0));
+View<unsigned char> Fluid::GetCellTypeView() const
+{
+	return View<unsigned char>(cellTypes.data(), cellTypes.size(), GetGeneration());
+}
 
-		particleEntity.push_back(*(new Entity(nextPos, particleSize)));
+View<unsigned int> Fluid::GetActiveCellView() const
+{
+	return View<unsigned int>(activeCells.data(), activeCellCount, GetGeneration());
+}
 
-		AddParticleToCell(particle);
-	}
-	
+View<unsigned int> Fluid::GetActiveBlockView() const
+{
+	return View<unsigned int>(activeBlocks.data(), activeBlockCount, GetGeneration());
+}
 
-	for (unsigned int i = 0; i < particles.size(); i++)
+template<typename Func>
+void Fluid::ForOccupiedCells(const Func& func)
+{
+	for (unsigned int block = 0; block < blockOccupied.size(); block++)
 	{
-		Particle *current = &particles[i];
-		
-		(*current).vel += glm::vec3(0.0f, 1.0f, 0.0f) * gravity * timeStep;
-
-		// Set up start and end of move 
-		glm::vec2 start = glm::vec2(current->pos->x, current->pos->y);
-		glm::vec2 next = *current->pos + current->vel * timeStep;
-
-		// Change pos and make correction if necessary 
-		*current->pos = glm::vec3(next, 0.0f);
-		CorrectParticlePos(current, cellSize, cellWallThickness);
+		if (!blockOccupied[block])
+			continue;
 
-		// Keep out of mouse radius 
-		if (glm::distance(*current->pos, mousePos) < MOUSERADIUS)
+		glm::ivec2 min, max;
+		BlockBounds(block, sideLength, sideLength, min, max);
+		for (int x = min.x; x < max.x; x++)
 		{
-			switch (paintMode)
+			for (int y = min.y; y < max.y; y++)
 			{
-			case 0: // Nothgin
-				break;
-			case 1: // Spawn Particles 
-				break;
-			case 2: // Remove Particles 
-				break;
-			default: // Seperate from cursor 
-				glm::vec3 dir = *current->pos - mousePos;
-				dir /= glm::length(dir);
-
-				*current->pos = mousePos + (dir * MOUSERADIUS);
-				current->SetVel(glm::vec3(-current->vel.x / 2.0f, current->vel.y, 0.0f));
-				break;
+				func(CellIndex(x, y));
 			}
 		}
 	}
+}
 
-	// I know the below code is horrifying to look at but having it split with
-	// multiple cells helps optimize it like a quad tree 
-
-	// GO THROUGH EACH CELL AND SEPERATE PARTICLES 
-	for (unsigned c = 0; c < maxParticleChecks; c++)
+template<typename Func>
+void Fluid::ForActiveFaces(const Func& func) const
+{
+	Parallel::For(0, activeBlockCount, 4, [&](int begin, int end)
 	{
-		for (unsigned int i = 0; i < cells.size(); i++)
+		for (int a = begin; a < end; a++)
 		{
-			Cell* cell = &cells[i];
-
-			if (cell == nullptr)
-			{
-				// Cell does not exist
-				continue;
-			}
-
-			int particleCount = cell->GetParticleCount();
-			for (unsigned int a = 0; a < particleCount; a++)
+			for (int axis = 0; axis < 2; axis++)
 			{
-				Particle* childA = cell->GetParticle(a);
-
-				// Safety 
-				if (childA == nullptr || childA->index > particles.size())
-					continue;
-
+				bool horizontal = axis == 0;
+				glm::ivec2 min, max;
+				BlockBounds(activeBlocks[a], horizontal ? sideLength + 1 : sideLength, horizontal ? sideLength : sideLength + 1, min, max);
 
-				for (unsigned int b = 0; b < particleCount; b++)
+				for (int x = min.x; x < max.x; x++)
 				{
-					Particle* childB = cell->GetParticle(b);
-
-					// Safety 
-					if (childB == nullptr || childA == childB)
-						continue;
-
-					// Find center and split both particles
-					// an equal distance away from it 
-
-					glm::vec3 center = (*childA->pos + *childB->pos) / 2.0f;
-					glm::vec3 dir = (*childA->pos - center);
-					float length = glm::length(dir);
-					
-					if (length > 2.5f)
-					{
-						continue;
-					}
-
-					if (length == 0)
-					{
-						dir = glm::vec3(((double)rand() / (RAND_MAX)), ((double)rand() / (RAND_MAX)), 0.0f);
-						length = glm::length(dir);
-					}
-					dir /= length;
-
-					// Apply change 
-					if (childA->pos->y > childB->pos->y)
+					for (int y = min.y; y < max.y; y++)
 					{
-						*childA->pos += glm::vec3(0, 2.5f, 0);
-						*childB->pos -= glm::vec3(0, 2.5f, 0);
+						func(horizontal ? HorizontalFaceIndex(x, y) : VerticalFaceIndex(x, y), x, y, horizontal);
 					}
-					else
-					{
-						*childA->pos -= glm::vec3(0, 2.5f, 0);
-						*childB->pos += glm::vec3(0, 2.5f, 0);
-					}
-					
-					break;
 				}
 			}
 		}
-	}
-
-
+	});
 }
 
 /// <summary>
-/// Apply the particle velocities to the grid 
+/// Group the particles by the cell they are in with a counting sort. The
+/// blocks the particles are in are found first, so every cell a particle is
+/// listed in has a page. Only allocates when the fluid spreads over more
+/// blocks than it ever has before 
 /// </summary>
-void Fluid::TransferToVelField(std::vector<Cell> *nextValues)
+void Fluid::RebuildCellLists(bool cellsAssigned)
 {
-	// Reset all cells 
-	for (unsigned int i = 0; i < nextValues->size(); i++)
+	BeginChange();
+
+	// Only the blocks that held particles last time have lists to clear 
+	ForOccupiedCells([&](int c)
 	{
-		Cell cell = (*nextValues)[i];
+		cellOccupancy[c] = 0;
+		cells[c].SetParticles(nullptr, 0);
+	});
+	std::fill(blockOccupied.begin(), blockOccupied.end(), 0);
+	if (sleepSteps > 0)
+	{
+		std::swap(blockParticles, lastBlockParticles);
+		std::fill(blockParticles.begin(), blockParticles.end(), 0);
+	}
 
-		if (cell.q1 != nullptr)
-		{
-			*cell.q1 = 0;
-		}
-		if (cell.q2 != nullptr)
-		{
-			*cell.q2 = 0;
-		}
-		if (cell.q3 != nullptr)
-		{
-			*cell.q3 = 0;
-		}
-		if (cell.q4 != nullptr)
+	for (unsigned int i = 0; i < particles.GetCount(); i++)
+	{
+		int block = PosToBlock(particles.Position(i));
+		if (block < 0)
 		{
-			*cell.q4 = 0;
+			// Particle might have been pushed out by user 
+			particles.Velocity(i) = glm::vec2(0);
+			particles.SetCell(i, -1);
+			continue;
 		}
 
-		if (cell.r1 != nullptr)
+		blockOccupied[block] = 1;
+		if (sleepSteps > 0)
 		{
-			*cell.r1 = 0;
-		}
-		if (cell.r2 != nullptr)
-		{
-			*cell.r2 = 0;
-		}
-		if (cell.r3 != nullptr)
-		{
-			*cell.r3 = 0;
-		}
-		if (cell.r4 != nullptr)
-		{
-			*cell.r4 = 0;
+			blockParticles[block]++;
 		}
 	}
+	UpdateActiveBlocks();
 
-	// Calculate new q values of each cell
-	for (unsigned int i = 0; i < particles.size(); i++)
+	for (unsigned int i = 0; i < particles.GetCount(); i++)
 	{
-		Particle* current = &particles[i];
-		glm::vec2 particlePos = glm::vec2((*(current->pos)).x, (*(current->pos)).y - (cellSize / 2.0f));
-
-		// Get the index of cell this particle is in 
-		int xCell = particlePos.x / cellSize;
-		int yCell = particlePos.y / cellSize;
-
-
-		int cellIndex = xCell + sideLength * yCell;
-		if (cellIndex >= nextValues->size())
+		// Particles that moved into a block without a page were given the rest page 
+		int cellIndex = cellsAssigned ? particles.GetCell(i) : -1;
+		if (cellIndex < 0 || IsRestCell(cellIndex))
 		{
-			continue;
+			cellIndex = PosToCellIndex(particles.Position(i));
+			if (cellIndex < 0)
+				continue;
 		}
-		Cell cell = (*nextValues)[cellIndex];
-
-		// Change in distance to cell 
-		float deltaX = glm::abs(xCell * cellSize - particlePos.x);
-		float deltaY = glm::abs(yCell * cellSize - particlePos.y);
 
-		// Weights relative to each side 
-		float w1 = (1.0f - deltaX / cellSize) * (1.0f - deltaY / cellSize);
-		float w2 = deltaX / cellSize * (1 - deltaY / cellSize);
-		float w3 = deltaX / cellSize * deltaY / cellSize;
-		float w4 = (1 - deltaX / cellSize) * deltaY / cellSize;
-
-		float pSum = 0.0f;
-		int pCount = 0;
+		particles.SetCell(i, cellIndex);
+		cellOccupancy[cellIndex]++;
+	}
 
-		// Apply velocities to the next grid 
-		if (cell.q1 != nullptr)
+	// Particles arriving, leaving, spawning or dying all change the count 
+	if (sleepingBlockCount > 0)
+	{
+		for (unsigned int block = 0; block < blockAsleep.size(); block++)
 		{
-			*cell.q1 += w1 * current->vel.x;
-			*cell.r1 += w1;
-			*cell.p1 += w1;
-
-			pSum += w1;
-			pCount++;
+			if (blockAsleep[block] && blockParticles[block] != lastBlockParticles[block])
+			{
+				WakeBlock(block);
+			}
 		}
-		if (cell.q2 != nullptr)
-		{
-			*cell.q2 += w2 * current->vel.x;
-			*cell.r2 += w2;
-			*cell.p2 += w2;
+	}
 
-			pSum += w2;
-			pCount++;
-		}
-		if (cell.q3 != nullptr)
-		{
-			*cell.q3 += w3 * current->vel.y;
-			*cell.r3 += w3;
-			*cell.p3 += w3;
+	// Running sum over the occupied blocks only, the same as storage order
+	// for the tiled layout 
+	unsigned int start = 0;
+	ForOccupiedCells([&](int c)
+	{
+		cellStarts[c] = start;
+		start += cellOccupancy[c];
+	});
 
-			pSum += w3;
-			pCount++;
-		}
-		if (cell.q4 != nullptr)
+	// Every start is pushed to the end of its range while filling 
+	for (unsigned int i = 0; i < particles.GetCount(); i++)
+	{
+		int cellIndex = particles.GetCell(i);
+		if (cellIndex >= 0)
 		{
-			*cell.q4 += w4 * current->vel.y;
-			*cell.r4 += w4;
-			*cell.p4 += w4;
-
-			pSum += w4;
-			pCount++;
+			particles.SetCellSlot(i, cellStarts[cellIndex]);
+			cellParticles[cellStarts[cellIndex]++] = i;
 		}
-
-		cell.averageP = pSum / pCount;
 	}
 
-	for (unsigned int i = 0; i < nextValues->size(); i++)
+	ForOccupiedCells([&](int c)
 	{
-		Cell cell = (*nextValues)[i];
-		
-		if (cell.q1 != nullptr)
-		{
-			if (glm::abs(*cell.r1) > 0.0f)
-				*cell.q1 /= *cell.r1;
-		}
-		if (cell.q3 != nullptr)
+		cellStarts[c] -= cellOccupancy[c];
+		cells[c].SetParticles(cellParticles.data() + cellStarts[c], cellOccupancy[c]);
+	});
+
+	cellListsDirty = false;
+	EndChange();
+}
+
+/// <summary>
+/// Activate every block within one block of an occupied one and retire the
+/// rest. The ring holds every face the particle stencils touch and up to
+/// BLOCKSIZE layers of extrapolation. In narrow band mode blocks of liquid
+/// count as occupied even with no particles left in them. Then give a page
+/// to every block within one block of an active one and take it back from
+/// the others 
+/// </summary>
+void Fluid::UpdateActiveBlocks()
+{
+	unsigned int count = 0;
+	for (int bx = 0; bx < blocksPerSide; bx++)
+	{
+		for (int by = 0; by < blocksPerSide; by++)
+		{
+			bool wanted = false;
+			for (int x = glm::max(bx - 1, 0); x <= glm::min(bx + 1, blocksPerSide - 1) && !wanted; x++)
+			{
+				for (int y = glm::max(by - 1, 0); y <= glm::min(by + 1, blocksPerSide - 1) && !wanted; y++)
+				{
+					wanted = blockOccupied[x * blocksPerSide + y] != 0 || blockLiquid[x * blocksPerSide + y] != 0;
+				}
+			}
+
+			unsigned int block = bx * blocksPerSide + by;
+			if (wanted)
+			{
+				// Faces of a newly active block are already zero 
+				blockSlots[block] = count;
+				activeBlocks[count++] = block;
+			}
+			else if (blockSlots[block] >= 0)
+			{
+				RetireBlock(block);
+			}
+		}
+	}
+	activeBlockCount = count;
+
+	// Cells point into the face arrays, which move when a page is added 
+	const float* velocities = faceVelocities.data();
+	const float* weights = faceWeights.data();
+	const float* densities = faceDensities.data();
+	bool changed = false;
+
+	for (int bx = 0; bx < blocksPerSide; bx++)
+	{
+		for (int by = 0; by < blocksPerSide; by++)
+		{
+			bool needed = false;
+			for (int x = glm::max(bx - 1, 0); x <= glm::min(bx + 1, blocksPerSide - 1) && !needed; x++)
+			{
+				for (int y = glm::max(by - 1, 0); y <= glm::min(by + 1, blocksPerSide - 1) && !needed; y++)
+				{
+					needed = blockSlots[x * blocksPerSide + y] >= 0;
+				}
+			}
+
+			unsigned int block = bx * blocksPerSide + by;
+			bool paged = blockPages[block] != 0;
+			if (needed == paged)
+				continue;
+
+			if (needed)
+			{
+				AllocatePage(block);
+				LinkBlock(block);
+			}
+			else
+			{
+				FreePage(block);
+			}
+			changed = true;
+
+			// The blocks to the left and below have their right and top faces here 
+			if (bx > 0 && blockPages[block - blocksPerSide] != 0)
+			{
+				LinkBlock(block - blocksPerSide);
+			}
+			if (by > 0 && blockPages[block - 1] != 0)
+			{
+				LinkBlock(block - 1);
+			}
+		}
+	}
+
+	if (!changed)
+		return;
+
+	if (faceVelocities.data() != velocities || faceWeights.data() != weights || faceDensities.data() != densities)
+	{
+		for (unsigned int block = 0; block < blockPages.size(); block++)
+		{
+			if (blockPages[block] != 0)
+			{
+				LinkBlock(block);
+			}
+		}
+	}
+
+	// Stencils hold cell and face indices 
+	positionEpoch++;
+}
+
+/// <summary>
+/// Zero everything a step may have left on the faces of a block and put its
+/// cells back to what they are without fluid. The block keeps its page while
+/// it is next to an active one 
+/// </summary>
+void Fluid::RetireBlock(unsigned int block)
+{
+	blockSlots[block] = -1;
+	WakeBlock(block);
+
+	for (int axis = 0; axis < 2; axis++)
+	{
+		bool horizontal = axis == 0;
+		glm::ivec2 min, max;
+		BlockBounds(block, horizontal ? sideLength + 1 : sideLength, horizontal ? sideLength : sideLength + 1, min, max);
+
+		for (int x = min.x; x < max.x; x++)
+		{
+			for (int y = min.y; y < max.y; y++)
+			{
+				int face = horizontal ? HorizontalFaceIndex(x, y) : VerticalFaceIndex(x, y);
+				faceVelocities[face] = 0.0f;
+				faceWeights[face] = 0.0f;
+				faceDensities[face] = 0.0f;
+				faceKnown[face] = 0;
+				faceKnownNext[face] = 0;
+				advectedFaces[face] = 0.0f;
+			}
+		}
+	}
+
+	glm::ivec2 min, max;
+	BlockBounds(block, sideLength, sideLength, min, max);
+	RestCells(min, max);
+
+	blockLiquid[block] = 0;
+	for (int x = min.x; x < max.x; x++)
+	{
+		for (int y = min.y; y < max.y; y++)
+		{
+			liquidPhi[CellIndex(x, y)] = 1.0f;
+			liquidPhiNext[CellIndex(x, y)] = 1.0f;
+		}
+	}
+}
+
+/// <summary>
+/// A page off the free list, or a new one added to the end of every per cell
+/// and per face array with the values of the rest page. Adding can move the
+/// arrays 
+/// </summary>
+int Fluid::TakePage()
+{
+	if (!freePages.empty())
+	{
+		int page = freePages.back();
+		freePages.pop_back();
+		return page;
+	}
+
+	int page = cells.size() / PAGESIZE;
+	int cellCount = cells.size() + PAGESIZE;
+	int faceCount = faceVelocities.size() + 2 * PAGESIZE;
+
+	cells.resize(cellCount, Cell(-1, -1, cellSize, false,
+		nullptr, nullptr, nullptr, nullptr,
+		nullptr, nullptr, nullptr, nullptr,
+		nullptr, nullptr, nullptr, nullptr,
+		Cell::None));
+	cellStarts.resize(cellCount, 0);
+	cellOccupancy.resize(cellCount, 0);
+	cellTypes.resize(cellCount, AirCell);
+	openFaces.resize(cellCount, 0);
+	obstacleCells.resize(cellCount, 0);
+	activeCells.resize(cellCount);
+	quadLeaves.resize(cellCount);
+	leafSizes.resize(cellCount, 1);
+	liquidPhi.resize(cellCount, 1.0f);
+	liquidPhiNext.resize(cellCount, 1.0f);
+
+	faceVelocities.resize(faceCount, 0.0f);
+	faceWeights.resize(faceCount, 0.0f);
+	faceDensities.resize(faceCount, 0.0f);
+	prevFaceVelocities.resize(faceCount, 0.0f);
+	faceKnown.resize(faceCount, 0);
+	faceKnownNext.resize(faceCount, 0);
+	advectedFaces.resize(faceCount, 0.0f);
+	return page;
+}
+
+/// <summary>
+/// Give a block a page and set its cells up as they are without fluid. The
+/// faces start at zero and the cells still have to be linked 
+/// </summary>
+void Fluid::AllocatePage(unsigned int block)
+{
+	int page = TakePage();
+	blockPages[block] = page;
+
+	std::fill(faceVelocities.begin() + page * 2 * PAGESIZE, faceVelocities.begin() + (page + 1) * 2 * PAGESIZE, 0.0f);
+	std::fill(faceWeights.begin() + page * 2 * PAGESIZE, faceWeights.begin() + (page + 1) * 2 * PAGESIZE, 0.0f);
+	std::fill(faceDensities.begin() + page * 2 * PAGESIZE, faceDensities.begin() + (page + 1) * 2 * PAGESIZE, 0.0f);
+	std::fill(prevFaceVelocities.begin() + page * 2 * PAGESIZE, prevFaceVelocities.begin() + (page + 1) * 2 * PAGESIZE, 0.0f);
+	std::fill(faceKnown.begin() + page * 2 * PAGESIZE, faceKnown.begin() + (page + 1) * 2 * PAGESIZE, 0);
+	std::fill(faceKnownNext.begin() + page * 2 * PAGESIZE, faceKnownNext.begin() + (page + 1) * 2 * PAGESIZE, 0);
+	std::fill(advectedFaces.begin() + page * 2 * PAGESIZE, advectedFaces.begin() + (page + 1) * 2 * PAGESIZE, 0.0f);
+
+	// Blocks on the far edge are padded with solid cells past the grid,
+	// which no step visits 
+	int bx = block / blocksPerSide;
+	int by = block % blocksPerSide;
+	for (int slot = 0; slot < PAGESIZE; slot++)
+	{
+		int x = bx * BLOCKSIZE + cellLayout.GetX(slot);
+		int y = by * BLOCKSIZE + cellLayout.GetY(slot);
+		int c = page * PAGESIZE + slot;
+
+		bool isXEdge = (x == 0 || x >= sideLength - 1);
+		bool isYEdge = (y == 0 || y >= sideLength - 1);
+
+		// Check if on an edge 
+		bool isSolid = isXEdge || isYEdge;
+
+		Cell::PushDirections pushDir = Cell::None;
+		if (isSolid)
+		{
+			// Whether to set to push horizontally
+			// or vertically 
+			pushDir = isXEdge ? Cell::XAxis : Cell::YAxis;
+		}
+
+		cells[c] = Cell(x, y, cellSize, isSolid,
+			nullptr, nullptr, nullptr, nullptr,
+			nullptr, nullptr, nullptr, nullptr,
+			nullptr, nullptr, nullptr, nullptr,
+			pushDir);
+
+		cellStarts[c] = 0;
+		cellOccupancy[c] = 0;
+		openFaces[c] = 0;
+		leafSizes[c] = 1;
+		liquidPhi[c] = 1.0f;
+		liquidPhiNext[c] = 1.0f;
+		obstacleCells[c] = x < sideLength && y < sideLength && CellInObstacle(x, y);
+		cellTypes[c] = RestingCellType(c);
+	}
+}
+
+/// <summary>
+/// Put the page of a block back on the free list. Its particle lists are
+/// already empty, since only blocks away from every particle lose their page 
+/// </summary>
+void Fluid::FreePage(unsigned int block)
+{
+	freePages.push_back(blockPages[block]);
+	blockPages[block] = 0;
+}
+
+/// <summary>
+/// Point the cells of a block at their faces. The right and top faces of the
+/// cells on the edge of the block are in the next blocks, so the block is
+/// linked again whenever one of those gets or loses its page 
+/// </summary>
+void Fluid::LinkBlock(unsigned int block)
+{
+	glm::ivec2 min, max;
+	BlockBounds(block, sideLength, sideLength, min, max);
+
+	for (int x = min.x; x < max.x; x++)
+	{
+		for (int y = min.y; y < max.y; y++)
+		{
+			Cell& cell = cells[CellIndex(x, y)];
+
+			// Faces on the border of the grid do not exist 
+			int xLess = x > 0 ? HorizontalFaceIndex(x, y) : -1;
+			int xMore = x + 1 < sideLength ? HorizontalFaceIndex(x + 1, y) : -1;
+			int yLess = y > 0 ? VerticalFaceIndex(x, y) : -1;
+			int yMore = y + 1 < sideLength ? VerticalFaceIndex(x, y + 1) : -1;
+
+			cell.q1 = FaceAt(faceVelocities, xLess);
+			cell.q2 = FaceAt(faceVelocities, xMore);
+			cell.q3 = FaceAt(faceVelocities, yLess);
+			cell.q4 = FaceAt(faceVelocities, yMore);
+
+			cell.r1 = FaceAt(faceWeights, xLess);
+			cell.r2 = FaceAt(faceWeights, xMore);
+			cell.r3 = FaceAt(faceWeights, yLess);
+			cell.r4 = FaceAt(faceWeights, yMore);
+
+			cell.p1 = FaceAt(faceDensities, xLess);
+			cell.p2 = FaceAt(faceDensities, xMore);
+			cell.p3 = FaceAt(faceDensities, yLess);
+			cell.p4 = FaceAt(faceDensities, yMore);
+		}
+	}
+}
+
+/// <summary>
+/// Range of a block in a grid of width by height, max exclusive. The extra
+/// line of faces past the last cell falls in the last column and row 
+/// </summary>
+void Fluid::BlockBounds(unsigned int block, int width, int height, glm::ivec2& min, glm::ivec2& max) const
+{
+	int bx = block / blocksPerSide;
+	int by = block % blocksPerSide;
+
+	min = glm::ivec2(bx, by) * BLOCKSIZE;
+	max = glm::min(min + glm::ivec2(BLOCKSIZE), glm::ivec2(width, height));
+}
+
+/// <summary>
+/// The centre of the cell is inside an obstacle 
+/// </summary>
+bool Fluid::CellInObstacle(int x, int y) const
+{
+	glm::vec2 center = (glm::vec2(x, y) + glm::vec2(0.5f)) * cellSize;
+	return !obstacles.IsEmpty() && obstacles.Sample(center) < 0.0f;
+}
+
+/// <summary>
+/// What a cell is with no particles in it 
+/// </summary>
+unsigned char Fluid::RestingCellType(int cell) const
+{
+	const Cell& current = cells[cell];
+	bool inWall = current.xIndex < wallThickness || current.xIndex >= sideLength - wallThickness ||
+		current.yIndex < wallThickness || current.yIndex >= sideLength - wallThickness;
+
+	return current.isSolid || inWall || obstacleCells[cell] ? SolidCell : AirCell;
+}
+
+/// <summary>
+/// Give the cells of inactive blocks with a page in a range their resting
+/// type. Cells of active blocks are classified every step instead 
+/// </summary>
+void Fluid::RestCells(glm::ivec2 min, glm::ivec2 max)
+{
+	min = glm::max(min, glm::ivec2(0));
+	max = glm::min(max, glm::ivec2(sideLength));
+	if (min.x >= max.x || min.y >= max.y)
+		return;
+
+	for (int bx = min.x / BLOCKSIZE; bx <= (max.x - 1) / BLOCKSIZE; bx++)
+	{
+		for (int by = min.y / BLOCKSIZE; by <= (max.y - 1) / BLOCKSIZE; by++)
+		{
+			unsigned int block = bx * blocksPerSide + by;
+			if (blockSlots[block] >= 0 || blockPages[block] == 0)
+				continue;
+
+			glm::ivec2 blockMin, blockMax;
+			BlockBounds(block, sideLength, sideLength, blockMin, blockMax);
+			blockMin = glm::max(blockMin, min);
+			blockMax = glm::min(blockMax, max);
+
+			for (int x = blockMin.x; x < blockMax.x; x++)
+			{
+				for (int y = blockMin.y; y < blockMax.y; y++)
+				{
+					int cell = CellIndex(x, y);
+					cellTypes[cell] = RestingCellType(cell);
+				}
+			}
+		}
+	}
+}
+
+void Fluid::UpdateCellLists()
+{
+	if (cellListsDirty)
+	{
+		RebuildCellLists();
+	}
+}
+
+/// <summary>
+/// Reorder the particle arrays by the Z-order key of their cell when they
+/// have drifted too far from it, so the transfers walk the grid in order 
+/// </summary>
+void Fluid::SortParticlesIfNeeded()
+{
+	unsigned int count = particles.GetCount();
+	if (count < 2)
+		return;
+
+	UpdateCellLists();
+
+	// Cells are stored page by page in a local order, so their index is the
+	// key. The linear layout uses the Z-order of the coordinates 
+	bool useMorton = cellLayout.GetMode() == GridLayout::Linear;
+	unsigned int keyBits = useMorton ? Morton::BitsFor(sideLength) * 2 : Morton::BitsFor(cells.size());
+
+	// Particles outside the grid sort after every cell 
+	unsigned int outside = 1u << keyBits;
+
+	unsigned int descents = 0;
+	for (unsigned int i = 0; i < count; i++)
+	{
+		int cellIndex = particles.GetCell(i);
+		if (cellIndex < 0)
+		{
+			sortKeys[i] = outside;
+		}
+		else
+		{
+			sortKeys[i] = useMorton ? Morton::Encode(cells[cellIndex].xIndex, cells[cellIndex].yIndex) : cellIndex;
+		}
+		sortOrder[i] = i;
+
+		if (i > 0 && sortKeys[i] < sortKeys[i - 1])
+			descents++;
+	}
+
+	disorder = (float)descents / (count - 1);
+	if (disorder <= sortThreshold)
+		return;
+
+	BeginChange();
+
+	sorter.Sort(sortKeys.data(), sortOrder.data(), count, keyBits + 1);
+	particles.Reorder(sortOrder.data());
+	positionEpoch++;
+
+	// Cells now list the particles as runs of consecutive indices 
+	cellListsDirty = true;
+	sortCount++;
+
+	EndChange();
+}
+
+unsigned int Fluid::SpawnParticles(const glm::vec2* positions, const glm::vec2* velocities, unsigned int count)
+{
+	BeginChange();
+
+	unsigned int spawned = 0;
+	for (unsigned int i = 0; i < count; i++)
+	{
+		// Deep inside an obstacle there is no gradient to push a particle out 
+		if (!obstacles.IsEmpty() && obstacles.Sample(positions[i]) < 0.0f)
+			continue;
+
+		glm::vec2 vel = velocities != nullptr ? velocities[i] : glm::vec2(0);
+		unsigned int particle = particles.Spawn(positions[i], vel);
+		if (particle == ParticlePool::INVALID)
+		{
+			// Pool is full 
+			break;
+		}
+		spawned++;
+	}
+
+	if (spawned > 0)
+	{
+		cellListsDirty = true;
+		positionEpoch++;
+	}
+
+	EndChange();
+	return spawned;
+}
+
+/// <summary>
+/// Take a particle out of its cell in O(1) by moving the last particle of
+/// the cells range into its slot 
+/// </summary>
+void Fluid::RemoveFromCellLists(unsigned int particle)
+{
+	int c = particles.GetCell(particle);
+	if (c < 0)
+		return;
+
+	unsigned int slot = particles.GetCellSlot(particle);
+	unsigned int last = cellStarts[c] + cellOccupancy[c] - 1;
+	unsigned int other = cellParticles[last];
+	cellParticles[slot] = other;
+	particles.SetCellSlot(other, slot);
+
+	cellOccupancy[c]--;
+	cells[c].SetParticles(cellParticles.data() + cellStarts[c], cellOccupancy[c]);
+	particles.SetCell(particle, -1);
+
+	// A sleeping block has lost a particle, so it is no longer settled 
+	if (sleepSteps > 0)
+	{
+		blockParticles[BlockOf(c)]--;
+		WakeBlock(BlockOf(c));
+	}
+}
+
+void Fluid::KillParticle(unsigned int particle)
+{
+	BeginChange();
+
+	// Lists that are already stale get rebuilt anyway 
+	if (!cellListsDirty)
+	{
+		RemoveFromCellLists(particle);
+	}
+
+	// The last particle is moved into this index, so its slot has to point at the new index 
+	unsigned int moved = particles.Kill(particle);
+	if (moved != ParticlePool::INVALID && !cellListsDirty && particles.GetCell(particle) >= 0)
+	{
+		cellParticles[particles.GetCellSlot(particle)] = particle;
+	}
+	positionEpoch++;
+
+	EndChange();
+}
+
+void Fluid::KillParticles(unsigned int* indices, unsigned int count)
+{
+	// Going from the back means no particle still waiting to be removed gets moved 
+	std::sort(indices, indices + count, std::greater<unsigned int>());
+
+	// One change for the whole batch 
+	BeginChange();
+	for (unsigned int i = 0; i < count; i++)
+	{
+		if (i > 0 && indices[i] == indices[i - 1])
+			continue;
+
+		KillParticle(indices[i]);
+	}
+	EndChange();
+}
+
+/// <summary>
+/// Used to make sure that the particle is within the bounds 
+/// of the grid and that there is no overlap for the particles 
+/// </summary>
+/// <param name="particle"></param>
+/// <param name="trueCellSize"></param>
+/// <param name="cellWallThickness"></param>
+void Fluid::CorrectParticlePos(unsigned int particle, float trueCellSize, int cellWallThickness)
+{
+	BeginChange();
+
+	// Keep particle in bounds  
+
+	// Get the size of the grid. Don't correct based on collision cells but just if it goes out of range
+	// on each axis
+
+	float axisLimt = (sideLength - cellWallThickness) * trueCellSize;
+	float axisMin = cellWallThickness * trueCellSize;
+
+	ClampToDomain(particles.Position(particle), particles.Velocity(particle), axisMin, axisLimt);
+	positionEpoch++;
+
+	EndChange();
+}
+
+/// <summary>
+/// Bounce a particle off the walls of the domain. Only touches the given
+/// particle, so it is safe to call from parallel loops 
+/// </summary>
+void Fluid::ClampToDomain(glm::vec2& pos, glm::vec2& vel, float axisMin, float axisLimt) const
+{
+	// The following checks have "magic numbers" used to help reduce the speeding up of diagonal
+	// particles. This occurs because at the bottom particles can speed really fast after meeting
+	// with their friends and then reflect in the opposite direction. This keeps happening which 
+	// eventually causes the particles to speed wayyyyy too fast. A better solution would probably
+	// be conserving momentum. 
+
+	// X Check
+	if (pos.x <= axisMin)
+	{
+		pos = glm::vec2(axisMin + particleHalfSize, pos.y);
+		vel = glm::vec2(-vel.x / 2.0f, vel.y / 2.0f);
+	}
+	else if (pos.x >= axisLimt)
+	{
+		pos = glm::vec2(axisLimt - particleHalfSize, pos.y);
+		vel = glm::vec2(-vel.x / 2.0f, vel.y / 2.0f);
+	}
+
+	// Y Check
+	if (pos.y <= axisMin)
+	{
+		pos = glm::vec2(pos.x, axisMin + particleHalfSize);
+		vel = glm::vec2(vel.x / 2.0f, -vel.y / 4.0f);
+	}
+	else if (pos.y >= axisLimt)
+	{
+		pos = glm::vec2(pos.x, axisLimt - particleHalfSize);
+		vel = glm::vec2(vel.x / 2.0f, -vel.y / 4.0f);
+	}
+
+	// Obstacles cost one lookup whatever their shape 
+	if (obstacles.IsEmpty())
+		return;
+
+	float distance = obstacles.Sample(pos);
+	if (distance >= particleHalfSize)
+		return;
+
+	glm::vec2 normal = obstacles.Gradient(pos);
+	float length = glm::length(normal);
+	if (length <= 0.0f)
+		return;
+	normal /= length;
+
+	// Push out to the surface and bounce off at half speed like the walls 
+	pos += normal * (particleHalfSize - distance);
+	float into = glm::dot(vel, normal);
+	if (into < 0.0f)
+	{
+		vel -= normal * (into * 1.5f);
+	}
+}
+
+/// <summary>
+/// Push a particle inside the mouse radius out to its edge 
+/// </summary>
+static void PushOutOfRadius(glm::vec2& pos, glm::vec2& vel, glm::vec2 mouse, float radius)
+{
+	glm::vec2 dir = pos - mouse;
+	dir /= glm::length(dir);
+
+	pos = mouse + (dir * radius);
+	vel = glm::vec2(-vel.x / 2.0f, vel.y);
+}
+
+/// <summary>
+/// Every per particle step of SimulateParticles in one parallel pass: forces,
+/// advection, walls, the mouse and the cell the particle ends up in. Each
+/// particle is loaded and stored once 
+/// </summary>
+void Fluid::UpdateParticlesFused(float timeStep, int cellWallThickness, glm::vec2 mouse, float radius, bool pushFromMouse)
+{
+	float axisLimt = (sideLength - cellWallThickness) * cellSize;
+	float axisMin = cellWallThickness * cellSize;
+	glm::vec2 gravityStep = glm::vec2(0.0f, 1.0f) * gravity * timeStep;
+	float radiusSq = radius * radius;
+
+	Parallel::For(0, particles.GetCount(), 1024, [&](int begin, int end)
+	{
+		glm::vec2 moved[ADVECTIONBLOCK];
+		for (int i = begin; i < end; i++)
+		{
+			// Runge-Kutta positions are worked out a block ahead of the rest 
+			int block = (i - begin) % ADVECTIONBLOCK;
+			if (advectionMode != EulerAdvection && block == 0)
+			{
+				AdvectBlock(i, glm::min(i + ADVECTIONBLOCK, end), timeStep, gravityStep, moved);
+			}
+
+			// Sleeping particles keep their cell from the last rebuild 
+			if (ParticleAsleep(i))
+				continue;
+
+			glm::vec2 pos = particles.Position(i);
+			glm::vec2 vel = particles.Velocity(i) + gravityStep;
+
+			if (advectionMode == EulerAdvection)
+			{
+				pos += vel * timeStep;
+				ClampToDomain(pos, vel, axisMin, axisLimt);
+			}
+			else
+			{
+				// The grid keeps particles off the walls, so the bounce their own
+				// velocity would have hit is applied to the velocity alone 
+				glm::vec2 probe = pos + vel * timeStep;
+				ClampToDomain(probe, vel, axisMin, axisLimt);
+
+				glm::vec2 unused = vel;
+				pos = moved[block];
+				ClampToDomain(pos, unused, axisMin, axisLimt);
+			}
+
+			if (pushFromMouse)
+			{
+				glm::vec2 offset = pos - mouse;
+				if (glm::dot(offset, offset) < radiusSq)
+				{
+					PushOutOfRadius(pos, vel, mouse, radius);
+				}
+			}
+
+			int cellIndex = PosToCellIndex(pos);
+			if (cellIndex < 0)
+			{
+				// Particle might have been pushed out by user 
+				vel = glm::vec2(0);
+			}
+
+			particles.Position(i) = pos;
+			particles.Velocity(i) = vel;
+			particles.SetCell(i, cellIndex);
+		}
+	});
+}
+
+/// <summary>
+/// Move the particles based on their velocity
+/// Also makes sure that particles stay within bounds 
+/// </summary>
+void Fluid::SimulateParticles(float timeStep, int maxParticleChecks, int cellWallThickness, glm::vec3 mousePos, const float& MOUSERADIUS, int paintMode)
+{
+	BeginChange();
+
+	// Cells of inactive blocks only see the walls move through RestCells 
+	if (wallThickness != cellWallThickness)
+	{
+		wallThickness = cellWallThickness;
+		RestCells(glm::ivec2(0), glm::ivec2(sideLength));
+		WakeAll();
+	}
+
+	// Spawning and removing while painting is done by the brush emitters 
+	glm::vec2 mouse = glm::vec2(mousePos);
+	bool pushFromMouse = paintMode < 0 || paintMode > 2;
+
+	// Pushing wakes the blocks under the mouse. Painting changes particle
+	// counts instead, which wakes blocks by itself 
+	if (pushFromMouse && sleepingBlockCount > 0)
+	{
+		WakeRegion(mouse - glm::vec2(MOUSERADIUS), mouse + glm::vec2(MOUSERADIUS));
+	}
+
+	// Nothing can move while everything sleeps 
+	if (AllAsleep())
+	{
+		// Particles spawned by hand still have to show up in the views 
+		UpdateCellLists();
+		EndChange();
+		return;
+	}
+
+	// Advection, clamping and separation below all move particles 
+	positionEpoch++;
+
+	if (fuseParticleUpdate)
+	{
+		UpdateParticlesFused(timeStep, cellWallThickness, mouse, MOUSERADIUS, pushFromMouse);
+
+		// Cells were already worked out by the fused pass 
+		RebuildCellLists(true);
+	}
+	else
+	{
+		// Separate passes, kept for debugging the fused one 
+		for (unsigned int i = 0; i < particles.GetCount(); i++)
+		{
+			if (ParticleAsleep(i))
+				continue;
+
+			glm::vec2& pos = particles.Position(i);
+			glm::vec2& vel = particles.Velocity(i);
+		
+			vel += glm::vec2(0.0f, 1.0f) * gravity * timeStep;
+
+			// Change pos and make correction if necessary 
+			if (advectionMode == EulerAdvection)
+			{
+				pos += vel * timeStep;
+				CorrectParticlePos(i, cellSize, cellWallThickness);
+			}
+			else
+			{
+				float axisLimt = (sideLength - cellWallThickness) * cellSize;
+				float axisMin = cellWallThickness * cellSize;
+				glm::vec2 probe = pos + vel * timeStep;
+				ClampToDomain(probe, vel, axisMin, axisLimt);
+
+				glm::vec2 unused = vel;
+				AdvectBlock(i, i + 1, timeStep, glm::vec2(0.0f), &pos);
+				ClampToDomain(pos, unused, axisMin, axisLimt);
+			}
+
+			// Keep out of mouse radius 
+			if (glm::distance(pos, mouse) < MOUSERADIUS)
+			{
+				switch (paintMode)
+				{
+				case 0: // Nothgin
+					break;
+				case 1: // Spawn Particles 
+					break;
+				case 2: // Remove Particles 
+					break;
+				default: // Seperate from cursor 
+					PushOutOfRadius(pos, vel, mouse, MOUSERADIUS);
+					break;
+				}
+			}
+		}
+
+		// Particle update parent 
+		RebuildCellLists();
+	}
+
+	if (resampleInterval > 0 && ++stepsSinceResample >= resampleInterval)
+	{
+		stepsSinceResample = 0;
+		ResampleParticles();
+		UpdateCellLists();
+	}
+
+	// I know the below code is horrifying to look at but having it split with
+	// multiple cells helps optimize it like a quad tree 
+
+	// GO THROUGH EACH CELL AND SEPERATE PARTICLES. Cells of blocks without
+	// particles have nothing to separate 
+	for (unsigned c = 0; c < maxParticleChecks; c++)
+	{
+		ForOccupiedCells([&](int i)
+		{
+			Cell* cell = &cells[i];
+
+			if (cell == nullptr || CellAsleep(i))
+			{
+				// Cell does not exist or sleeps 
+				return;
+			}
+
+			int particleCount = cell->GetParticleCount();
+			for (unsigned int a = 0; a < particleCount; a++)
+			{
+				unsigned int childA = cell->GetParticle(a);
+
+				// Safety 
+				if (childA >= particles.GetCount())
+					continue;
+
+				glm::vec2& posA = particles.Position(childA);
+
+				for (unsigned int b = 0; b < particleCount; b++)
+				{
+					unsigned int childB = cell->GetParticle(b);
+
+					// Safety 
+					if (childB >= particles.GetCount() || childA == childB)
+						continue;
+
+					glm::vec2& posB = particles.Position(childB);
+
+					// Find center and split both particles
+					// an equal distance away from it 
+
+					glm::vec2 center = (posA + posB) / 2.0f;
+					glm::vec2 dir = (posA - center);
+					float length = glm::length(dir);
+					
+					if (length > 2.5f)
+					{
+						continue;
+					}
+
+					if (length == 0)
+					{
+						dir = glm::vec2(((double)rand() / (RAND_MAX)), ((double)rand() / (RAND_MAX)));
+						length = glm::length(dir);
+					}
+					dir /= length;
+
+					// Apply change 
+					if (posA.y > posB.y)
+					{
+						posA += glm::vec2(0, 2.5f);
+						posB -= glm::vec2(0, 2.5f);
+					}
+					else
+					{
+						posA -= glm::vec2(0, 2.5f);
+						posB += glm::vec2(0, 2.5f);
+					}
+					
+					break;
+				}
+			}
+		});
+	}
+
+	// Separation moved particles after the lists were built. Rebuilt here
+	// rather than on first read, so the grid views never have to write 
+	RebuildCellLists();
+
+	EndChange();
+}
+
+
+void Fluid::SetResampling(int interval, int minPerCell, int maxPerCell)
+{
+	resampleInterval = glm::max(interval, 0);
+	resampleMax = glm::max(maxPerCell, 1);
+	resampleMin = glm::clamp(minPerCell, 0, resampleMax);
+}
+
+/// <summary>
+/// Keep the particles per cell between the resample limits. Extra particles
+/// in a full cell are merged into the ones that stay, weighted by mass so
+/// momentum is kept. Fluid cells with too few particles, empty ones
+/// included, are seeded up to the minimum with the grid velocity. Cells
+/// next to air are left alone since the surface is allowed to thin out.
+/// No allocation 
+/// </summary>
+void Fluid::ResampleParticles()
+{
+	BeginChange();
+	UpdateCellLists();
+
+	unsigned int killCount = 0;
+	unsigned int seedCount = 0;
+
+	ForOccupiedCells([&](int c)
+	{
+		const unsigned int* list = cellParticles.data() + cellStarts[c];
+		int count = cellOccupancy[c];
+
+		if (count > resampleMax)
+		{
+			// Fold every particle past the limit into one that stays 
+			for (int j = resampleMax; j < count; j++)
+			{
+				unsigned int keep = list[j % resampleMax];
+				unsigned int merge = list[j];
+
+				float keepMass = particles.Mass(keep);
+				float mergeMass = particles.Mass(merge);
+				float mass = keepMass + mergeMass;
+
+				particles.Position(keep) = (particles.Position(keep) * keepMass + particles.Position(merge) * mergeMass) / mass;
+				particles.Velocity(keep) = (particles.Velocity(keep) * keepMass + particles.Velocity(merge) * mergeMass) / mass;
+				particles.Affine(keep) = (particles.Affine(keep) * keepMass + particles.Affine(merge) * mergeMass) * (1.0f / mass);
+				particles.Mass(keep) = mass;
+
+				killList[killCount++] = merge;
+			}
+		}
+	});
+
+	// Fluid cells are only listed in the active cells, occupied or not. Cells
+	// below the narrow band are meant to have no particles 
+	float cutoff = -(float)narrowBand - 0.5f;
+	for (unsigned int a = 0; a < activeCellCount && !particles.IsFull(); a++)
+	{
+		int c = activeCells[a];
+		int count = cellOccupancy[c];
+		if (count >= resampleMin || CellAsleep(c) || (narrowBand > 0 && liquidPhi[c] < cutoff))
+			continue;
+
+		const Cell& cell = cells[c];
+		if (TouchesAir(cell.xIndex, cell.yIndex))
+			continue;
+
+		seedCount += SeedCell(c, resampleMin - count);
+	}
+
+	// Seeding only appended, so the indices collected above are still good 
+	if (killCount > 0)
+	{
+		KillParticles(killList.data(), killCount);
+	}
+
+	resampleMerges = killCount;
+	resampleSeeds = seedCount;
+
+	// Merges move the particle that stays 
+	if (killCount > 0)
+	{
+		positionEpoch++;
+	}
+
+	// Kills fix the lists up as they go, merged particles stay in their cell 
+	if (seedCount > 0)
+	{
+		cellListsDirty = true;
+	}
+
+	EndChange();
+}
+
+/// <summary>
+/// Mark every cell of the active blocks as solid (the domain walls), fluid
+/// (holds particles or is inside the narrow band level set) or air, and pack the fluid cells into the active list.
+/// Faces between fluid and solid are walls and are left out of openFaces,
+/// CloseSolidFaces zeroes them 
+/// </summary>
+void Fluid::ClassifyCells()
+{
+	UpdateCellLists();
+
+	// Cells of inactive blocks hold no fluid and keep their resting type 
+	activeCellCount = 0;
+	for (unsigned int a = 0; a < activeBlockCount; a++)
+	{
+		glm::ivec2 min, max;
+		BlockBounds(activeBlocks[a], sideLength, sideLength, min, max);
+
+		for (int x = min.x; x < max.x; x++)
+		{
+			for (int y = min.y; y < max.y; y++)
+			{
+				int c = CellIndex(x, y);
+				cellTypes[c] = RestingCellType(c);
+
+				// In narrow band mode the deep interior is liquid by its level
+				// set alone, with no particles to give it a density 
+				bool liquid = cellOccupancy[c] > 0;
+				if (narrowBand > 0 && !liquid && liquidPhi[c] < INTERIORPHI)
+				{
+					liquid = true;
+					cells[c].averageP = 0.0f;
+				}
+
+				if (cellTypes[c] == AirCell && liquid)
+				{
+					cellTypes[c] = FluidCell;
+					activeCells[activeCellCount++] = c;
+				}
+			}
+		}
+	}
+
+	for (unsigned int a = 0; a < activeCellCount; a++)
+	{
+		Cell& cell = cells[activeCells[a]];
+		float* faces[4] = { cell.q1, cell.q2, cell.q3, cell.q4 };
+		int neighbours[4][2] = {
+			{ cell.xIndex - 1, cell.yIndex },
+			{ cell.xIndex + 1, cell.yIndex },
+			{ cell.xIndex, cell.yIndex - 1 },
+			{ cell.xIndex, cell.yIndex + 1 } };
+
+		unsigned char open = 0;
+		for (int f = 0; f < 4; f++)
+		{
+			// Faces only exist where there is a neighbour 
+			if (faces[f] == nullptr)
+				continue;
+
+			if (cellTypes[CellIndex(neighbours[f][0], neighbours[f][1])] != SolidCell)
+			{
+				open |= 1 << f;
+			}
+		}
+		openFaces[activeCells[a]] = open;
+	}
+}
+
+/// <summary>
+/// Stop the flow through every face between a fluid cell and a solid one,
+/// the faces ClassifyCells left out of openFaces 
+/// </summary>
+void Fluid::CloseSolidFaces()
+{
+	for (unsigned int a = 0; a < activeCellCount; a++)
+	{
+		Cell& cell = cells[activeCells[a]];
+		float* faces[4] = { cell.q1, cell.q2, cell.q3, cell.q4 };
+		unsigned char open = openFaces[activeCells[a]];
+
+		for (int f = 0; f < 4; f++)
+		{
+			if (faces[f] != nullptr && !(open & (1 << f)))
+			{
+				*faces[f] = 0.0f;
+			}
+		}
+	}
+}
+
+/// <summary>
+/// Carry the velocities of the faces around fluid cells out into the air a
+/// layer at a time. Every unknown face next to a known one takes the average
+/// of its known neighbours, so each layer only reads the layers before it 
+/// </summary>
+void Fluid::ExtrapolateVelocities()
+{
+	if (extrapolationLayers <= 0)
+		return;
+
+	ForActiveFaces([&](int face, int, int, bool)
+	{
+		faceKnown[face] = 0;
+	});
+	for (unsigned int a = 0; a < activeCellCount; a++)
+	{
+		const Cell& cell = cells[activeCells[a]];
+		const float* faces[4] = { cell.q1, cell.q2, cell.q3, cell.q4 };
+		for (int f = 0; f < 4; f++)
+		{
+			if (faces[f] != nullptr)
+			{
+				faceKnown[faces[f] - faceVelocities.data()] = 1;
+			}
+		}
+	}
+
+	for (int layer = 0; layer < extrapolationLayers; layer++)
+	{
+		ForActiveFaces([&](int face, int, int, bool)
+		{
+			faceKnownNext[face] = faceKnown[face];
+		});
+		ForActiveFaces([&](int face, int x, int y, bool horizontal)
+		{
+			ExtrapolateFace(face, x, y, horizontal);
+		});
+		faceKnown.swap(faceKnownNext);
+	}
+}
+
+/// <summary>
+/// One face of one layer. Faces on the border of the grid do not exist and
+/// are skipped. Only reads faces known before the layer, so faces can be
+/// done in any order 
+/// </summary>
+void Fluid::ExtrapolateFace(int face, int x, int y, bool horizontal)
+{
+	int width = horizontal ? sideLength + 1 : sideLength;
+	int height = horizontal ? sideLength : sideLength + 1;
+
+	if (horizontal ? (x == 0 || x == width - 1) : (y == 0 || y == height - 1))
+		return;
+
+	if (faceKnown[face])
+		return;
+
+	int neighbours[4][2] = { { x - 1, y }, { x + 1, y }, { x, y - 1 }, { x, y + 1 } };
+	float sum = 0.0f;
+	int count = 0;
+	for (int n = 0; n < 4; n++)
+	{
+		int nx = neighbours[n][0];
+		int ny = neighbours[n][1];
+		if (nx < 0 || ny < 0 || nx >= width || ny >= height)
+			continue;
+
+		int neighbour = horizontal ? HorizontalFaceIndex(nx, ny) : VerticalFaceIndex(nx, ny);
+		if (faceKnown[neighbour])
+		{
+			sum += faceVelocities[neighbour];
+			count++;
+		}
+	}
+
+	if (count > 0)
+	{
+		faceVelocities[face] = sum / count;
+		faceKnownNext[face] = 1;
+	}
+}
+
+/// <summary>
+/// Work out the cell and face weights of every particle for both transfers.
+/// Tagged with the current position epoch, so anything that moves particles
+/// afterwards makes them stale 
+/// </summary>
+void Fluid::ComputeStencils()
+{
+	stencilEpoch = positionEpoch;
+	stencilCount = particles.GetCount();
+	stencilMode = transferMode;
+
+	if (transferMode == Apic)
+	{
+		Parallel::For(0, particles.GetCount(), 1024, [&](int begin, int end)
+		{
+			for (int i = begin; i < end; i++)
+			{
+				StaggeredStencil& stencil = staggeredStencils[i];
+				glm::vec2 lattice = particles.Position(i) / cellSize;
+
+				// Sleeping particles are left out of both transfers 
+				stencil.cell = ParticleAsleep(i) ? -1 : PosToCellIndex(particles.Position(i));
+				if (stencil.cell < 0)
+					continue;
+
+				// Horizontal faces sit half a cell up from the cell corners,
+				// vertical faces half a cell to the right 
+				FillStaggeredAxis(lattice - glm::vec2(0.0f, 0.5f), true, stencil.xFaces, stencil.xFraction);
+				FillStaggeredAxis(lattice - glm::vec2(0.5f, 0.0f), false, stencil.yFaces, stencil.yFraction);
+			}
+		});
+		return;
+	}
+
+	Parallel::For(0, particles.GetCount(), 1024, [&](int begin, int end)
+	{
+		for (int i = begin; i < end; i++)
+		{
+			TransferStencil& stencil = stencils[i];
+			glm::vec2 particlePos = particles.Position(i) - glm::vec2(0.0f, cellSize / 2.0f);
+
+			// Get the index of cell this particle is in 
+			int xCell = particlePos.x / cellSize;
+			int yCell = particlePos.y / cellSize;
+
+			if (xCell < 0 || yCell < 0 || xCell >= sideLength || yCell >= sideLength || ParticleAsleep(i))
+			{
+				stencil.cell = -1;
+				continue;
+			}
+			stencil.cell = CellIndex(xCell, yCell);
+
+			// Change in distance to cell 
+			float deltaX = glm::abs(xCell * cellSize - particlePos.x) / cellSize;
+			float deltaY = glm::abs(yCell * cellSize - particlePos.y) / cellSize;
+
+			// Weights relative to each side 
+			stencil.weights[0] = (1.0f - deltaX) * (1.0f - deltaY);
+			stencil.weights[1] = deltaX * (1.0f - deltaY);
+			stencil.weights[2] = deltaX * deltaY;
+			stencil.weights[3] = (1.0f - deltaX) * deltaY;
+		}
+	});
+}
+
+/// <summary>
+/// Find the four faces of one velocity component around a point and where
+/// the point sits between them 
+/// </summary>
+/// <param name="lattice">Position in units of cells relative to the first face</param>
+/// <param name="horizontal">Faces crossed by x velocity, otherwise y velocity</param>
+void Fluid::FillStaggeredAxis(glm::vec2 lattice, bool horizontal, int* faces, glm::vec2& fraction) const
+{
+	int width = horizontal ? sideLength + 1 : sideLength;
+	int height = horizontal ? sideLength : sideLength + 1;
+
+	int x = glm::clamp((int)glm::floor(lattice.x), 0, width - 2);
+	int y = glm::clamp((int)glm::floor(lattice.y), 0, height - 2);
+	fraction = glm::clamp(lattice - glm::vec2(x, y), glm::vec2(0.0f), glm::vec2(1.0f));
+
+	for (int k = 0; k < 4; k++)
+	{
+		int faceX = x + (k & 1);
+		int faceY = y + (k >> 1);
+
+		if (horizontal)
+		{
+			faces[k] = faceX > 0 && faceX < sideLength ? HorizontalFaceIndex(faceX, faceY) : -1;
+		}
+		else
+		{
+			faces[k] = faceY > 0 && faceY < sideLength ? VerticalFaceIndex(faceX, faceY) : -1;
+		}
+	}
+}
+
+/// <summary>
+/// Bilinear weights of the corners of a stencil 
+/// </summary>
+static void CornerWeights(glm::vec2 f, float* weights)
+{
+	weights[0] = (1.0f - f.x) * (1.0f - f.y);
+	weights[1] = f.x * (1.0f - f.y);
+	weights[2] = (1.0f - f.x) * f.y;
+	weights[3] = f.x * f.y;
+}
+
+/// <summary>
+/// Gradients of the corner weights, per cell rather than per pixel 
+/// </summary>
+static void CornerGradients(glm::vec2 f, glm::vec2* gradients)
+{
+	gradients[0] = glm::vec2(-(1.0f - f.y), -(1.0f - f.x));
+	gradients[1] = glm::vec2(1.0f - f.y, -f.x);
+	gradients[2] = glm::vec2(-f.y, 1.0f - f.x);
+	gradients[3] = glm::vec2(f.y, f.x);
+}
+
+/// <summary>
+/// Bilinear grid velocity at a point, each component from its own faces.
+/// Faces the extrapolation did not reach are left out and a component with
+/// none at all takes the fallback 
+/// </summary>
+glm::vec2 Fluid::SampleGridVelocity(glm::vec2 pos, glm::vec2 fallback) const
+{
+	glm::vec2 lattice = pos / cellSize;
+	glm::vec2 vel = fallback;
+
+	for (int axis = 0; axis < 2; axis++)
+	{
+		int faces[4];
+		glm::vec2 fraction;
+		float weights[4];
+		FillStaggeredAxis(lattice - (axis == 0 ? glm::vec2(0.0f, 0.5f) : glm::vec2(0.5f, 0.0f)), axis == 0, faces, fraction);
+		CornerWeights(fraction, weights);
+
+		float weightSum = 0.0f;
+		float sampled = 0.0f;
+		for (int k = 0; k < 4; k++)
+		{
+			// Border faces are walls, so they count as standing still 
+			int face = faces[k];
+			if (face >= 0)
+			{
+				if (extrapolationLayers > 0 && !faceKnown[face])
+					continue;
+				sampled += weights[k] * faceVelocities[face];
+			}
+			weightSum += weights[k];
+		}
+
+		if (weightSum > 0.0f)
+		{
+			vel[axis] = sampled / weightSum;
+		}
+	}
+
+	return vel;
+}
+
+/// <summary>
+/// Integrate the positions of a block of particles through the grid velocity
+/// with midpoint RK2 or Ralston's RK3. Each stage is a gather from the grid
+/// followed by loops over plain float arrays, which the compiler vectorises 
+/// </summary>
+/// <param name="end">At most ADVECTIONBLOCK past begin</param>
+/// <param name="gravityStep">Added to the particle velocities used as the fallback</param>
+/// <param name="moved">New position of every particle in the block</param>
+void Fluid::AdvectBlock(int begin, int end, float timeStep, glm::vec2 gravityStep, glm::vec2* moved) const
+{
+	// Where each stage samples along the previous one and its share of the result 
+	static const float RK2OFFSETS[2] = { 0.0f, 0.5f };
+	static const float RK2WEIGHTS[2] = { 0.0f, 1.0f };
+	static const float RK3OFFSETS[3] = { 0.0f, 0.5f, 0.75f };
+	static const float RK3WEIGHTS[3] = { 2.0f / 9.0f, 3.0f / 9.0f, 4.0f / 9.0f };
+
+	int stages = advectionMode == Rk3Advection ? 3 : 2;
+	const float* offsets = advectionMode == Rk3Advection ? RK3OFFSETS : RK2OFFSETS;
+	const float* stageWeights = advectionMode == Rk3Advection ? RK3WEIGHTS : RK2WEIGHTS;
+
+	int count = end - begin;
+	float startX[ADVECTIONBLOCK], startY[ADVECTIONBLOCK];
+	float sampleX[ADVECTIONBLOCK], sampleY[ADVECTIONBLOCK];
+	float slopeX[ADVECTIONBLOCK], slopeY[ADVECTIONBLOCK];
+	float sumX[ADVECTIONBLOCK], sumY[ADVECTIONBLOCK];
+
+	for (int i = 0; i < count; i++)
+	{
+		startX[i] = particles.Position(begin + i).x;
+		startY[i] = particles.Position(begin + i).y;
+		sumX[i] = 0.0f;
+		sumY[i] = 0.0f;
+	}
+
+	for (int s = 0; s < stages; s++)
+	{
+		float reach = offsets[s] * timeStep;
+		for (int i = 0; i < count; i++)
+		{
+			sampleX[i] = s == 0 ? startX[i] : startX[i] + reach * slopeX[i];
+			sampleY[i] = s == 0 ? startY[i] : startY[i] + reach * slopeY[i];
+		}
+
+		for (int i = 0; i < count; i++)
+		{
+			glm::vec2 vel = SampleGridVelocity(glm::vec2(sampleX[i], sampleY[i]), particles.Velocity(begin + i) + gravityStep);
+			slopeX[i] = vel.x;
+			slopeY[i] = vel.y;
+		}
+
+		float weight = stageWeights[s];
+		for (int i = 0; i < count; i++)
+		{
+			sumX[i] += weight * slopeX[i];
+			sumY[i] += weight * slopeY[i];
+		}
+	}
+
+	for (int i = 0; i < count; i++)
+	{
+		moved[i] = glm::vec2(startX[i] + sumX[i] * timeStep, startY[i] + sumY[i] * timeStep);
+	}
+}
+
+/// <summary>
+/// Apply the particle velocities to the grid 
+/// </summary>
+void Fluid::TransferToVelField()
+{
+	// Reset the faces of the active blocks, the rest are already zero 
+	ForActiveFaces([&](int face, int, int, bool)
+	{
+		faceVelocities[face] = 0.0f;
+		faceWeights[face] = 0.0f;
+		faceDensities[face] = 0.0f;
+	});
+
+	ComputeStencils();
+
+	if (transferMode == Apic)
+	{
+		TransferToVelFieldAffine();
+	}
+	else
+	{
+		// Calculate new q values of each cell
+		for (unsigned int i = 0; i < particles.GetCount(); i++)
+		{
+			const TransferStencil& stencil = stencils[i];
+			if (stencil.cell < 0)
+			{
+				continue;
+			}
+
+			const glm::vec2& vel = particles.Velocity(i);
+			Cell& cell = cells[stencil.cell];
+
+			// Heavier particles count for more on the grid 
+			float mass = particles.Mass(i);
+			float w1 = stencil.weights[0] * mass;
+			float w2 = stencil.weights[1] * mass;
+			float w3 = stencil.weights[2] * mass;
+			float w4 = stencil.weights[3] * mass;
+
+			float pSum = 0.0f;
+			int pCount = 0;
+
+			// Apply velocities to the next grid 
+			if (cell.q1 != nullptr)
+			{
+				*cell.q1 += w1 * vel.x;
+				*cell.r1 += w1;
+				*cell.p1 += w1;
+
+				pSum += w1;
+				pCount++;
+			}
+			if (cell.q2 != nullptr)
+			{
+				*cell.q2 += w2 * vel.x;
+				*cell.r2 += w2;
+				*cell.p2 += w2;
+
+				pSum += w2;
+				pCount++;
+			}
+			if (cell.q3 != nullptr)
+			{
+				*cell.q3 += w3 * vel.y;
+				*cell.r3 += w3;
+				*cell.p3 += w3;
+
+				pSum += w3;
+				pCount++;
+			}
+			if (cell.q4 != nullptr)
+			{
+				*cell.q4 += w4 * vel.y;
+				*cell.r4 += w4;
+				*cell.p4 += w4;
+
+				pSum += w4;
+				pCount++;
+			}
+
+			if (pCount > 0)
+			{
+				cell.averageP = pSum / pCount;
+			}
+		}
+	}
+
+	// Every face gets the weighted average of what was splatted onto it 
+	ForActiveFaces([&](int face, int, int, bool)
+	{
+		if (glm::abs(faceWeights[face]) > 0.0f)
+			faceVelocities[face] /= faceWeights[face];
+	});
+}
+
+/// <summary>
+/// Splat the particle velocities onto the faces of their own component, each
+/// shifted by the particles affine velocity to where the face is 
+/// </summary>
+void Fluid::TransferToVelFieldAffine()
+{
+	for (unsigned int i = 0; i < particles.GetCount(); i++)
+	{
+		const StaggeredStencil& stencil = staggeredStencils[i];
+		if (stencil.cell < 0)
+			continue;
+
+		const glm::vec2& vel = particles.Velocity(i);
+		const glm::mat2& affine = particles.Affine(i);
+		float mass = particles.Mass(i);
+
+		float pSum = 0.0f;
+		int pCount = 0;
+
+		for (int axis = 0; axis < 2; axis++)
+		{
+			const int* faces = axis == 0 ? stencil.xFaces : stencil.yFaces;
+			glm::vec2 fraction = axis == 0 ? stencil.xFraction : stencil.yFraction;
+
+			float weights[4];
+			CornerWeights(fraction, weights);
+
+			for (int k = 0; k < 4; k++)
+			{
+				int face = faces[k];
+				if (face < 0)
+					continue;
+
+				// From the particle to the face in pixels 
+				glm::vec2 offset = (glm::vec2(k & 1, k >> 1) - fraction) * cellSize;
+				float value = vel[axis] + (affine * offset)[axis];
+
+				float weight = weights[k] * mass;
+				faceVelocities[face] += weight * value;
+				faceWeights[face] += weight;
+				faceDensities[face] += weight;
+
+				pSum += weight;
+				pCount++;
+			}
+		}
+
+		if (pCount > 0)
+		{
+			cells[stencil.cell].averageP = pSum / pCount;
+		}
+	}
+}
+
+/// <summary>
+/// Make the grid have an equal amout of fluid inflow and outflow. With the
+/// quadtree on every leaf is one unknown, so deep fluid costs a fraction of
+/// the cells it covers 
+/// </summary>
+void Fluid::MakeIncompressible(int iterations, float overrelaxation, float densityMultipier)
+{
+	overrelaxation = glm::clamp(overrelaxation, 1.0f, 2.0f);
+
+	for (unsigned int i = 0; i < iterations; i++)
+	{
+		// Air and solid cells have nothing to solve 
+		if (maxLeafSize <= 1)
+		{
+			for (unsigned int a = 0; a < activeCellCount; a++)
+			{
+				if (!CellAsleep(activeCells[a]))
+				{
+					SolveCell(activeCells[a], overrelaxation, densityMultipier);
+				}
+			}
+			continue;
+		}
+
+		for (unsigned int l = 0; l < quadLeafCount; l++)
+		{
+			// Leaves never cross a block, so a leaf sleeps with its cell 
+			const QuadLeaf& leaf = quadLeaves[l];
+			if (CellAsleep(leaf.cell))
+			{
+				continue;
+			}
+			else if (leaf.graded)
+			{
+				SolveLeaf(leaf, overrelaxation, densityMultipier);
+			}
+			else
+			{
+				SolveCell(leaf.cell, overrelaxation, densityMultipier);
+			}
+		}
+	}
+
+	for (unsigned int l = 0; l < quadLeafCount; l++)
+	{
+		if (quadLeaves[l].size > 1 && !CellAsleep(quadLeaves[l].cell))
+		{
+			FillLeafInterior(quadLeaves[l]);
+		}
+	}
+}
+
+/// <summary>
+/// One Gauss-Seidel update of a single cell with fine neighbours 
+/// </summary>
+void Fluid::SolveCell(unsigned int c, float overrelaxation, float densityMultipier)
+{
+	Cell& cell = cells[c];
+	unsigned char open = openFaces[c];
+	float divergence = 0.0f; // Used to make incompressible by "spreading" out values 
+	float s = 0.0f; // Accomodate for solid cells 
+
+	float p = 0.0f; // Demsityl 
+
+	// Divergence and s value calculations 
+	if (open & 1)
+	{
+		divergence += *cell.q1;
+		s += 1;
+
+		p += *cell.p1;
+	}
+
+	if (open & 2)
+	{
+		divergence -= *cell.q2;
+		s += 1;
+
+		p -= *cell.p2;
+	}
+
+	if (open & 4)
+	{
+		divergence += *cell.q3;
+		s += 1;
+
+		p += *cell.p3;
+	}
+
+	if (open & 8)
+	{
+		divergence -= *cell.q4;
+		s += 1;
+
+		p -= *cell.p4;
+	}
+
+	if (s == 0.0f)
+		return;
+
+	divergence *= overrelaxation;
+	divergence -= densityMultipier * (p - cell.averageP);
+
+	// Apply incompressibility 
+	if (open & 1)
+	{
+		*cell.q1 -= divergence / s;
+	}
+
+	if (open & 2)
+	{
+		*cell.q2 += divergence / s;
+	}
+
+	if (open & 4)
+	{
+		*cell.q3 -= divergence / s;
+	}
+
+	if (open & 8)
+	{
+		*cell.q4 += divergence / s;
+	}
+}
+
+/// <summary>
+/// One Gauss-Seidel update of a leaf with the finite volume weights of a
+/// graded grid. Each perimeter face is one fine face, weighted by one over
+/// the distance between the centres of the leaves either side, so a leaf
+/// of one cell between leaves of one cell matches SolveCell 
+/// </summary>
+void Fluid::SolveLeaf(const QuadLeaf& leaf, float overrelaxation, float densityMultipier)
+{
+	int faces[4 * BLOCKSIZE];
+	float weights[4 * BLOCKSIZE];
+	int count = 0;
+
+	float flux = 0.0f;
+	float s = 0.0f;
+	float p = 0.0f;
+
+	// Left, right, bottom, top. Inflow counts positive like q1 and q3 
+	int k = leaf.size;
+	for (int side = 0; side < 4; side++)
+	{
+		bool horizontal = side < 2;
+		bool upper = (side & 1) != 0;
+		float sign = upper ? -1.0f : 1.0f;
+
+		for (int t = 0; t < k; t++)
+		{
+			int faceX = horizontal ? leaf.x + (upper ? k : 0) : leaf.x + t;
+			int faceY = horizontal ? leaf.y + t : leaf.y + (upper ? k : 0);
+			int nx = horizontal ? (upper ? faceX : faceX - 1) : faceX;
+			int ny = horizontal ? faceY : (upper ? faceY : faceY - 1);
+			if (nx < 0 || ny < 0 || nx >= sideLength || ny >= sideLength)
+				continue;
+
+			int neighbour = CellIndex(nx, ny);
+			if (cellTypes[neighbour] == SolidCell)
+				continue;
+
+			int face = horizontal ? HorizontalFaceIndex(faceX, faceY) : VerticalFaceIndex(faceX, faceY);
+			float weight = 2.0f / (k + leafSizes[neighbour]);
+
+			flux += sign * faceVelocities[face];
+			p += sign * faceDensities[face];
+			s += weight;
+
+			faces[count] = face;
+			weights[count++] = sign * weight;
+		}
+	}
+
+	if (s == 0.0f)
+		return;
+
+	float divergence = flux * overrelaxation - densityMultipier * (p - leaf.averageP);
+	for (int f = 0; f < count; f++)
+	{
+		faceVelocities[faces[f]] -= weights[f] * divergence / s;
+	}
+}
+
+/// <summary>
+/// Faces inside a coarse leaf are not part of the solve, so they are filled
+/// in from the leafs own faces without adding divergence. Along its own axis
+/// every face is interpolated linearly between the two ends of its row or
+/// column, and the change of the other axis across the leaf is taken back
+/// out, so each cell only keeps an equal share of what the whole leaf has 
+/// </summary>
+void Fluid::FillLeafInterior(const QuadLeaf& leaf)
+{
+	int k = leaf.size;
+	float left[BLOCKSIZE];
+	float bottom[BLOCKSIZE];
+	float rowChange[BLOCKSIZE];
+	float columnChange[BLOCKSIZE];
+	float rowTotal = 0.0f;
+	float columnTotal = 0.0f;
+
+	for (int t = 0; t < k; t++)
+	{
+		left[t] = faceVelocities[HorizontalFaceIndex(leaf.x, leaf.y + t)];
+		bottom[t] = faceVelocities[VerticalFaceIndex(leaf.x + t, leaf.y)];
+		rowChange[t] = faceVelocities[HorizontalFaceIndex(leaf.x + k, leaf.y + t)] - left[t];
+		columnChange[t] = faceVelocities[VerticalFaceIndex(leaf.x + t, leaf.y + k)] - bottom[t];
+		rowTotal += rowChange[t];
+		columnTotal += columnChange[t];
+	}
+
+	// Cell (i, t) takes a k-th of its rows change along x and gives back a
+	// k-th of its columns change, the totals over the leaf bring both walks
+	// out at the far side again. Columns work the same with x and y swapped 
+	float area = (float)(k * k);
+	for (int t = 0; t < k; t++)
+	{
+		float u = left[t];
+		float v = bottom[t];
+		for (int i = 0; i < k - 1; i++)
+		{
+			u += (rowChange[t] - columnChange[i]) / k + columnTotal / area;
+			v += (columnChange[t] - rowChange[i]) / k + rowTotal / area;
+			faceVelocities[HorizontalFaceIndex(leaf.x + i + 1, leaf.y + t)] = u;
+			faceVelocities[VerticalFaceIndex(leaf.x + t, leaf.y + i + 1)] = v;
+		}
+	}
+}
+
+void Fluid::SetQuadtree(int maxSize, int band)
+{
+	// Powers of two only, so leaves tile their block 
+	int size = 1;
+	while (size * 2 <= glm::min(maxSize, BLOCKSIZE))
+	{
+		size *= 2;
+	}
+
+	maxLeafSize = size;
+	surfaceBand = glm::max(band, 1);
+}
+
+/// <summary>
+/// Split every active block into the leaves of the pressure solve. A square
+/// becomes one leaf when it is small enough and every cell within the band
+/// around it is fluid, otherwise it is split in four down to single cells 
+/// </summary>
+void Fluid::BuildQuadtree()
+{
+	// The last tree may have covered blocks that have since been retired.
+	// Blocks that lost their page start from single cells when they get one 
+	for (unsigned int l = 0; l < quadLeafCount; l++)
+	{
+		const QuadLeaf& leaf = quadLeaves[l];
+		for (int x = leaf.x; x < leaf.x + leaf.size; x++)
+		{
+			for (int y = leaf.y; y < leaf.y + leaf.size; y++)
+			{
+				int c = CellIndex(x, y);
+				if (!IsRestCell(c))
+				{
+					leafSizes[c] = 1;
+				}
+			}
+		}
+	}
+	quadLeafCount = 0;
+
+	if (maxLeafSize <= 1)
+		return;
+
+	for (unsigned int a = 0; a < activeBlockCount; a++)
+	{
+		glm::ivec2 min, max;
+		BlockBounds(activeBlocks[a], sideLength, sideLength, min, max);
+		AddLeaves(min.x, min.y, BLOCKSIZE);
+	}
+
+	// Single cells only need the weighted update next to a coarse leaf 
+	for (unsigned int l = 0; l < quadLeafCount; l++)
+	{
+		QuadLeaf& leaf = quadLeaves[l];
+		if (leaf.size > 1)
+		{
+			leaf.graded = true;
+			continue;
+		}
+
+		leaf.graded = LeafSizeAt(leaf.x - 1, leaf.y) > 1 || LeafSizeAt(leaf.x + 1, leaf.y) > 1 ||
+			LeafSizeAt(leaf.x, leaf.y - 1) > 1 || LeafSizeAt(leaf.x, leaf.y + 1) > 1;
+	}
+}
+
+void Fluid::AddLeaves(int x, int y, int size)
+{
+	if (x >= sideLength || y >= sideLength)
+		return;
+
+	if (size > 1 && size <= maxLeafSize && IsDeepFluid(x, y, size))
+	{
+		QuadLeaf& leaf = quadLeaves[quadLeafCount++];
+		leaf.x = x;
+		leaf.y = y;
+		leaf.size = size;
+		leaf.cell = CellIndex(x, y);
+		leaf.averageP = 0.0f;
+
+		for (int cx = x; cx < x + size; cx++)
+		{
+			for (int cy = y; cy < y + size; cy++)
+			{
+				int c = CellIndex(cx, cy);
+				leafSizes[c] = size;
+				leaf.averageP += cells[c].averageP;
+			}
+		}
+		leaf.averageP /= size * size;
+		return;
+	}
+
+	if (size > 1)
+	{
+		int half = size / 2;
+		AddLeaves(x, y, half);
+		AddLeaves(x, y + half, half);
+		AddLeaves(x + half, y, half);
+		AddLeaves(x + half, y + half, half);
+		return;
+	}
+
+	int c = CellIndex(x, y);
+	if (cellTypes[c] != FluidCell)
+		return;
+
+	QuadLeaf& leaf = quadLeaves[quadLeafCount++];
+	leaf.x = x;
+	leaf.y = y;
+	leaf.size = 1;
+	leaf.cell = c;
+	leaf.averageP = cells[c].averageP;
+}
+
+/// <summary>
+/// A side of the cell is open to air, which makes it part of the surface 
+/// </summary>
+bool Fluid::TouchesAir(int x, int y) const
+{
+	return (x > 0 && cellTypes[CellIndex(x - 1, y)] == AirCell) ||
+		(x + 1 < sideLength && cellTypes[CellIndex(x + 1, y)] == AirCell) ||
+		(y > 0 && cellTypes[CellIndex(x, y - 1)] == AirCell) ||
+		(y + 1 < sideLength && cellTypes[CellIndex(x, y + 1)] == AirCell);
+}
+
+/// <summary>
+/// Every cell of the square and of the band around it is fluid 
+/// </summary>
+bool Fluid::IsDeepFluid(int x, int y, int size) const
+{
+	if (x - surfaceBand < 0 || y - surfaceBand < 0 || x + size + surfaceBand > sideLength || y + size + surfaceBand > sideLength)
+		return false;
+
+	for (int cx = x - surfaceBand; cx < x + size + surfaceBand; cx++)
+	{
+		for (int cy = y - surfaceBand; cy < y + size + surfaceBand; cy++)
 		{
-			if(glm::abs(*cell.r3) > 0.0f)
-				*cell.q3 /= *cell.r3;
+			if (cellTypes[CellIndex(cx, cy)] != FluidCell)
+				return false;
 		}
 	}
+	return true;
 }
 
-/// <summary>
-/// Make the grid have an equal amout of fluid inflow and outflow 
-/// </summary>
-void Fluid::MakeIncompressible(std::vector<Cell>* nextValues, int iterations, float overrelaxation, float densityMultipier)
+void Fluid::SetNarrowBand(int band, int seedsPerCell)
 {
-	overrelaxation = glm::clamp(overrelaxation, 1.0f, 2.0f);
+	band = glm::max(band, 0);
+	bandSeeds = glm::clamp(seedsPerCell, 1, 16);
 
-	for (unsigned int i = 0; i < iterations; i++)
+	// The interior only lives on the grid, so it needs particles again
+	// before the grid stops keeping it 
+	if (band == 0 && narrowBand > 0)
 	{
-		for (unsigned int c = 0; c < nextValues->size(); c++)
+		BeginChange();
+		UpdateCellLists();
+		for (unsigned int a = 0; a < activeCellCount; a++)
 		{
-			Cell cell = (*nextValues)[c];
-			float divergence = 0.0f; // Used to make incompressible by "spreading" out values 
-			float s = 0.0f; // Accomodate for solid cells 
+			if (cellOccupancy[activeCells[a]] == 0)
+			{
+				SeedCell(activeCells[a], bandSeeds);
+			}
+		}
 
-			float p = 0.0f; // Demsityl 
+		std::fill(liquidPhi.begin(), liquidPhi.end(), 1.0f);
+		std::fill(liquidPhiNext.begin(), liquidPhiNext.end(), 1.0f);
+		std::fill(blockLiquid.begin(), blockLiquid.end(), 0);
+		cellListsDirty = true;
+		EndChange();
+	}
+	narrowBand = band;
+}
 
-			// Divergence and s value calculations 
-			if (cell.q1 != nullptr)
-			{
-				divergence += *cell.q1;
-				s += 1;
+/// <summary>
+/// Bilinear liquidPhi between cell centres. Solid cells and cells off the
+/// grid are left out, so walls neither add nor take away liquid 
+/// </summary>
+float Fluid::SampleLiquidPhi(glm::vec2 pos) const
+{
+	glm::vec2 lattice = pos / cellSize - glm::vec2(0.5f);
+	glm::vec2 base = glm::floor(lattice);
+	float weights[4];
+	CornerWeights(lattice - base, weights);
+
+	float weightSum = 0.0f;
+	float sampled = 0.0f;
+	for (int k = 0; k < 4; k++)
+	{
+		int x = (int)base.x + (k & 1);
+		int y = (int)base.y + (k >> 1);
+		if (x < 0 || y < 0 || x >= sideLength || y >= sideLength)
+			continue;
 
-				p += *cell.p1;
-			}
+		int c = CellIndex(x, y);
+		if (cellTypes[c] == SolidCell)
+			continue;
 
-			if (cell.q2 != nullptr)
-			{
-				divergence -= *cell.q2;
-				s += 1;
+		sampled += weights[k] * liquidPhi[c];
+		weightSum += weights[k];
+	}
 
-				p -= *cell.p2;
-			}
+	return weightSum > 0.0f ? sampled / weightSum : 1.0f;
+}
 
-			if (cell.q3 != nullptr)
-			{
-				divergence += *cell.q3;
-				s += 1;
+/// <summary>
+/// Either cell beside the face is in the interior by the level set 
+/// </summary>
+bool Fluid::TouchesLiquid(int x, int y, bool horizontal) const
+{
+	int lessX = horizontal ? x - 1 : x;
+	int lessY = horizontal ? y : y - 1;
 
-				p += *cell.p3;
-			}
+	if (x < sideLength && y < sideLength && liquidPhi[CellIndex(x, y)] < INTERIORPHI)
+		return true;
+	return lessX >= 0 && lessY >= 0 && liquidPhi[CellIndex(lessX, lessY)] < INTERIORPHI;
+}
 
-			if (cell.q4 != nullptr)
+/// <summary>
+/// Semi-Lagrangian step of the level set and of the face velocities of the
+/// liquid through the grid the last step ended with. Gravity is added here
+/// since the interior has no particles to carry it. Must run before the
+/// transfer overwrites the faces 
+/// </summary>
+void Fluid::AdvectInterior(float timeStep)
+{
+	Parallel::For(0, activeBlockCount, 4, [&](int begin, int end)
+	{
+		for (int a = begin; a < end; a++)
+		{
+			glm::ivec2 min, max;
+			BlockBounds(activeBlocks[a], sideLength, sideLength, min, max);
+
+			for (int x = min.x; x < max.x; x++)
 			{
-				divergence -= *cell.q4;
-				s += 1;
+				for (int y = min.y; y < max.y; y++)
+				{
+					int c = CellIndex(x, y);
+					if (RestingCellType(c) == SolidCell)
+					{
+						liquidPhiNext[c] = 1.0f;
+						continue;
+					}
 
-				p -= *cell.p4;
+					glm::vec2 center = (glm::vec2(x, y) + glm::vec2(0.5f)) * cellSize;
+					glm::vec2 vel = SampleGridVelocity(center, glm::vec2(0));
+					liquidPhiNext[c] = SampleLiquidPhi(center - vel * timeStep);
+				}
 			}
+		}
+	});
+	std::swap(liquidPhi, liquidPhiNext);
 
-			divergence *= overrelaxation;
-			divergence -= densityMultipier * (p - cell.averageP);
+	// Only faces that can end up inside the liquid are read back 
+	ForActiveFaces([&](int face, int x, int y, bool horizontal)
+	{
+		if (!TouchesLiquid(x, y, horizontal))
+			return;
+
+		glm::vec2 pos = horizontal ? glm::vec2(x, y + 0.5f) * cellSize : glm::vec2(x + 0.5f, y) * cellSize;
+		glm::vec2 vel = SampleGridVelocity(pos, glm::vec2(0));
+		glm::vec2 from = SampleGridVelocity(pos - vel * timeStep, glm::vec2(0));
+		advectedFaces[face] = horizontal ? from.x : from.y + gravity * timeStep;
+	});
+}
 
-			// Apply incompressibility 
-			if (cell.q1 != nullptr)
-			{
-				*cell.q1 += (divergence * !cell.isSolid) / s;
-			}
+/// <summary>
+/// Faces of the liquid no particle splatted onto take the advected grid
+/// velocity, the band keeps what its particles gave it 
+/// </summary>
+void Fluid::FillInteriorFaces()
+{
+	ForActiveFaces([&](int face, int x, int y, bool horizontal)
+	{
+		if (faceWeights[face] == 0.0f && TouchesLiquid(x, y, horizontal))
+		{
+			faceVelocities[face] = advectedFaces[face];
+		}
+	});
+}
 
-			if (cell.q2 != nullptr)
-			{
-				*cell.q2 += (divergence * !cell.isSolid) / s;
-			}
+/// <summary>
+/// Replace liquidPhi with the depth of every fluid cell in cells from the
+/// air, found a layer at a time like the extrapolation. Walls do not count
+/// as surface. Anything deeper than the band keeps one past it 
+/// </summary>
+void Fluid::MeasureDepth()
+{
+	float deep = -(float)(narrowBand + 1);
 
-			if (cell.q3 != nullptr)
+	for (unsigned int a = 0; a < activeBlockCount; a++)
+	{
+		glm::ivec2 min, max;
+		BlockBounds(activeBlocks[a], sideLength, sideLength, min, max);
+
+		unsigned char liquid = 0;
+		for (int x = min.x; x < max.x; x++)
+		{
+			for (int y = min.y; y < max.y; y++)
 			{
-				*cell.q3 += (divergence * !cell.isSolid) / s;
+				int c = CellIndex(x, y);
+				liquidPhi[c] = cellTypes[c] == FluidCell ? deep : 1.0f;
+				liquid |= cellTypes[c] == FluidCell;
 			}
+		}
+		blockLiquid[activeBlocks[a]] = liquid;
+	}
 
-			if (cell.q4 != nullptr)
+	// Layer 1 borders air, every later layer borders the one before 
+	for (int layer = 1; layer <= narrowBand; layer++)
+	{
+		for (unsigned int a = 0; a < activeCellCount; a++)
+		{
+			int c = activeCells[a];
+			if (liquidPhi[c] != deep)
+				continue;
+
+			const Cell& cell = cells[c];
+			int neighbours[4][2] = {
+				{ cell.xIndex - 1, cell.yIndex },
+				{ cell.xIndex + 1, cell.yIndex },
+				{ cell.xIndex, cell.yIndex - 1 },
+				{ cell.xIndex, cell.yIndex + 1 } };
+
+			for (int n = 0; n < 4; n++)
 			{
-				*cell.q4 += (divergence * !cell.isSolid) / s;
+				int x = neighbours[n][0];
+				int y = neighbours[n][1];
+				if (x < 0 || y < 0 || x >= sideLength || y >= sideLength)
+					continue;
+
+				int other = CellIndex(x, y);
+				bool surface = layer == 1 ? cellTypes[other] == AirCell : liquidPhi[other] == -(float)(layer - 1);
+				if (surface)
+				{
+					liquidPhi[c] = -(float)layer;
+					break;
+				}
 			}
 		}
 	}
 }
 
 /// <summary>
-/// Gets the difference between the old velocity grid and the new
-/// one and applys that change in velocity to all particles within
-/// each cell 
+/// Add particles spread evenly over a cell, moving with the grid 
 /// </summary>
-/// <param name="nextValues"></param>
-/// <param name="timeStep"></param>
-void Fluid::AddChangeToParticles(std::vector<Cell>* nextValues, float timeStep)
+/// <returns>How many were added</returns>
+int Fluid::SeedCell(int c, int count)
 {
-	for (unsigned int i = 0; i < particles.size(); i++)
+	const Cell& cell = cells[c];
+	glm::vec2 cellMin = glm::vec2(cell.xIndex, cell.yIndex) * cellSize;
+	int side = (int)glm::ceil(glm::sqrt((float)count));
+
+	int seeded = 0;
+	for (int i = 0; i < count && !particles.IsFull(); i++)
 	{
-		Particle* current = &particles[i];
-		glm::vec2 particlePos = glm::vec2((*(current->pos)).x, (*(current->pos)).y - (cellSize / 2.0f));
+		glm::vec2 offset = (glm::vec2(i % side, i / side) + glm::vec2(0.5f)) / (float)side;
+		glm::vec2 pos = cellMin + offset * cellSize;
+		if (!obstacles.IsEmpty() && obstacles.Sample(pos) < 0.0f)
+			continue;
 
-		int xCell = particlePos.x / cellSize;
-		int yCell = particlePos.y / cellSize;
+		particles.Spawn(pos, SampleGridVelocity(pos, glm::vec2(0)));
+		seeded++;
+	}
 
-		int cellIndex = xCell + sideLength * yCell;
-		if (cellIndex >= nextValues->size())
-			continue;
-		Cell cellNext = (*nextValues)[cellIndex];
-		Cell cellOld = cells[cellIndex];
+	if (seeded > 0)
+	{
+		positionEpoch++;
+	}
+	return seeded;
+}
+
+/// <summary>
+/// Remove the particles of cells deeper than the band and seed the band
+/// cells that have none, which is where the band moved since last step 
+/// </summary>
+void Fluid::CullAndReseed()
+{
+	UpdateCellLists();
+
+	unsigned int killCount = 0;
+	unsigned int seeded = 0;
+	float cutoff = -(float)narrowBand - 0.5f;
+	for (unsigned int a = 0; a < activeCellCount; a++)
+	{
+		int c = activeCells[a];
+		if (liquidPhi[c] < cutoff)
+		{
+			const Cell& cell = cells[c];
+			for (int i = 0; i < cell.GetParticleCount(); i++)
+			{
+				killList[killCount++] = cell.GetParticle(i);
+			}
+		}
+		else if (cellOccupancy[c] == 0)
+		{
+			seeded += SeedCell(c, bandSeeds);
+		}
+	}
+
+	// Seeding only appended, so the indices collected above are still good 
+	if (killCount > 0)
+	{
+		KillParticles(killList.data(), killCount);
+	}
 
-		float deltaX = glm::abs(xCell * cellSize - particlePos.x);
-		float deltaY = glm::abs(yCell * cellSize - particlePos.y);
+	bandCulls = killCount;
+	bandSeedings = seeded;
+
+	// Kills fix the lists up as they go 
+	if (seeded > 0)
+	{
+		cellListsDirty = true;
+	}
+}
 
-		// Weights for how much each corner is affected by particle
-		float w1 = (1.0f - deltaX / cellSize) * (1.0f - deltaY / cellSize);
-		float w2 = deltaX / cellSize * (1 - deltaY / cellSize);
-		float w3 = deltaX / cellSize * (deltaY / cellSize);
-		float w4 = (1 - deltaX / cellSize) * (deltaY / cellSize);
+void Fluid::SetSleeping(int steps, float speed, float divergence)
+{
+	sleepSteps = glm::clamp(steps, 0, 0xFFFF);
+	sleepSpeed = glm::max(speed, 0.0f);
+	sleepDivergence = glm::max(divergence, 0.0f);
 
-		float denomenator = 0.0f;
+	if (sleepSteps == 0)
+	{
+		WakeAll();
+	}
+}
 
-		float xComp = 0.0f;
-		float yComp = 0.0f;
+/// <summary>
+/// Every face of the block is slower than sleepSpeed and every fluid cell
+/// is within sleepDivergence of divergence free 
+/// </summary>
+bool Fluid::IsBlockCalm(unsigned int block) const
+{
+	for (int axis = 0; axis < 2; axis++)
+	{
+		bool horizontal = axis == 0;
+		glm::ivec2 min, max;
+		BlockBounds(block, horizontal ? sideLength + 1 : sideLength, horizontal ? sideLength : sideLength + 1, min, max);
 
-		// Add corner points 
-		if (cellOld.q1 != nullptr)
+		for (int x = min.x; x < max.x; x++)
 		{
-			xComp += w1 * (*cellNext.q1 - *cellOld.q1);
-			denomenator += w1;
+			for (int y = min.y; y < max.y; y++)
+			{
+				int face = horizontal ? HorizontalFaceIndex(x, y) : VerticalFaceIndex(x, y);
+				if (glm::abs(faceVelocities[face]) >= sleepSpeed)
+					return false;
+			}
 		}
+	}
 
-		if (cellOld.q2 != nullptr)
+	glm::ivec2 min, max;
+	BlockBounds(block, sideLength, sideLength, min, max);
+	for (int x = min.x; x < max.x; x++)
+	{
+		for (int y = min.y; y < max.y; y++)
 		{
-			xComp += w2 * (*cellNext.q2 - *cellOld.q2);
-			denomenator += w2;
+			int c = CellIndex(x, y);
+			if (cellTypes[c] != FluidCell)
+				continue;
+
+			// Border faces do not exist and walls were closed by the solve 
+			const Cell& cell = cells[c];
+			float divergence = 0.0f;
+			divergence -= cell.q1 != nullptr ? *cell.q1 : 0.0f;
+			divergence += cell.q2 != nullptr ? *cell.q2 : 0.0f;
+			divergence -= cell.q3 != nullptr ? *cell.q3 : 0.0f;
+			divergence += cell.q4 != nullptr ? *cell.q4 : 0.0f;
+			if (glm::abs(divergence) >= sleepDivergence)
+				return false;
 		}
+	}
+	return true;
+}
+
+/// <summary>
+/// Count how long each awake block has been calm and put the ones calm for
+/// sleepSteps to sleep, stopping their particles. Then wake every sleeping
+/// block next to an awake one that moved this step 
+/// </summary>
+void Fluid::UpdateSleep()
+{
+	UpdateCellLists();
+
+	for (unsigned int a = 0; a < activeBlockCount; a++)
+	{
+		unsigned int block = activeBlocks[a];
+		if (blockAsleep[block])
+			continue;
+
+		blockCalmSteps[block] = IsBlockCalm(block) ? glm::min(blockCalmSteps[block] + 1, 0xFFFF) : 0;
+		if (blockCalmSteps[block] < sleepSteps)
+			continue;
+
+		blockAsleep[block] = 1;
+		sleepingBlockCount++;
 
-		if (cellOld.q3 != nullptr)
+		// Woken particles start again from rest, the same as the faces 
+		glm::ivec2 min, max;
+		BlockBounds(block, sideLength, sideLength, min, max);
+		for (int x = min.x; x < max.x; x++)
 		{
-			yComp += w3 * (*cellNext.q3 - *cellOld.q3);
-			denomenator += w3;
+			for (int y = min.y; y < max.y; y++)
+			{
+				const Cell& cell = cells[CellIndex(x, y)];
+				for (int i = 0; i < cell.GetParticleCount(); i++)
+				{
+					particles.Velocity(cell.GetParticle(i)) = glm::vec2(0);
+					particles.Affine(cell.GetParticle(i)) = glm::mat2(0.0f);
+				}
+			}
 		}
+	}
+
+	if (sleepingBlockCount == 0)
+		return;
+
+	for (unsigned int a = 0; a < activeBlockCount; a++)
+	{
+		unsigned int block = activeBlocks[a];
+		if (!blockAsleep[block])
+			continue;
 
-		if (cellOld.q4 != nullptr)
+		int bx = block / blocksPerSide;
+		int by = block % blocksPerSide;
+		bool disturbed = false;
+		for (int x = glm::max(bx - 1, 0); x <= glm::min(bx + 1, blocksPerSide - 1) && !disturbed; x++)
 		{
-			yComp += w4 * (*cellNext.q4 - *cellOld.q4);
-			denomenator += w4;
+			for (int y = glm::max(by - 1, 0); y <= glm::min(by + 1, blocksPerSide - 1) && !disturbed; y++)
+			{
+				unsigned int other = x * blocksPerSide + y;
+				disturbed = blockSlots[other] >= 0 && !blockAsleep[other] && blockCalmSteps[other] == 0;
+			}
 		}
 
-		current->vel += (glm::vec3(
-			isnan(xComp) ? 0.0f : xComp, 
-			isnan(yComp) ? 0.0f : yComp, 
-			0.0f) / denomenator) * timeStep;
+		if (disturbed)
+		{
+			WakeBlock(block);
+		}
 	}
+}
 
+void Fluid::WakeBlock(unsigned int block)
+{
+	blockCalmSteps[block] = 0;
+	if (blockAsleep[block])
+	{
+		blockAsleep[block] = 0;
+		sleepingBlockCount--;
 
-	cells = *nextValues;
+		// Stencils skipped the particles of the block while it slept 
+		positionEpoch++;
+	}
 }
 
-void Fluid::SimulateFlip(float timeStep, int iterations, float overrelaxation, float densityMultiplier)
+/// <summary>
+/// Wake every block overlapping a rectangle in world space 
+/// </summary>
+void Fluid::WakeRegion(glm::vec2 min, glm::vec2 max)
 {
-	// Simulate the made FLIP calculations 
-	std::vector<Cell> nextValues(cells);
+	float blockLength = cellSize * BLOCKSIZE;
+	int xMin = glm::max((int)glm::floor(min.x / blockLength), 0);
+	int yMin = glm::max((int)glm::floor(min.y / blockLength), 0);
+	int xMax = glm::min((int)glm::floor(max.x / blockLength), blocksPerSide - 1);
+	int yMax = glm::min((int)glm::floor(max.y / blockLength), blocksPerSide - 1);
 
-	// Create a clone 
-	for (unsigned int i = 0; i < nextValues.size(); i++)
+	for (int x = xMin; x <= xMax; x++)
 	{
-		Cell* cell = &(nextValues[i]);
-		Cell oldCell = (cells[i]);
-
-		float* _q1 = cell->q1;
-		if (_q1 != nullptr)
+		for (int y = yMin; y <= yMax; y++)
 		{
-			cell->q1 = new float(*oldCell.q1);
-			cell->r1 = new float(*oldCell.r1);
+			WakeBlock(x * blocksPerSide + y);
 		}
+	}
+}
+
+void Fluid::WakeAll()
+{
+	if (sleepingBlockCount == 0)
+		return;
+
+	for (unsigned int block = 0; block < blockAsleep.size(); block++)
+	{
+		WakeBlock(block);
+	}
+}
+
+/// <summary>
+/// Gets the difference between the velocity grid at the start of the step
+/// and the new one and applys that change in velocity to all particles
+/// within each cell 
+/// </summary>
+/// <param name="timeStep"></param>
+void Fluid::AddChangeToParticles(float timeStep)
+{
+	// Particles have not moved since the transfer to the grid unless something
+	// else changed them in between 
+	if (stencilEpoch != positionEpoch || stencilCount != particles.GetCount() || stencilMode != transferMode)
+	{
+		ComputeStencils();
+	}
+
+	if (transferMode == Apic)
+	{
+		AddChangeToParticlesAffine();
+		return;
+	}
 
-		float* _q2 = cell->q2;
-		if (_q2 != nullptr)
+	// Every particle only reads the grid and writes its own velocity 
+	Parallel::For(0, particles.GetCount(), 1024, [&](int begin, int end)
+	{
+		for (int i = begin; i < end; i++)
 		{
-			cell->q2 = new float(*oldCell.q2);
-			cell->r2 = new float(*oldCell.r2);
+			const TransferStencil& stencil = stencils[i];
+			if (stencil.cell < 0)
+				continue;
+			const Cell& cell = cells[stencil.cell];
+
+			// Weights for how much each corner is affected by particle
+			float w1 = stencil.weights[0];
+			float w2 = stencil.weights[1];
+			float w3 = stencil.weights[2];
+			float w4 = stencil.weights[3];
+
+			float denomenator = 0.0f;
+
+			float xComp = 0.0f;
+			float yComp = 0.0f;
+
+			// Add corner points 
+			if (cell.q1 != nullptr)
+			{
+				xComp += w1 * (*cell.q1 - PrevFaceVelocity(cell.q1));
+				denomenator += w1;
+			}
+
+			if (cell.q2 != nullptr)
+			{
+				xComp += w2 * (*cell.q2 - PrevFaceVelocity(cell.q2));
+				denomenator += w2;
+			}
+
+			if (cell.q3 != nullptr)
+			{
+				yComp += w3 * (*cell.q3 - PrevFaceVelocity(cell.q3));
+				denomenator += w3;
+			}
+
+			if (cell.q4 != nullptr)
+			{
+				yComp += w4 * (*cell.q4 - PrevFaceVelocity(cell.q4));
+				denomenator += w4;
+			}
+
+			glm::vec2& vel = particles.Velocity(i);
+			glm::vec2 flipVel = vel + (glm::vec2(
+				isnan(xComp) ? 0.0f : xComp, 
+				isnan(yComp) ? 0.0f : yComp) / denomenator) * timeStep;
+
+			if (flipBlend >= 1.0f)
+			{
+				vel = flipVel;
+				continue;
+			}
+
+			// Grid velocity at the particle for the PIC part 
+			glm::vec2 picVel = flipVel;
+			float xWeight = (cell.q1 != nullptr ? w1 : 0.0f) + (cell.q2 != nullptr ? w2 : 0.0f);
+			float yWeight = (cell.q3 != nullptr ? w3 : 0.0f) + (cell.q4 != nullptr ? w4 : 0.0f);
+			if (xWeight > 0.0f)
+			{
+				picVel.x = ((cell.q1 != nullptr ? w1 * *cell.q1 : 0.0f) + (cell.q2 != nullptr ? w2 * *cell.q2 : 0.0f)) / xWeight;
+			}
+			if (yWeight > 0.0f)
+			{
+				picVel.y = ((cell.q3 != nullptr ? w3 * *cell.q3 : 0.0f) + (cell.q4 != nullptr ? w4 * *cell.q4 : 0.0f)) / yWeight;
+			}
+
+			vel = glm::mix(picVel, flipVel, flipBlend);
 		}
+	});
+}
 
-		float* _q3 = cell->q3;
-		if (_q3 != nullptr)
+/// <summary>
+/// Read each particles velocity back from the faces of its own component and
+/// rebuild its affine velocity from the gradient of the weights. The FLIP
+/// part of the blend adds the change of the grid to the old velocity instead 
+/// </summary>
+void Fluid::AddChangeToParticlesAffine()
+{
+	Parallel::For(0, particles.GetCount(), 1024, [&](int begin, int end)
+	{
+		for (int i = begin; i < end; i++)
 		{
-			cell->q3 = new float(*oldCell.q3);
-			cell->r3 = new float(*oldCell.r3);
+			const StaggeredStencil& stencil = staggeredStencils[i];
+			if (stencil.cell < 0)
+				continue;
+
+			glm::vec2& vel = particles.Velocity(i);
+			glm::vec2 picVel = vel;
+			glm::vec2 flipVel = vel;
+			glm::vec2 gradients[2] = { glm::vec2(0.0f), glm::vec2(0.0f) };
+
+			for (int axis = 0; axis < 2; axis++)
+			{
+				const int* faces = axis == 0 ? stencil.xFaces : stencil.yFaces;
+				glm::vec2 fraction = axis == 0 ? stencil.xFraction : stencil.yFraction;
+
+				float weights[4];
+				glm::vec2 cornerGradients[4];
+				CornerWeights(fraction, weights);
+				CornerGradients(fraction, cornerGradients);
+
+				float weightSum = 0.0f;
+				float sampled = 0.0f;
+				float change = 0.0f;
+
+				// Border faces are walls, so they count as standing still 
+				for (int k = 0; k < 4; k++)
+				{
+					int face = faces[k];
+					if (face < 0)
+						continue;
+
+					float q = faceVelocities[face];
+					weightSum += weights[k];
+					sampled += weights[k] * q;
+					change += weights[k] * (q - prevFaceVelocities[face]);
+					gradients[axis] += cornerGradients[k] * q;
+				}
+
+				if (weightSum > 0.0f)
+				{
+					picVel[axis] = sampled / weightSum;
+					flipVel[axis] += change / weightSum;
+				}
+			}
+
+			vel = glm::mix(picVel, flipVel, flipBlend);
+
+			// Rows are the gradients of x and y velocity, per pixel 
+			particles.Affine(i) = glm::mat2(
+				glm::vec2(gradients[0].x, gradients[1].x),
+				glm::vec2(gradients[0].y, gradients[1].y)) * (1.0f / cellSize);
 		}
+	});
+}
+
+void Fluid::SimulateFlip(float timeStep, int iterations, float overrelaxation, float densityMultiplier)
+{
+	BeginChange();
 
-		float* _q4 = cell->q4;
-		if (_q4 != nullptr)
+	// A settled fluid with every block asleep has nothing to do 
+	if (AllAsleep())
+	{
+		// Particles spawned by hand still have to show up in the views 
+		UpdateCellLists();
+		EndChange();
+		return;
+	}
+
+	// Particles in the same cell next to each other in memory for the transfers,
+	// and the active blocks brought up to date with them 
+	SortParticlesIfNeeded();
+	UpdateCellLists();
+
+	// Keep the grid the step starts from instead of cloning every cell. APIC
+	// keeps the grid the particles were splatted onto instead, so the FLIP
+	// part of its blend is only the change made by the pressure solve 
+	if (transferMode == Flip)
+	{
+		ForActiveFaces([&](int face, int, int, bool)
 		{
-			cell->q4 = new float(*oldCell.q4);
-			cell->r4 = new float(*oldCell.r4);
-		}
+			prevFaceVelocities[face] = faceVelocities[face];
+		});
+	}
+
+	// The interior is moved on the grid before the transfer overwrites it 
+	if (narrowBand > 0)
+	{
+		AdvectInterior(timeStep);
 	}
 
 	// Run each step in Flip 
-	TransferToVelField(&nextValues);
-	MakeIncompressible(&nextValues, iterations, overrelaxation, densityMultiplier);
-	AddChangeToParticles(&nextValues, timeStep);
-}
+	TransferToVelField();
+	if (narrowBand > 0)
+	{
+		FillInteriorFaces();
+	}
+	ClassifyCells();
+	if (narrowBand > 0)
+	{
+		MeasureDepth();
+	}
+	if (transferMode == Apic)
+	{
+		// Extrapolated as well, otherwise the FLIP change at the surface is
+		// measured against empty air faces. Taken before the walls are
+		// closed so the change also stops particles moving into them 
+		ExtrapolateVelocities();
+		ForActiveFaces([&](int face, int, int, bool)
+		{
+			prevFaceVelocities[face] = faceVelocities[face];
+		});
+	}
+	CloseSolidFaces();
+	BuildQuadtree();
+	MakeIncompressible(iterations, overrelaxation, densityMultiplier);
+	ExtrapolateVelocities();
+	AddChangeToParticles(timeStep);
+	if (narrowBand > 0)
+	{
+		CullAndReseed();
+	}
+	if (sleepSteps > 0)
+	{
+		UpdateSleep();
+	}
+
+	// Reseeding the band adds particles, the step leaves the lists up to date 
+	UpdateCellLists();
+
+	EndChange();
+}
\ No newline at end of file
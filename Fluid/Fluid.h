@@ -2,113 +2,23 @@
 #include "glm/glm.hpp"
 #include "glm/gtc/matrix_transform.hpp"
 
-#include "Entity.h"
-#include "Renderer.h"
-
-#include "Collision.h"
-
-struct Particle
-{
-
-private:
-	float halfSize;
-
-public:
-	glm::vec2 parentIndex; 
-
-	unsigned int index;
-	float qp;
-
-	glm::vec3* pos; // Address to position which is held in another vector 
-	glm::vec3 vel;
-
-	// The matrix represents the actual verticie positions 
-	float positions[4 * 4];
-
-	Particle()
-		:index(-1), pos(NULL), vel(glm::vec3(0)), halfSize(-1.0f)
-	{
-		// This is used for positions of corners and uv
-		float posTemp[] =
-		{
-				-halfSize, -halfSize, 0.0f, 0.0f,   // 0
-				 halfSize, -halfSize, 1.0f, 0.0f,   // 1
-				 halfSize,  halfSize, 1.0f, 1.0f,   // 2
-				-halfSize,  halfSize, 0.0f, 1.0f    // 3
-		};
-
-
-		// Assign variables to 
-		for (unsigned int i = 0; i < 4 * 4; i++)
-		{
-			positions[i] = posTemp[i];
-		}
-	}
-
-	Particle(unsigned int _index, glm::vec3* _pos, glm::vec3 _vel, float _halfSize)
-		:index(_index), pos(_pos), vel(_vel), halfSize(_halfSize)
-	{
-		// This is used for positions of corners and uv
-		float posTemp[] =
-		{
-				-halfSize, -halfSize, 0.0f, 0.0f,   // 0
-				 halfSize, -halfSize, 1.0f, 0.0f,   // 1
-				 halfSize,  halfSize, 1.0f, 1.0f,   // 2
-				-halfSize,  halfSize, 0.0f, 1.0f    // 3
-		};
-
-		// Assign variables to 
-		for (unsigned int i = 0; i < 4 * 4; i++)
-		{
-			positions[i] = posTemp[i];
-		}
-
-		parentIndex = glm::vec2(-1, -1);
-	}
-
-	/// <summary>
-	/// Updates the particles position based on its velocity 
-	/// </summary>
-	/// <param name="timeStep"></param>
-	void MoveByVel(float timeStep, float cellSize, int sideLength)
-	{
-		//*pos += vel * timeStep;
-
-		// The end of the path 
-		glm::vec2 start = glm::vec2(pos->x, pos->y);
-		glm::vec2 next = *pos + vel * timeStep;
+#include <vector>
+#include <atomic>
 
-		// SAFETY THAT IS EVENTUALLY TO BE MOVED 
-
-		// Freeze position if out of bounds 
-		if (IsIntersectingRect(
-			glm::vec2(cellSize, cellSize),
-			glm::vec2(1.0f) * (cellSize * sideLength),
-			*pos,
-			glm::vec2(1.0f) * halfSize))
-		{
-			*pos = glm::vec3(next, 0.0f);
-		}
-	}
+#include "Renderer.h"
 
-	/// <summary>
-	/// Set the velocity of the particle 
-	/// </summary>
-	void SetVel(glm::vec3 nextVel)
-	{
-		vel = nextVel;
-	}
+#include "ParticlePool.h"
+#include "RadixSort.h"
+#include "GridLayout.h"
+#include "DistanceField.h"
+#include "View.h"
 
-	float GetHalfSize()
-	{
-		return halfSize;
-	}
-};
- 
 struct Cell
 {
 private:
-	std::vector<Particle*> particles;
+	// Indices into the particle pool, this cells range of the fluids cell lists 
+	const unsigned int* particles;
+	int particleCount;
 
 public:
 	// Shared corners between cells 
@@ -151,7 +61,7 @@ public:
 		float* _r1, float* _r2, float* _r3, float* _r4,
 		float* _p1, float* _p2, float* _p3, float* _p4,
 		Cell::PushDirections _pushDirection)
-		: xIndex(_xIndex), yIndex(_yIndex), halfSize(_halfSize), isSolid(_isSolid)
+		: particles(nullptr), particleCount(0), averageP(0.0f), halfSize(_halfSize), isSolid(_isSolid), xIndex(_xIndex), yIndex(_yIndex)
 	{
 		pushDir = _pushDirection;
 
@@ -169,8 +79,6 @@ public:
 		p2 = _p2;
 		p3 = _p3;
 		p4 = _p4;
-
-		particles = std::vector<Particle*>();
 	}
 
 	~Cell()
@@ -182,99 +90,369 @@ public:
 	/// Get how many particles currently exist in this cell
 	/// </summary>
 	/// <returns></returns>
-	int GetParticleCount()
+	int GetParticleCount() const
 	{
-		return particles.size();
+		return particleCount;
 	}
 
 	/// <summary>
-	/// Check if this cell already contains the given particle
+	/// Gets the particle based on index 
 	/// </summary>
-	/// <returns></returns>
-	bool ContainsParticle(Particle* particle)
+	/// <param name="index"></param>
+	/// <returns>Index into the particle pool or ParticlePool::INVALID</returns>
+	unsigned int GetParticle(int index) const
 	{
-		for (unsigned int i = 0; i < particles.size(); i++)
+		if (index < 0 || index >= particleCount)
 		{
-			if (particles[i] == particle)
-			{
-				// Was found 
-				return true;
-			}
+			return ParticlePool::INVALID;
 		}
 
-		// Was not found 
-		return false;
+		return particles[index];
 	}
 
 	/// <summary>
-	/// Gets the particle based on index 
+	/// Point the cell at its range of the cell lists 
 	/// </summary>
-	/// <param name="index"></param>
-	/// <returns></returns>
-	Particle* GetParticle(int index)
+	void SetParticles(const unsigned int* _particles, int count)
 	{
-		if (index < 0 || index >= particles.size())
-		{
-			return nullptr;
-		}
-
-		return particles[index];
+		particles = _particles;
+		particleCount = count;
 	}
+};
+
+/// <summary>
+/// Where a particle sits in the grid for the transfers. Worked out once by
+/// the transfer to the grid and read again by the transfer back 
+/// </summary>
+struct TransferStencil
+{
+	// Cell the weights are relative to or -1 when outside the grid 
+	int cell;
+
+	// Weight of the cells q1 to q4 faces 
+	float weights[4];
+};
+
+/// <summary>
+/// Bilinear stencil over the faces that hold each velocity component, used
+/// by the APIC transfers. Corners go (0, 0), (1, 0), (0, 1), (1, 1) 
+/// </summary>
+struct StaggeredStencil
+{
+	// Cell the particle is in or -1 when outside the grid 
+	int cell;
 
+	// Face indices or -1 for faces on the border of the grid 
+	int xFaces[4];
+	int yFaces[4];
+
+	// Where the particle sits between the corners, 0 to 1 on each axis 
+	glm::vec2 xFraction;
+	glm::vec2 yFraction;
+};
+
+/// <summary>
+/// A leaf of the pressure quadtree, a square of fluid cells solved as one.
+/// Leaves of one cell are the plain grid 
+/// </summary>
+struct QuadLeaf
+{
+	// Lower left cell and the side length in cells 
+	int x;
+	int y;
+	int size;
+
+	// Storage index of the lower left cell 
+	int cell;
+
+	// Some neighbour is a leaf of another size, so the faces need weights 
+	bool graded;
+
+	// Mean of the averageP of the cells covered 
+	float averageP;
+};
+
+class Fluid
+{
+public:
 	/// <summary>
-	/// Add a particle reference to this cell 
+	/// How velocity moves between the particles and the grid 
 	/// </summary>
-	/// <param name="particle"></param>
-	void AddParticle(Particle* particle)
+	enum TransferMode
 	{
-		particles.push_back(particle);
-		particle->parentIndex = glm::vec2(xIndex, yIndex);
-	}
+		Flip = 0,
+		Apic = 1
+	};
 
 	/// <summary>
-	/// Does not consider that particle as one of this cells children 
+	/// What a cell holds this step, see ClassifyCells 
 	/// </summary>
-	/// <param name="particle"></param>
-	void RemoveParticle(Particle* particle)
+	enum CellType
 	{
-		for (unsigned int i = 0; i < particles.size(); i++)
-		{
-			if (particles[i] == particle)
-			{
-				particles.erase(particles.begin() + i);
-				break;
-			}
-		}
-	}
-};
+		AirCell = 0,
+		FluidCell = 1,
+		SolidCell = 2
+	};
 
-class Fluid
-{
-private:
-	std::vector<Particle> particles;
-	std::vector<Entity> particleEntity;
 	/// <summary>
-	/// Used to store each particle's position 
+	/// How particle positions are integrated. Euler moves each particle by its
+	/// own velocity, the Runge-Kutta modes follow the grid velocity field 
 	/// </summary>
-	std::vector<glm::vec3> positions;
+	enum AdvectionMode
+	{
+		EulerAdvection = 0,
+		Rk2Advection = 1,
+		Rk3Advection = 2
+	};
 
-	std::vector<std::vector<Cell>> velField;
+private:
+	ParticlePool particles;
+
+	// Cells are stored page by page, see blockPages, and in the order of
+	// cellLayout within a page 
 	std::vector<Cell> cells;
-	
-	std::vector<float*> qValues;
-	std::vector<float*> rValues;
+	GridLayout cellLayout;
+
+	// Face values of the staggered grid, stored page by page like the cells.
+	// A page holds the left face of each of its cells followed by the bottom
+	// face, so the right and top faces of a cell on the edge of a block live
+	// in the next page. Cells point into these, see LinkBlock 
+	std::vector<float> faceVelocities;
+	std::vector<float> faceWeights;
+	std::vector<float> faceDensities;
+
+	// Face velocities at the start of the step, used for the FLIP difference 
+	std::vector<float> prevFaceVelocities;
+
+	// Particle indices grouped by cell with a counting sort. Rebuilt in place
+	// whenever particles have moved, spawned or died since the last rebuild 
+	std::vector<unsigned int> cellParticles;
+	std::vector<unsigned int> cellStarts;
+	std::vector<unsigned int> cellOccupancy;
+	bool cellListsDirty;
+
+	// The grid is split into BLOCKSIZE square blocks numbered column after
+	// column, with enough of them to also cover the line of faces past the
+	// last cell. Only blocks holding particles and the ring of blocks around
+	// them take part in a step, see UpdateActiveBlocks. Every face outside
+	// them is kept at zero. blockSlots maps a block to its place in
+	// activeBlocks, -1 while the block is inactive.
+	// blockPages is the page table. The cells and faces of a block are kept
+	// in a page of PAGESIZE cells that is taken when the block or one of its
+	// neighbours becomes active and goes back on freePages once none is, so
+	// storage grows with the fluid rather than the domain. The ring of
+	// resting pages around the active blocks holds every neighbour a step
+	// writes to. Blocks without a page read page 0, the rest page of zero
+	// faces and air cells, which nothing writes to 
+	static const int BLOCKSIZE = GridLayout::TILESIZE;
+	static const int PAGESIZE = BLOCKSIZE * BLOCKSIZE;
+	int blocksPerSide;
+	std::vector<int> blockSlots;
+	std::vector<int> blockPages;
+	std::vector<int> freePages;
+	std::vector<unsigned char> blockOccupied;
+	std::vector<unsigned int> activeBlocks;
+	unsigned int activeBlockCount;
+
+	// One CellType per cell and the fluid cells packed block by block.
+	// openFaces has a bit per face of a fluid cell that is not against a
+	// solid, in the order q1 to q4 
+	std::vector<unsigned char> cellTypes;
+	std::vector<unsigned char> openFaces;
+	std::vector<unsigned int> activeCells;
+	unsigned int activeCellCount;
+
+	// Leaves of the pressure solve, see BuildQuadtree. leafSizes holds the
+	// size of the leaf each fluid cell is in and 1 for every other cell.
+	// Squares of up to maxLeafSize cells are merged when every cell within
+	// surfaceBand of them is fluid, so the surface and obstacles stay fine 
+	std::vector<QuadLeaf> quadLeaves;
+	unsigned int quadLeafCount;
+	std::vector<unsigned char> leafSizes;
+	int maxLeafSize;
+	int surfaceBand;
+
+	// Narrow band mode, see SetNarrowBand. liquidPhi is minus the depth in
+	// cells of each liquid cell from the surface, capped past the band, and
+	// 1 outside the liquid. Cells deeper than narrowBand hold no particles,
+	// they are carried on the grid by advecting liquidPhi and the face
+	// velocities into liquidPhiNext and advectedFaces. blockLiquid keeps
+	// blocks of liquid with no particles active. Off while narrowBand is 0 
+	int narrowBand;
+	int bandSeeds;
+	std::vector<float> liquidPhi;
+	std::vector<float> liquidPhiNext;
+	std::vector<float> advectedFaces;
+	std::vector<unsigned char> blockLiquid;
+	unsigned int bandCulls;
+	unsigned int bandSeedings;
+
+	// Sleeping blocks, see SetSleeping. An active block that stays calm for
+	// sleepSteps steps in a row is left out of advection, the transfers and
+	// the pressure solve until a neighbour, the mouse or a change to its
+	// particles wakes it. blockParticles counts the particles of each block
+	// at the last two cell list rebuilds. Off while sleepSteps is 0 
+	int sleepSteps;
+	float sleepSpeed;
+	float sleepDivergence;
+	std::vector<unsigned char> blockAsleep;
+	std::vector<unsigned short> blockCalmSteps;
+	std::vector<unsigned int> blockParticles;
+	std::vector<unsigned int> lastBlockParticles;
+	unsigned int sleepingBlockCount;
+
+	// Faces with a known velocity while extrapolating into the air, see
+	// ExtrapolateVelocities. The next layer is marked in the second array 
+	std::vector<unsigned char> faceKnown;
+	std::vector<unsigned char> faceKnownNext;
+	int extrapolationLayers;
+
+	// Cells this far from the edge are walls, as last given to SimulateParticles 
+	int wallThickness;
+
+	// Static obstacles, empty when there are none. obstacleCells marks the
+	// cells whose centre is inside one 
+	DistanceField obstacles;
+	std::vector<unsigned char> obstacleCells;
+
+	// One per particle, valid while the position epoch they were made in
+	// lasts. Only the array of the current transfer mode is filled 
+	std::vector<TransferStencil> stencils;
+	std::vector<StaggeredStencil> staggeredStencils;
+	unsigned int stencilEpoch;
+	unsigned int stencilCount;
+
+	// Bumped by everything that moves, adds, removes or reorders particles,
+	// wakes them up or moves the pages their stencils point into. Unlike the
+	// generation it also changes inside a change 
+	unsigned int positionEpoch;
+
+	// Particles are put back into Z-order of their cells once neighbours in
+	// the arrays are far enough apart in the grid, see SortParticlesIfNeeded 
+	RadixSort sorter;
+	std::vector<unsigned int> sortKeys;
+	std::vector<unsigned int> sortOrder;
+	float sortThreshold;
+	float disorder;
+	unsigned int sortCount;
+
+	bool fuseParticleUpdate;
+
+	// Merging and seeding to keep the particles per cell in range, see
+	// ResampleParticles. Off while the interval is 0 
+	int resampleInterval;
+	int resampleMin;
+	int resampleMax;
+	int stepsSinceResample;
+	unsigned int resampleMerges;
+	unsigned int resampleSeeds;
+
+	// Particles to remove in one batch, sized to the pool 
+	std::vector<unsigned int> killList;
+
+	TransferMode transferMode;
+	TransferMode stencilMode;
+	AdvectionMode advectionMode;
+
+	// 0 takes the grid velocity as is (PIC), 1 only adds the change of the grid (FLIP) 
+	float flipBlend;
+
+	// Odd while particles or the grid are being written, see GetGeneration 
+	std::atomic<unsigned int> generation;
+	int changeDepth;
+
+	void BeginChange();
+	void EndChange();
 
 	float gravity;
 	float cellSize; // NOT HALFSIZE!!!
 	int sideLength;
+	float particleHalfSize;
+
+	inline unsigned int BlockAt(int x, int y) const { return (x / BLOCKSIZE) * blocksPerSide + y / BLOCKSIZE; }
+	inline int PageSlot(int x, int y) const { return cellLayout.Index(x % BLOCKSIZE, y % BLOCKSIZE); }
+	inline int CellIndex(int x, int y) const { return blockPages[BlockAt(x, y)] * PAGESIZE + PageSlot(x, y); }
+	inline int HorizontalFaceIndex(int x, int y) const { return blockPages[BlockAt(x, y)] * 2 * PAGESIZE + PageSlot(x, y); }
+	inline int VerticalFaceIndex(int x, int y) const { return blockPages[BlockAt(x, y)] * 2 * PAGESIZE + PAGESIZE + PageSlot(x, y); }
+	inline bool IsRestCell(int cell) const { return cell < PAGESIZE; }
+	inline float PrevFaceVelocity(const float* face) const { return prevFaceVelocities[face - faceVelocities.data()]; }
+	inline unsigned int BlockOf(int cell) const { return (cells[cell].xIndex / BLOCKSIZE) * blocksPerSide + cells[cell].yIndex / BLOCKSIZE; }
+	// Outside the domain counts as single cells 
+	inline int LeafSizeAt(int x, int y) const { return x < 0 || y < 0 || x >= sideLength || y >= sideLength ? 1 : leafSizes[CellIndex(x, y)]; }
+	inline bool CellAsleep(int cell) const { return sleepingBlockCount > 0 && blockAsleep[BlockOf(cell)]; }
+	inline bool ParticleAsleep(unsigned int particle) const { return sleepingBlockCount > 0 && particles.GetCell(particle) >= 0 && blockAsleep[BlockOf(particles.GetCell(particle))]; }
+	inline bool AllAsleep() const { return sleepingBlockCount > 0 && sleepingBlockCount == activeBlockCount && !cellListsDirty; }
+
+	glm::vec2 GetCellVel(const Cell& cell) const;
+
+	/// <param name="cellsAssigned">Every particles cell is already up to date</param>
+	void RebuildCellLists(bool cellsAssigned = false);
+	void RemoveFromCellLists(unsigned int particle);
+	void SortParticlesIfNeeded();
+
+	int PosToCellIndex(glm::vec2 pos) const;
+	int PosToBlock(glm::vec2 pos) const;
+	void ClampToDomain(glm::vec2& pos, glm::vec2& vel, float axisMin, float axisLimt) const;
+	void UpdateParticlesFused(float timeStep, int cellWallThickness, glm::vec2 mouse, float radius, bool pushFromMouse);
+	void AdvectBlock(int begin, int end, float timeStep, glm::vec2 gravityStep, glm::vec2* moved) const;
+	glm::vec2 SampleGridVelocity(glm::vec2 pos, glm::vec2 fallback) const;
+	void ResampleParticles();
+
+	void UpdateActiveBlocks();
+	void RetireBlock(unsigned int block);
+	int TakePage();
+	void AllocatePage(unsigned int block);
+	void FreePage(unsigned int block);
+	void LinkBlock(unsigned int block);
+	void BlockBounds(unsigned int block, int width, int height, glm::ivec2& min, glm::ivec2& max) const;
+	bool CellInObstacle(int x, int y) const;
+	unsigned char RestingCellType(int cell) const;
+	void RestCells(glm::ivec2 min, glm::ivec2 max);
 
-	glm::vec2 GetCellVel(Cell cell);
-
-	void AddParticleToCell(Particle* particle);
+	/// <summary>
+	/// Call func(face, x, y, horizontal) for every face of the active blocks,
+	/// blocks in parallel. func may only write to the face it is given 
+	/// </summary>
+	template<typename Func>
+	void ForActiveFaces(const Func& func) const;
 
-	void TransferToVelField(std::vector<Cell> *nextValues);
-	void MakeIncompressible(std::vector<Cell>* nextValues, int iterations, float overrelaxation, float densityMultipier);
-	void AddChangeToParticles(std::vector<Cell>* nextValues, float timeStep);
+	/// <summary>
+	/// Call func(cell) for every cell of the blocks that held particles when
+	/// the cell lists were last built, block after block 
+	/// </summary>
+	template<typename Func>
+	void ForOccupiedCells(const Func& func);
+
+	void ClassifyCells();
+	void CloseSolidFaces();
+	void ExtrapolateVelocities();
+	void ExtrapolateFace(int face, int x, int y, bool horizontal);
+	void ComputeStencils();
+	void FillStaggeredAxis(glm::vec2 lattice, bool horizontal, int* faces, glm::vec2& fraction) const;
+	void TransferToVelField();
+	void TransferToVelFieldAffine();
+	void MakeIncompressible(int iterations, float overrelaxation, float densityMultipier);
+	void BuildQuadtree();
+	void AddLeaves(int x, int y, int size);
+	bool IsDeepFluid(int x, int y, int size) const;
+	bool TouchesAir(int x, int y) const;
+	void SolveCell(unsigned int c, float overrelaxation, float densityMultipier);
+	void SolveLeaf(const QuadLeaf& leaf, float overrelaxation, float densityMultipier);
+	void FillLeafInterior(const QuadLeaf& leaf);
+	float SampleLiquidPhi(glm::vec2 pos) const;
+	bool TouchesLiquid(int x, int y, bool horizontal) const;
+	void AdvectInterior(float timeStep);
+	void FillInteriorFaces();
+	void MeasureDepth();
+	int SeedCell(int c, int count);
+	void CullAndReseed();
+	bool IsBlockCalm(unsigned int block) const;
+	void UpdateSleep();
+	void WakeBlock(unsigned int block);
+	void WakeRegion(glm::vec2 min, glm::vec2 max);
+	void WakeAll();
+	void AddChangeToParticles(float timeStep);
+	void AddChangeToParticlesAffine();
 
 
 public:
@@ -284,22 +462,205 @@ public:
 	/// <param name="_gravity">How much are fluid particles accelerated downards</param>
 	/// <param name="_cellSize">What is the size in pixels of each cell</param>
 	/// <param name="_sideLength">How many cells make up one size of the square simulation area</param>
-	Fluid(float _gravity, glm::vec3 startVel, float _cellSize, int _sideLength, int particleCount, float particleSize);
+	/// <param name="maxParticleCount">How many particles can exist at once, allocated up front</param>
+	/// <param name="layout">Order the cells and faces are stored in within a block</param>
+	Fluid(float _gravity, glm::vec3 startVel, float _cellSize, int _sideLength, int particleCount, int maxParticleCount, float particleSize, GridLayout::Mode layout = GridLayout::Tiled);
 	~Fluid();
 
 	void SetGravity(float g);
+
+	/// <summary>
+	/// Replace the obstacles. The field has to cover the whole grid,
+	/// sideLength * cellSize on each side 
+	/// </summary>
+	void SetObstacles(const DistanceField& field);
+
+	/// <summary>
+	/// Make a disc of the obstacles solid or empty. Only the distances near
+	/// the brush are recomputed and only the cells under them updated.
+	/// Particles buried by new wall are removed 
+	/// </summary>
+	void PaintObstacle(glm::vec2 center, float radius, bool solid);
 	void SetParticlePosition(unsigned int index, glm::vec3 pos);
-	void CorrectParticlePos(Particle* particle, float trueCellSize, int cellWallThickness);
+	void CorrectParticlePos(unsigned int particle, float trueCellSize, int cellWallThickness);
+
+	/// <summary>
+	/// Add many particles at once 
+	/// </summary>
+	/// <param name="velocities">Velocity per particle or nullptr to start at rest</param>
+	/// <returns>How many were added, positions inside obstacles are skipped</returns>
+	unsigned int SpawnParticles(const glm::vec2* positions, const glm::vec2* velocities, unsigned int count);
+
+	void KillParticle(unsigned int particle);
+	/// <summary>
+	/// Remove many particles at once. The indices are sorted in place 
+	/// </summary>
+	void KillParticles(unsigned int* indices, unsigned int count);
 
-	Particle* GetParticle(int index);
-	Entity GetEntity(int index);
 	glm::mat4 GetModel(int index);
 
+	/// <summary>
+	/// Goes up by one when a change to the particles or grid starts and again
+	/// when it ends. A reader on another thread can copy out of a view and then
+	/// compare generations to know whether the copy is a consistent snapshot
+	/// </summary>
+	inline unsigned int GetGeneration() const { return generation.load(std::memory_order_acquire); }
+
+	/// <summary>
+	/// Particle centres packed one after another, ready for a buffer upload 
+	/// </summary>
+	View<glm::vec2> GetPositionView() const;
+	View<glm::vec2> GetVelocityView() const;
+
+	// Cell lists as of the end of the last step or UpdateCellLists. Particles
+	// spawned or moved by hand since then are not listed yet. The cell views
+	// cover every page, pages not in use keep whatever they last held 
+	View<Cell> GetCellView() const;
+	View<unsigned int> GetOccupancyView() const;
+	View<float> GetFaceVelocityView() const;
+
+	/// <summary>
+	/// CellType of every cell and the indices of the fluid cells, as of the
+	/// last SimulateFlip 
+	/// </summary>
+	View<unsigned char> GetCellTypeView() const;
+	View<unsigned int> GetActiveCellView() const;
+
+	/// <summary>
+	/// Blocks taking part in the step. The cells of a block are stored
+	/// together in the cell views, GetBlockCellCount of them from
+	/// GetBlockFirstCell on. Blocks on the far edge are padded with cells
+	/// past the grid 
+	/// </summary>
+	View<unsigned int> GetActiveBlockView() const;
+	inline unsigned int GetBlockFirstCell(unsigned int block) const { return blockPages[block] * PAGESIZE; }
+	inline unsigned int GetBlockCellCount() const { return PAGESIZE; }
+
+	// Blocks taking part in the step, blocks holding a page and all of them 
+	inline unsigned int GetActiveBlockCount() const { return activeBlockCount; }
+	inline unsigned int GetPageCount() const { return cells.size() / PAGESIZE - 1 - freePages.size(); }
+	inline unsigned int GetBlockCount() const { return blockSlots.size(); }
+
+	View<unsigned int> GetIdView() const;
+
+	// Ids stay with a particle while sorting and removal change its index 
+	inline unsigned int GetParticleId(unsigned int index) const { return particles.GetId(index); }
+	inline unsigned int GetParticleIndex(unsigned int id) const { return particles.GetIndex(id); }
+
+	/// <summary>
+	/// How shuffled the particles may get before they are sorted again. Measured
+	/// as the fraction of neighbouring particles that are out of Z-order, so
+	/// zero sorts every step and one never sorts
+	/// </summary>
+	inline void SetSortThreshold(float threshold) { sortThreshold = threshold; }
+	inline float GetDisorder() const { return disorder; }
+
+	/// <summary>
+	/// Run the per particle steps as one pass or as the separate loops they
+	/// started as, which is easier to step through 
+	/// </summary>
+	inline void SetFusedParticleUpdate(bool fused) { fuseParticleUpdate = fused; }
+	inline unsigned int GetSortCount() const { return sortCount; }
+
+	/// <summary>
+	/// Every interval steps merge particles in cells holding more than
+	/// maxPerCell and seed new ones into fluid cells below the surface with
+	/// fewer than minPerCell. An interval of 0 turns it off 
+	/// </summary>
+	void SetResampling(int interval, int minPerCell, int maxPerCell);
+	// Particles merged away and seeded in the last resample 
+	inline unsigned int GetResampleMerges() const { return resampleMerges; }
+	inline unsigned int GetResampleSeeds() const { return resampleSeeds; }
+
+	/// <summary>
+	/// APIC keeps a velocity gradient per particle, so rotation and shear
+	/// survive the trip through the grid with fewer particles per cell 
+	/// </summary>
+	inline void SetTransferMode(TransferMode mode) { transferMode = mode; }
+	inline TransferMode GetTransferMode() const { return transferMode; }
+
+	/// <summary>
+	/// Runge-Kutta advection costs two or three grid lookups per particle but
+	/// stays accurate at steps where Euler overshoots 
+	/// </summary>
+	inline void SetAdvectionMode(AdvectionMode mode) { advectionMode = mode; }
+	inline AdvectionMode GetAdvectionMode() const { return advectionMode; }
+
+	/// <summary>
+	/// How many faces deep velocities are carried from the fluid into the
+	/// air, so particles at the surface read sensible values 
+	/// </summary>
+	inline void SetExtrapolationLayers(int layers) { extrapolationLayers = glm::max(layers, 0); }
+
+	/// <summary>
+	/// Let the pressure solve merge deep fluid into square leaves of up to
+	/// maxSize cells, a power of two up to the block size. 1 keeps every
+	/// cell fine. band is how many cells from air or solid stay fine 
+	/// </summary>
+	void SetQuadtree(int maxSize, int band);
+	// Unknowns in the last pressure solve 
+	inline unsigned int GetQuadLeafCount() const { return maxLeafSize > 1 ? quadLeafCount : activeCellCount; }
+
+	/// <summary>
+	/// Only keep particles within band cells of the liquid surface. The deep
+	/// interior is carried by the grid alone, and cells the band moves into
+	/// are seeded with seedsPerCell particles. A band of 0 turns it off and
+	/// fills the interior with particles again 
+	/// </summary>
+	void SetNarrowBand(int band, int seedsPerCell);
+	inline int GetNarrowBand() const { return narrowBand; }
+	// Particles removed from the interior and added to the band in the last step 
+	inline unsigned int GetBandCulls() const { return bandCulls; }
+	inline unsigned int GetBandSeedings() const { return bandSeedings; }
+
+	/// <summary>
+	/// Let blocks whose face speeds and divergence stay under speed and
+	/// divergence for steps steps in a row sleep. A sleeping block costs
+	/// nothing until something disturbs it. Gravity over the steps should add
+	/// more than speed, or fluid let go from rest can sleep before it falls.
+	/// 0 steps keeps every block awake 
+	/// </summary>
+	void SetSleeping(int steps, float speed, float divergence);
+	inline unsigned int GetSleepingBlockCount() const { return sleepingBlockCount; }
+
+	/// <summary>
+	/// Mix between the PIC velocity (0), which is smooth but damped, and the
+	/// FLIP velocity (1), which keeps detail but gets noisy 
+	/// </summary>
+	inline void SetFlipBlend(float blend) { flipBlend = glm::clamp(blend, 0.0f, 1.0f); }
+	inline float GetFlipBlend() const { return flipBlend; }
+
+	/// <summary>
+	/// Speed of the fastest particle, found with a parallel reduction 
+	/// </summary>
+	float GetMaxParticleSpeed() const;
+
+	/// <summary>
+	/// Largest step that moves no particle further than cfl cells, counting
+	/// the speed gravity can add over the step 
+	/// </summary>
+	float GetStableTimeStep(float cfl) const;
+
+	inline int GetParticleCount() const { return particles.GetCount(); }
+	inline GridLayout::Mode GetLayout() const { return cellLayout.GetMode(); }
+	inline int GetMaxParticleCount() const { return particles.GetCapacity(); }
+
 	Cell* PosToCell(glm::vec2 pos, float trueCellSize);
 
-	void SimulateParticles(float timeStep, int maxParticleChecks, int cellWallThickness, glm::vec3 mousePos, const float& MOUSERADIUS, int paintMode, float particleSize);
+	/// <summary>
+	/// Write every particle listed in a cell that overlaps the rectangle, stopping
+	/// once the buffer is full 
+	/// </summary>
+	/// <returns>How many were written, equal to capacity when some did not fit</returns>
+	unsigned int CollectParticlesInRect(glm::vec2 min, glm::vec2 max, unsigned int* out, unsigned int capacity);
+
+	/// <summary>
+	/// Bring the cell lists up to date if anything changed since they were built 
+	/// </summary>
+	void UpdateCellLists();
+
+	void SimulateParticles(float timeStep, int maxParticleChecks, int cellWallThickness, glm::vec3 mousePos, const float& MOUSERADIUS, int paintMode);
 	void SimulateFlip(float timeStep, int iterations, float overrelaxation, float densityMultiplier);
 
 	glm::vec3 GetCellPos(int xIndex, int yIndex);
-	std::vector<Cell> GetCells();
 };
\ No newline at end of file
@@ -0,0 +1,75 @@
+#include "FrameBuffer.h"
+#include "Renderer.h"
+
+#include <iostream>
+
+FrameBuffer::FrameBuffer(int width, int height)
+    : m_RendererID(0), m_ColorTexture(0), m_Width(0), m_Height(0)
+{
+    GLCall(glGenFramebuffers(1, &m_RendererID));
+    GLCall(glGenTextures(1, &m_ColorTexture));
+
+    Resize(width, height);
+}
+
+FrameBuffer::~FrameBuffer()
+{
+    GLCall(glDeleteTextures(1, &m_ColorTexture));
+    GLCall(glDeleteFramebuffers(1, &m_RendererID));
+}
+
+void FrameBuffer::Resize(int width, int height)
+{
+    // An empty attachment leaves the framebuffer incomplete, keep the last size 
+    if (width <= 0 || height <= 0)
+        return;
+
+    if (width == m_Width && height == m_Height)
+        return;
+
+    m_Width = width;
+    m_Height = height;
+
+    GLCall(glBindTexture(GL_TEXTURE_2D, m_ColorTexture));
+    GLCall(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR));
+    GLCall(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR));
+    GLCall(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE));
+    GLCall(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE));
+    GLCall(glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, m_Width, m_Height, 0, GL_RGBA, GL_UNSIGNED_BYTE, nullptr));
+    GLCall(glBindTexture(GL_TEXTURE_2D, 0));
+
+    GLCall(glBindFramebuffer(GL_FRAMEBUFFER, m_RendererID));
+    GLCall(glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, m_ColorTexture, 0));
+
+    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+    {
+        std::cout << "[FrameBuffer] Incomplete at " << m_Width << "x" << m_Height << std::endl;
+    }
+
+    GLCall(glBindFramebuffer(GL_FRAMEBUFFER, 0));
+}
+
+void FrameBuffer::Bind(int viewportWidth, int viewportHeight) const
+{
+    GLCall(glBindFramebuffer(GL_FRAMEBUFFER, m_RendererID));
+    GLCall(glViewport(0, 0, viewportWidth, viewportHeight));
+}
+
+void FrameBuffer::Unbind() const
+{
+    GLCall(glBindFramebuffer(GL_FRAMEBUFFER, 0));
+}
+
+void FrameBuffer::BlitToScreen(int sourceWidth, int sourceHeight, int screenWidth, int screenHeight) const
+{
+    GLCall(glBindFramebuffer(GL_READ_FRAMEBUFFER, m_RendererID));
+    GLCall(glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0));
+
+    // Nearest is enough when nothing is being scaled 
+    unsigned int filter = (sourceWidth == screenWidth && sourceHeight == screenHeight) ? GL_NEAREST : GL_LINEAR;
+    GLCall(glBlitFramebuffer(0, 0, sourceWidth, sourceHeight, 0, 0, screenWidth, screenHeight, GL_COLOR_BUFFER_BIT, filter));
+
+    // Anything drawn afterwards (the gui) is at native resolution 
+    GLCall(glBindFramebuffer(GL_FRAMEBUFFER, 0));
+    GLCall(glViewport(0, 0, screenWidth, screenHeight));
+}
\ No newline at end of file
@@ -0,0 +1,33 @@
+#pragma once
+
+/// <summary>
+/// Offscreen color target the scene can be drawn into at a lower
+/// resolution and then stretched to the window 
+/// </summary>
+class FrameBuffer
+{
+private:
+	unsigned int m_RendererID;
+	unsigned int m_ColorTexture;
+	int m_Width, m_Height;
+public:
+	FrameBuffer(int width, int height);
+	~FrameBuffer();
+
+	void Resize(int width, int height);
+
+	/// <summary>
+	/// Draw into the lower left viewportWidth x viewportHeight corner. Storage
+	/// is kept at full size so changing the scale never reallocates
+	/// </summary>
+	void Bind(int viewportWidth, int viewportHeight) const;
+	void Unbind() const;
+
+	/// <summary>
+	/// Stretch the drawn corner over the whole window in one filtered blit 
+	/// </summary>
+	void BlitToScreen(int sourceWidth, int sourceHeight, int screenWidth, int screenHeight) const;
+
+	inline int GetWidth() const { return m_Width; }
+	inline int GetHeight() const { return m_Height; }
+};
\ No newline at end of file
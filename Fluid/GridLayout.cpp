@@ -0,0 +1,72 @@
+#include "GridLayout.h"
+#include "Morton.h"
+
+#include <algorithm>
+
+GridLayout::GridLayout()
+	:mode(Linear), width(0), height(0)
+{
+}
+
+GridLayout::GridLayout(Mode _mode, int _width, int _height)
+	:mode(_mode), width(_width), height(_height)
+{
+	int size = width * height;
+	slots = std::vector<int>(size);
+	xCoords = std::vector<int>(size);
+	yCoords = std::vector<int>(size);
+
+	// Rank every coordinate by its key in the layout, which packs the slots
+	// even when the grid is not a multiple of the tile or a power of two 
+	std::vector<unsigned long long> order(size);
+	for (int x = 0; x < width; x++)
+	{
+		for (int y = 0; y < height; y++)
+		{
+			unsigned long long coordinate = x * height + y;
+			order[coordinate] = ((unsigned long long)LayoutKey(x, y) << 32) | coordinate;
+		}
+	}
+	std::sort(order.begin(), order.end());
+
+	for (int slot = 0; slot < size; slot++)
+	{
+		int coordinate = (int)(order[slot] & 0xFFFFFFFF);
+		slots[coordinate] = slot;
+		xCoords[slot] = coordinate / height;
+		yCoords[slot] = coordinate % height;
+	}
+}
+
+/// <summary>
+/// Sort key of a coordinate, unique within the grid 
+/// </summary>
+unsigned int GridLayout::LayoutKey(int x, int y) const
+{
+	switch (mode)
+	{
+	case Tiled:
+	{
+		int tilesHigh = (height + TILESIZE - 1) / TILESIZE;
+		int tile = (x / TILESIZE) * tilesHigh + (y / TILESIZE);
+		return tile * TILESIZE * TILESIZE + (x % TILESIZE) * TILESIZE + (y % TILESIZE);
+	}
+	case ZOrder:
+		return Morton::Encode(x, y);
+	default:
+		return x * height + y;
+	}
+}
+
+const char* GridLayout::GetModeName(Mode mode)
+{
+	switch (mode)
+	{
+	case Tiled:
+		return "Tiled";
+	case ZOrder:
+		return "Z-Order";
+	default:
+		return "Linear";
+	}
+}
\ No newline at end of file
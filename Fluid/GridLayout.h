@@ -0,0 +1,52 @@
+#pragma once
+
+#include <vector>
+
+/// <summary>
+/// Maps 2D grid coordinates to where they are stored in a flat array. Slots
+/// are packed with no padding whatever the mode, so the arrays stay exactly
+/// width * height long and a loop over the array visits the grid in layout
+/// order, tile by tile in the tiled mode
+/// </summary>
+class GridLayout
+{
+public:
+	enum Mode
+	{
+		Linear = 0, // Column after column, x * height + y 
+		Tiled = 1,  // TILESIZE square blocks, each stored column after column 
+		ZOrder = 2  // Morton order of the coordinates 
+	};
+
+	static const int TILESIZE = 8;
+
+private:
+	Mode mode;
+	int width;
+	int height;
+
+	// Slot of every coordinate (x * height + y) and the coordinates of every slot 
+	std::vector<int> slots;
+	std::vector<int> xCoords;
+	std::vector<int> yCoords;
+
+	unsigned int LayoutKey(int x, int y) const;
+public:
+	GridLayout();
+	GridLayout(Mode _mode, int _width, int _height);
+
+	inline int Index(int x, int y) const
+	{
+		return mode == Linear ? x * height + y : slots[x * height + y];
+	}
+
+	inline int GetX(int slot) const { return xCoords[slot]; }
+	inline int GetY(int slot) const { return yCoords[slot]; }
+
+	inline int GetSize() const { return width * height; }
+	inline int GetWidth() const { return width; }
+	inline int GetHeight() const { return height; }
+	inline Mode GetMode() const { return mode; }
+
+	static const char* GetModeName(Mode mode);
+};
\ No newline at end of file
@@ -13,6 +13,12 @@
 #include "VertexArray.h"
 #include "Shader.h"
 #include "Texture.h"
+#include "UniformBuffer.h"
+#include "TextureBuffer.h"
+#include "FrameBuffer.h"
+#include "RenderScale.h"
+#include "Profiler.h"
+#include "AllocationTracker.h"
 
 #include "glm/glm.hpp"
 #include "glm/gtc/matrix_transform.hpp"
@@ -28,6 +34,9 @@
 #include <string.h>
 
 #include "Fluid.h"
+#include "Emitter.h"
+#include "PoissonSampler.h"
+#include "Parallel.h"
 #include "Collision.h"
 #include "Main.h" // Auto generated?? 
 
@@ -38,11 +47,22 @@ const float GetRand()
     return ((double)rand() / (RAND_MAX));
 }
 
-void SetColor(Shader& shader, glm::vec4& color)
+/// <summary>
+/// Handles into Basic.shader that are resolved once after linking 
+/// </summary>
+struct BasicUniforms
 {
-    shader.Bind();
-    shader.SetUniform4f("u_Color", color.r, color.g, color.b, color.a);
-    shader.Unbind();
+    Uniform<glm::mat4> mvp;
+    Uniform<glm::vec4> color;
+    Uniform<int> texture;
+};
+
+/// <summary>
+/// Expects the shader to already be bound 
+/// </summary>
+void SetColor(Shader& shader, BasicUniforms& uniforms, glm::vec4& color)
+{
+    shader.SetUniform(uniforms.color, color);
 }
 
 void PrintVec3(glm::vec3 vector)
@@ -62,16 +82,17 @@ void CursorPositionCallback(GLFWwindow* window, double xPos, double yPos)
 /// <summary>
 /// Logic that applies to each particle 
 /// </summary>
-void ParticleLogic(const int& PARTICLECOUNT, glm::mat4& proj, glm::mat4& view, Fluid& fluid, Shader& shader, Renderer& renderer, VertexArray& va, IndexBuffer& ib, bool showParticles)
+void ParticleLogic(const int& PARTICLECOUNT, glm::mat4& proj, glm::mat4& view, Fluid& fluid, Shader& shader, BasicUniforms& uniforms, Renderer& renderer, VertexArray& va, IndexBuffer& ib, bool showParticles)
 {
+    glm::mat4 viewProj = proj * view;
+    shader.Bind();
+
     for (unsigned int i = 0; i < PARTICLECOUNT; i++)
     {
         glm::mat4 model = fluid.GetModel(i);
 
-        glm::mat4 mvp = proj * view * model;
-        shader.Bind();
-
-        shader.SetUniformMat4f("u_MVP", mvp);
+        glm::mat4 mvp = viewProj * model;
+        shader.SetUniform(uniforms.mvp, mvp);
 
         if(showParticles)
             renderer.Draw(va, ib, shader);
@@ -79,93 +100,154 @@ void ParticleLogic(const int& PARTICLECOUNT, glm::mat4& proj, glm::mat4& view, F
 }
 
 /// <summary>
-/// Logic that applies to each cell in the grid 
+/// Logic that applies to each cell in the grid. Only works out what each cell
+/// shows, the cells are drawn in one call that takes the matrices and
+/// colours from the frame uniforms. Only the cells of the active blocks are
+/// drawn, the rest of the domain holds no fluid 
 /// </summary>
-void GridLogic(const float& CELLSIZE, const float& CELLSPACINGSIZE, const int& GRIDSIZECOUNT, const float& CELLVISUALSCALAR, const int& PARTICLECOUNT, const float& MOUSERADIUS, glm::vec4& commonCellColor, glm::vec4& SOLIDCELLCOLOR, glm::vec4& barrierColor, glm::mat4& proj, glm::mat4& view, Shader& shader, Renderer& renderer, VertexArray& va, IndexBuffer& ib, Fluid& fluid, glm::vec2 mousePos, bool showCellHasParticles, float cellWallThickness)
+void GridLogic(const int& GRIDSIZECOUNT, const float& MOUSERADIUS, Shader& shader, Renderer& renderer, VertexArray& emptyVa, TextureBuffer& gridCellBuffer, std::vector<unsigned int>& gridCells, Fluid& fluid, glm::vec2 mousePos, bool showCellHasParticles, float cellWallThickness)
 {
-    std::vector<Cell> cells = fluid.GetCells();
-
-    int cellCount = cells.size();
-    float trueCellSize = CELLSIZE + CELLSPACINGSIZE;
+    View<Cell> cells = fluid.GetCellView();
+    View<unsigned char> cellTypes = fluid.GetCellTypeView();
+    View<unsigned int> activeBlocks = fluid.GetActiveBlockView();
 
-    //Cell* mouseCell = fluid.PosToCell(mousePos, trueCellSize);
-    //std::cout << mouseCell << std::endl;
-
-    for (unsigned int i = 0; i < cellCount; i++)
+    gridCells.clear();
+    for (unsigned int a = 0; a < activeBlocks.GetSize(); a++)
     {
-        Cell* current = &cells[i];
-        int x = (*current).xIndex;
-        int y = (*current).yIndex;
-
-
-
-        if (showCellHasParticles)
+        unsigned int first = fluid.GetBlockFirstCell(activeBlocks[a]);
+        for (unsigned int i = first; i < first + fluid.GetBlockCellCount(); i++)
         {
-            if (current->GetParticleCount() > 0)
+            const Cell* current = &cells[i];
+            int x = (*current).xIndex;
+            int y = (*current).yIndex;
+
+            // Blocks on the far edge are padded past the grid 
+            if (x >= GRIDSIZECOUNT || y >= GRIDSIZECOUNT)
+                continue;
+
+            // Matches the branches of Grid.shader, 0 empty, 1 fluid, 2 barrier 
+            unsigned int kind = 0;
+            if (cellTypes[i] == Fluid::SolidCell || (x < cellWallThickness) || (x + cellWallThickness >= GRIDSIZECOUNT) ||
+                (y < cellWallThickness) || (y + cellWallThickness >= GRIDSIZECOUNT))
             {
-                SetColor(shader, SOLIDCELLCOLOR);
+                // Cell wall
+                kind = 2;
             }
-            else
+            else if (showCellHasParticles && cellTypes[i] == Fluid::FluidCell)
             {
-
-                if ((current->xIndex < cellWallThickness) || (current->xIndex + cellWallThickness >= GRIDSIZECOUNT) ||
-                    (current->yIndex < cellWallThickness) || (current->yIndex + cellWallThickness >= GRIDSIZECOUNT))
-                {
-                    // Cell wall
-                    SetColor(shader, barrierColor);
-                }
-                else
-                {
-                    SetColor(shader, commonCellColor);
-                }
+                kind = 1;
             }
-        }
-        else
-        {
 
-            if ((current->xIndex < cellWallThickness) || (current->xIndex + cellWallThickness >= GRIDSIZECOUNT) ||
-                (current->yIndex < cellWallThickness) || (current->yIndex + cellWallThickness >= GRIDSIZECOUNT))
-            {
-                // Cell wall
-                SetColor(shader, barrierColor);
-            }
-            else
+            // Show mouse radius 
+            if (glm::distance(fluid.GetCellPos(x, y), glm::vec3(mousePos, 0.0f)) <= MOUSERADIUS)
             {
-                SetColor(shader, commonCellColor);
+                kind = 2;
             }
-        }
 
-        // Show mouse radius 
-        if (glm::distance(fluid.GetCellPos(current->xIndex, current->yIndex), glm::vec3(mousePos, 0.0f)) <= MOUSERADIUS)
-        {
-            SetColor(shader, barrierColor);
+            // The shader places each cell from its coordinates, 15 bits each,
+            // with the kind in the top two bits 
+            gridCells.push_back((unsigned int)x | ((unsigned int)y << 15) | (kind << 30));
         }
+    }
 
+    // Render Grid 
+    gridCellBuffer.SetData(gridCells.data(), gridCells.size() * sizeof(unsigned int));
+    gridCellBuffer.Bind(2);
+    renderer.DrawArrays(emptyVa, 6 * gridCells.size(), shader);
+}
 
-        // Get the center of a cell by taking into account
-            // size and borders 
-        glm::vec3 center = glm::vec3
-        (
-            x * trueCellSize + (trueCellSize / 2.0f),
-            y * trueCellSize + (trueCellSize / 2.0f),
-            0.0f
-        );
+/// <summary>
+/// Steps the simulation without a window and fails if it still allocates once
+/// it has settled. Started with --check-allocations. Builds that do not
+/// track allocations, see AllocationTracker.h, fail instead of passing
+/// with nothing counted
+/// </summary>
+/// <returns>Exit code, zero when the checked steps made no allocation</returns>
+int RunAllocationCheck(Fluid& fluid, float spacing, const float& TIMESTEP, const int& MAXPARTICLECHECKS, int cellWallThickness)
+{
+    if (!AllocationTracker::IsEnabled())
+    {
+        std::cerr << "[AllocationCheck] FAILED: this build does not track allocations, so it can not be checked." << std::endl;
+        std::cerr << "[AllocationCheck] Run a Debug build or define FLUID_TRACK_ALLOCATIONS and rebuild." << std::endl;
+        return 2;
+    }
 
-        // Move 
-        glm::mat4 model = glm::translate(glm::mat4(1.0f), center);
-        // Scale 
-        model = glm::scale(model, glm::vec3(CELLVISUALSCALAR, CELLVISUALSCALAR, CELLVISUALSCALAR));
+    // Same every run so a failure can be reproduced 
+    srand(1);
 
-        // Render Grid 
-        glm::mat4 mvp = proj * view * model;
-        shader.Bind();
+    EmitterSystem emitters(spacing, 1024);
+    const int BRUSHEMITTER = emitters.AddStroke(glm::vec2(0), glm::vec2(0), 40.0f, 300.0f, glm::vec2(0));
+    const int BRUSHSINK = emitters.AddDiscSink(glm::vec2(0), 40.0f, 0.0f);
+
+    Profiler profiler;
+    const int EMITTERSTAGE = profiler.AddStage("Emitters", false);
+    const int FLIPSTAGE = profiler.AddStage("Flip", false);
+    const int PARTICLESIMSTAGE = profiler.AddStage("Particle Sim", false);
+
+    // Long enough for every list and batch to reach the size it needs 
+    const int WARMUPSTEPS = 600;
+    const int CHECKSTEPS = 300;
+
+    unsigned long long totalAllocations = 0;
+    unsigned long long totalBytes = 0;
+    glm::vec2 brushPos = glm::vec2(220.0f, 200.0f);
+
+    for (int step = 0; step < WARMUPSTEPS + CHECKSTEPS; step++)
+    {
+        // The brush wanders over the grid and switches between painting and erasing 
+        float t = step * TIMESTEP;
+        glm::vec2 lastBrushPos = brushPos;
+        brushPos = glm::vec2(220.0f + 120.0f * glm::sin(t), 200.0f + 80.0f * glm::cos(t * 0.7f));
+        bool painting = (step / 60) % 2 == 0;
+
+        Emitter& brushEmitter = emitters.Get(BRUSHEMITTER);
+        brushEmitter.enabled = painting;
+        brushEmitter.start = lastBrushPos;
+        brushEmitter.end = brushPos;
+        brushEmitter.radius = 25.0f + 15.0f * glm::sin(t * 0.3f);
+
+        Emitter& brushSink = emitters.Get(BRUSHSINK);
+        brushSink.enabled = !painting;
+        brushSink.start = brushPos;
+
+        profiler.BeginFrame();
+
+        profiler.Begin(EMITTERSTAGE);
+        emitters.Update(fluid, TIMESTEP);
+        profiler.End(EMITTERSTAGE);
+
+        profiler.Begin(FLIPSTAGE);
+        fluid.SimulateFlip(TIMESTEP, 7, 1.0f, 1.0f);
+        profiler.End(FLIPSTAGE);
 
-        shader.SetUniformMat4f("u_MVP", mvp);
-        renderer.Draw(va, ib, shader);
+        profiler.Begin(PARTICLESIMSTAGE);
+        fluid.SimulateParticles(TIMESTEP, MAXPARTICLECHECKS, cellWallThickness, glm::vec3(brushPos, 0.0f), 40.0f, painting ? 1 : 2);
+        profiler.End(PARTICLESIMSTAGE);
+
+        if (step < WARMUPSTEPS)
+            continue;
+
+        for (int stage = 0; stage < profiler.GetStageCount(); stage++)
+        {
+            if (profiler.GetAllocations(stage) == 0)
+                continue;
+
+            std::cout << "[AllocationCheck] Step " << step << " " << profiler.GetName(stage) << ": "
+                << profiler.GetAllocations(stage) << " allocations, " << profiler.GetAllocatedBytes(stage) << " bytes over "
+                << profiler.GetRuns(stage) << " runs" << std::endl;
+
+            totalAllocations += profiler.GetAllocations(stage);
+            totalBytes += profiler.GetAllocatedBytes(stage);
+        }
     }
+
+    std::cout << "[AllocationCheck] " << CHECKSTEPS << " steps with " << fluid.GetParticleCount() << " particles: "
+        << totalAllocations << " allocations, " << totalBytes << " bytes" << std::endl;
+
+    return totalAllocations == 0 ? 0 : 1;
 }
 
-int main(void)
+int main(int argc, char** argv)
 {
     #pragma region Intialize 
 
@@ -175,6 +257,7 @@ int main(void)
 
     // Particle
     const int PARTICLECOUNT = 500;
+    const int MAXPARTICLECOUNT = 20000; // Painting can add particles up to this many 
     const float STANDARDSIZE = 18.0f; // Typically 10 
 
     // Cell Details 
@@ -182,33 +265,44 @@ int main(void)
     const float CELLSIZE = 20.0f;
     const float CELLSPACINGSIZE = 0.0f;
     const float CELLVISUALSCALAR = 1.0f;
+    const GridLayout::Mode GRIDLAYOUT = GridLayout::Tiled; // How cells and faces are ordered in memory 
 
     // Physics
-    const float TIMESTEP = 0.03f;
+    const float TIMESTEP = 0.03f; // Simulated time per frame 
+    const float MINTIMESTEP = 0.002f;
+    const float MAXTIMESTEP = TIMESTEP; // Never more than one frame, so every frame steps 
+    const int MAXSUBSTEPS = 8;
     const float STARTGRAVITY = -50.0f;
     const int MAXPARTICLECHECKS = 1;
+    const int RESAMPLEINTERVAL = 30; // Steps between resampling the particles per cell 
+    const int RESAMPLEMIN = 2;
+    const int RESAMPLEMAX = 8;
+    const int OBSTACLERESOLUTION = 4; // Distance field texels per cell side 
 
     // Spawning 
     const glm::vec3 STARTOFFSET = glm::vec3(190.0f, 100.0f, 0.0f);
     const float STARTRADIUS = 200.0f;
 
+    // Interaction 
+    const float MAXMOUSERADIUS = 90.0f; // Brush patterns are sampled out to this 
 
-    // Useful reference 
-    const unsigned int INDICIES[6] =
-    {
-        0, 1, 2,
-        2, 3, 0,
-    };
+    // Set random seed
+    srand(time(NULL));
 
+    #pragma endregion
 
+    #pragma region Allocation Check
+    if (argc > 1 && strcmp(argv[1], "--check-allocations") == 0)
+    {
+        Parallel::Start();
 
-    // Counts so easier to call 
-    int indiciesCount = 6 * PARTICLECOUNT;    // One Entity has 6 indicies 
-    int positionCount = 16 * PARTICLECOUNT;   // One Entity has 16 positions (Includes corners and UV)
-
-    // Set random seed
-    srand(time(NULL));
+        Fluid checkFluid(STARTGRAVITY, glm::vec3(0.0f), CELLSIZE, GRIDSIZECOUNT, 0, MAXPARTICLECOUNT, STANDARDSIZE, GRIDLAYOUT);
+        checkFluid.SetResampling(RESAMPLEINTERVAL, RESAMPLEMIN, RESAMPLEMAX);
+        int result = RunAllocationCheck(checkFluid, PoissonSampler::RadiusForCount(STARTRADIUS * STARTRADIUS, PARTICLECOUNT), TIMESTEP, MAXPARTICLECHECKS, 3);
 
+        Parallel::Stop();
+        return result;
+    }
     #pragma endregion
 
     #pragma region glfwWindow
@@ -238,6 +332,9 @@ int main(void)
 
     glewInit();
 
+    // Programs created with a deferred link get compiled on driver threads 
+    Shader::EnableParallelCompile();
+
 
     // Set up mouse callback 
     glfwSetCursorPosCallback(window, CursorPositionCallback);
@@ -245,45 +342,44 @@ int main(void)
     #pragma endregion
 
     #pragma region Rendering&Entity
-    
-    Fluid fluid(STARTGRAVITY, glm::vec3(0.0f, 20.0f, 0.0f), CELLSIZE, GRIDSIZECOUNT, PARTICLECOUNT, STANDARDSIZE);
-
-    // Set starting positions 
-    for (unsigned int i = 0; i < PARTICLECOUNT; i++)
-    {
-        glm::vec3 rand = glm::vec3(GetRand() * STARTRADIUS, GetRand() * STARTRADIUS, 0);
-        fluid.SetParticlePosition(i, STARTOFFSET + rand);
-    }
 
+    Parallel::Start();
     
-    // Vectors that contain the positions and indicies of all entities 
-    std::vector<float> flattenedPositions = std::vector <float>();
-    std::vector<unsigned int> indicies = std::vector <unsigned int>();
-    
+    const glm::vec3 STARTVEL = glm::vec3(0.0f, 20.0f, 0.0f);
+    Fluid fluid(STARTGRAVITY, STARTVEL, CELLSIZE, GRIDSIZECOUNT, 0, MAXPARTICLECOUNT, STANDARDSIZE, GRIDLAYOUT);
 
-    // Go through the vector and combine all the positions and indicies 
-
-    // Particle Positions 
-    for (unsigned int i = 0; i < PARTICLECOUNT; i++)
+    // Static obstacles from a mask image, bright pixels are solid 
+    for (int i = 1; i + 1 < argc; i++)
     {
-        Particle* current = fluid.GetParticle(i);
-        // Apply individual entity positions to main vector 
-        for (unsigned int p = 0; p < positionCount; p++)
+        if (strcmp(argv[i], "--obstacles") == 0)
         {
-            flattenedPositions.push_back((*current).positions[p]);
+            DistanceField obstacleField;
+            if (obstacleField.LoadMask(argv[i + 1], GRIDSIZECOUNT * CELLSIZE, GRIDSIZECOUNT * OBSTACLERESOLUTION))
+            {
+                fluid.SetObstacles(obstacleField);
+            }
         }
+    }
 
-        // Apply individual entity indicies to main vector 
-        for (unsigned int j = 0; j < indiciesCount / PARTICLECOUNT; j++)
-        {
-            indicies.push_back(INDICIES[j] + (i * 4));
-        }
+    // Set starting positions. Blue noise keeps the start evenly spaced so
+    // there is little overlap to separate in the first frames 
+    const float PARTICLESPACING = PoissonSampler::RadiusForCount(STARTRADIUS * STARTRADIUS, PARTICLECOUNT);
+    {
+        std::vector<glm::vec2> seeds;
+        PoissonSampler::SampleRect(glm::vec2(STARTOFFSET), glm::vec2(STARTOFFSET) + glm::vec2(STARTRADIUS), PARTICLESPACING, (unsigned int)time(NULL), seeds);
+
+        std::vector<glm::vec2> seedVelocities(seeds.size(), glm::vec2(STARTVEL));
+        fluid.SpawnParticles(seeds.data(), seedVelocities.data(), seeds.size());
     }
 
+    // Painting spawns along the stroke the mouse made this frame and removes under it 
+    EmitterSystem emitters(PARTICLESPACING, 1024);
+    const int BRUSHEMITTER = emitters.AddStroke(glm::vec2(0), glm::vec2(0), MAXMOUSERADIUS, 300.0f, glm::vec2(0));
+    const int BRUSHSINK = emitters.AddDiscSink(glm::vec2(0), 40.0f, 0.0f);
+    glm::vec2 lastMousePos;
 
-    // Get the beginning of each main vector 
-    float* posPointer = &flattenedPositions[0];
-    unsigned int* indexPointer = &indicies[0];
+    // One quad shared by every cell (and particles when not drawn procedurally) 
+    Entity quad(glm::vec3(0), STANDARDSIZE);
 
 
     // Blending 
@@ -299,6 +395,12 @@ int main(void)
      // Visual 
     bool showParticles = true;
     bool showCellHasParticles = true;
+    bool proceduralParticles = true;
+
+    // Resolution the scene is drawn at relative to the window 
+    float renderScaleValue = 1.0f;
+    bool dynamicRenderScale = false;
+    float targetFrameMs = 16.0f;
     
 
     glm::vec4 commonCellColor = glm::vec4(0.2f, 0.2f, 0.2f, 1.0f);
@@ -319,11 +421,33 @@ int main(void)
 
 
     bool isPaintbrush = false;
+    bool paintWalls = false; // Brush paints and erases obstacles instead of particles 
 
 
     // Physics 
     float overrelazation = 1.0f;
     float densityMultiplier = 1.0f;
+    bool fusedParticleUpdate = true;
+    float sortThreshold = 0.25f; // Fraction of particles out of grid order before they are sorted 
+    int resampleInterval = RESAMPLEINTERVAL;
+    int resampleMin = RESAMPLEMIN;
+    int resampleMax = RESAMPLEMAX;
+    int transferMode = Fluid::Flip;
+    int advectionMode = Fluid::EulerAdvection;
+    int extrapolationLayers = 2;
+    int maxLeafSize = 1; // Pressure quadtree off until raised 
+    int surfaceBand = 2;
+    int narrowBand = 0; // Particles everywhere until raised 
+    int bandSeeds = 4;
+    int sleepSteps = 0; // Blocks never sleep until raised 
+    float sleepSpeed = 20.0f;
+    float sleepDivergence = 20.0f;
+    bool adaptiveTimeStep = true;
+    float cflNumber = 1.0f; // Cells the fastest particle may cross in one step 
+    float stepDebt = 0.0f; // Simulated time owed to the frames so far 
+    float lastTimeStep = TIMESTEP;
+    int lastSubsteps = 1;
+    float flipBlend = 1.0f; // 0 is PIC, 1 is FLIP 
 
 
     #pragma endregion
@@ -335,7 +459,7 @@ int main(void)
         GLCall(glBindVertexArray(vao));
 
         VertexArray va;
-        VertexBuffer vb(posPointer, (positionCount) * sizeof(float));
+        VertexBuffer vb(quad.positions, 4 * 4 * sizeof(float));
         VertexBufferLayout layout;
 
         layout.Push<float>(2);
@@ -343,20 +467,62 @@ int main(void)
 
         va.AddBuffer(vb, layout);
 
-        IndexBuffer ib(indexPointer, 6);
+        IndexBuffer ib(quad.INDICIES, 6);
+
+        // Procedural particles pull everything from the position buffer 
+        VertexArray emptyVa;
+        TextureBuffer particlePositions(GL_RG32F);
+        particlePositions.Reserve(fluid.GetMaxParticleCount() * sizeof(glm::vec2));
+
+        // Where the cells of the active blocks are and what they show,
+        // uploaded once a frame for the grid pass. Grows with the fluid 
+        std::vector<unsigned int> gridCells;
+        TextureBuffer gridCellBuffer(GL_R32UI);
 
         // Setup matricies 
         glm::mat4 proj = glm::ortho(0.0f, (float)WIDTH, 0.0f, (float)HEIGHT, -1.0f, 1.0f);
         glm::mat4 view = glm::translate(glm::mat4(1.0f), glm::vec3(0, 0, 0));
 
-        // Setup shader 
-        Shader shader("res/shaders/Basic.shader");
+        // Per frame data shared by every program 
+        Shader::DeclareUniformBlock("FrameData", UniformBuffer::FRAMEBINDING);
+        UniformBuffer frameUniformBuffer(sizeof(FrameUniforms), UniformBuffer::FRAMEBINDING);
+        FrameUniforms frameUniforms;
+
+        // Setup shaders. All compiles are started before waiting on any of them 
+        double shaderStartTime = glfwGetTime();
+        Shader shader("res/shaders/Basic.shader", true);
+        Shader particleShader("res/shaders/Particle.shader", true);
+        Shader gridShader("res/shaders/Grid.shader", true);
+
+        shader.Finish();
+        particleShader.Finish();
+        gridShader.Finish();
+
+        std::cout << "[Startup] Shaders ready in " << (glfwGetTime() - shaderStartTime) * 1000.0 << " ms" 
+            << (shader.WasLoadedFromCache() && particleShader.WasLoadedFromCache() && gridShader.WasLoadedFromCache() ? " (from cache)" : "") << std::endl;
+
+        particleShader.Bind();
+        particleShader.SetUniform(particleShader.GetUniform<int>("u_Positions"), 1);
+        particleShader.SetUniform(particleShader.GetUniform<float>("u_HalfSize"), STANDARDSIZE / 2.0f);
+
+        // The cell size never changes, so only the cells are sent per frame 
+        gridShader.Bind();
+        gridShader.SetUniform(gridShader.GetUniform<int>("u_Texture"), 0);
+        gridShader.SetUniform(gridShader.GetUniform<int>("u_Cells"), 2);
+        gridShader.SetUniform(gridShader.GetUniform<float>("u_CellSpacing"), CELLSIZE + CELLSPACINGSIZE);
+        gridShader.SetUniform(gridShader.GetUniform<float>("u_HalfSize"), STANDARDSIZE / 2.0f * CELLVISUALSCALAR);
+
         shader.Bind();
 
+        BasicUniforms basicUniforms;
+        basicUniforms.mvp = shader.GetUniform<glm::mat4>("u_MVP");
+        basicUniforms.color = shader.GetUniform<glm::vec4>("u_Color");
+        basicUniforms.texture = shader.GetUniform<int>("u_Texture");
+
         // Bind the texture 
         Texture texture("res/textures/BevelSquare.png");
         texture.Bind();
-        shader.SetUniform1i("u_Texture", 0);
+        shader.SetUniform(basicUniforms.texture, 0);
 
         va.Unbind();
         vb.Unbind();
@@ -372,8 +538,29 @@ int main(void)
 
         // Used for manual control of each particle 
         std::vector<glm::vec3> translations = std::vector<glm::vec3>(PARTICLECOUNT);
+
+        // Scene is drawn offscreen and stretched to the window, gui stays native 
+        int framebufferWidth;
+        int framebufferHeight;
+        glfwGetFramebufferSize(window, &framebufferWidth, &framebufferHeight);
+
+        FrameBuffer sceneBuffer(framebufferWidth, framebufferHeight);
+        RenderScale renderScale(renderScaleValue, 0.25f, 1.0f, targetFrameMs);
+
+        // Frame stage timings shown in the gui 
+        Profiler profiler;
+        const int GRIDSTAGE = profiler.AddStage("Grid", true);
+        const int PARTICLESTAGE = profiler.AddStage("Particles", true);
+        const int UPSCALESTAGE = profiler.AddStage("Upscale", true);
+        const int GUISTAGE = profiler.AddStage("Gui", true);
+        const int FLIPSTAGE = profiler.AddStage("Flip", false);
+        const int PARTICLESIMSTAGE = profiler.AddStage("Particle Sim", false);
+        const int EMITTERSTAGE = profiler.AddStage("Emitters", false);
         #pragma endregion
 
+        // GLFW's timer starts at glfwInit 
+        std::cout << "[Startup] Ready to simulate after " << glfwGetTime() * 1000.0 << " ms" << std::endl;
+
         clock_t mainClock = clock();
 
         /* Loop until the user closes the window */
@@ -381,11 +568,36 @@ int main(void)
         {
             clock_t time_req;
             time_req = clock();
+            profiler.BeginFrame();
+
             /* Render here */
-            renderer.Clear();
+            glfwGetFramebufferSize(window, &framebufferWidth, &framebufferHeight);
+
+            // A minimised window has no framebuffer to draw into, the scene
+            // buffer keeps its last size and only the simulation keeps running 
+            bool sceneVisible = framebufferWidth > 0 && framebufferHeight > 0;
+
+            int sceneWidth = renderScale.Apply(framebufferWidth);
+            int sceneHeight = renderScale.Apply(framebufferHeight);
+
+            if (sceneVisible)
+            {
+                sceneBuffer.Resize(framebufferWidth, framebufferHeight);
+                sceneBuffer.Bind(sceneWidth, sceneHeight);
+                renderer.Clear();
+            }
 
             #pragma region Main Logic
 
+            // One upload for everything that stays the same during the frame 
+            frameUniforms.proj = proj;
+            frameUniforms.view = view;
+            frameUniforms.cellColor = commonCellColor;
+            frameUniforms.occupiedCellColor = occupiedCellColor;
+            frameUniforms.barrierColor = barrierColor;
+            frameUniforms.particleColor = particleColor;
+            frameUniformBuffer.SetData(&frameUniforms, sizeof(FrameUniforms));
+
             // Mouse Variables 
             double x;
             double y;
@@ -421,14 +633,47 @@ int main(void)
                 0;  // Will do Nothing 
 
 
-            // Rendering the grid and its logic 
-            GridLogic(CELLSIZE, CELLSPACINGSIZE, GRIDSIZECOUNT, CELLVISUALSCALAR, PARTICLECOUNT, mouseRadius, commonCellColor, occupiedCellColor, barrierColor, proj, view, shader, renderer, va, ib, fluid, mousePosHold, showCellHasParticles, cellWallThickness + 1);
+            if (sceneVisible)
+            {
+                // Rendering the grid and its logic 
+                profiler.Begin(GRIDSTAGE);
+                GridLogic(GRIDSIZECOUNT, mouseRadius, gridShader, renderer, emptyVa, gridCellBuffer, gridCells, fluid, mousePosHold, showCellHasParticles, cellWallThickness + 1);
+                profiler.End(GRIDSTAGE);
+
+                // Rendering the particle
+                profiler.Begin(PARTICLESTAGE);
+                if (proceduralParticles)
+                {
+                    if (showParticles)
+                    {
+                        View<glm::vec2> positions = fluid.GetPositionView();
+                        particlePositions.SetData(positions.GetData(), positions.GetSize() * sizeof(glm::vec2));
+                        particlePositions.Bind(1);
+                        renderer.DrawArrays(emptyVa, 6 * positions.GetSize(), particleShader);
+                    }
+                }
+                else
+                {
+                    shader.Bind();
+                    SetColor(shader, basicUniforms, particleColor);
 
-            // Rendering the particle
-            SetColor(shader, particleColor);
+                    ParticleLogic(fluid.GetParticleCount(), proj, view, fluid, shader, basicUniforms, renderer, va, ib, showParticles);
+                }
+                profiler.End(PARTICLESTAGE);
 
-            float trueCellSize = CELLSIZE + CELLSPACINGSIZE;
-            ParticleLogic(PARTICLECOUNT, proj, view, fluid, shader, renderer, va, ib, showParticles);
+                profiler.Begin(UPSCALESTAGE);
+                sceneBuffer.BlitToScreen(sceneWidth, sceneHeight, framebufferWidth, framebufferHeight);
+                profiler.End(UPSCALESTAGE);
+            }
+
+            // Fill rate is what the scale changes, so it follows the GPU time of
+            // the scene passes. Those results arrive a frame or two late, which
+            // the smoothing in RenderScale absorbs 
+            if (dynamicRenderScale && sceneVisible)
+            {
+                float sceneGpuMs = profiler.GetGpuMs(GRIDSTAGE) + profiler.GetGpuMs(PARTICLESTAGE) + profiler.GetGpuMs(UPSCALESTAGE);
+                renderScale.Update(sceneGpuMs);
+            }
 
             #pragma endregion
 
@@ -443,6 +688,17 @@ int main(void)
 
                 ImGui::Checkbox("Visualize Particles", &showParticles);
                 ImGui::Checkbox("Visualize Cells with particles", &showCellHasParticles);
+                ImGui::Checkbox("Procedural Particles", &proceduralParticles);
+
+                ImGui::Checkbox("Dynamic Render Scale", &dynamicRenderScale);
+                if (dynamicRenderScale)
+                {
+                    ImGui::SliderFloat("Target Scene GPU ms", &targetFrameMs, 4.0f, 50.0f);
+                    renderScale.SetTargetMs(targetFrameMs);
+                    renderScaleValue = renderScale.GetScale();
+                }
+                ImGui::SliderFloat("Render Scale", &renderScaleValue, 0.25f, 1.0f);
+                renderScale.SetScale(renderScaleValue);
 
 
                 ImGui::Text("Color");
@@ -460,9 +716,10 @@ int main(void)
                 particleColor = glm::vec4(particleColorArr[0], particleColorArr[1], particleColorArr[2], particleColorArr[3]);
 
                 ImGui::Text("Interaction");
-                ImGui::SliderFloat("Mouse Radius", &mouseRadius, 1.0f, 90.0f);
+                ImGui::SliderFloat("Mouse Radius", &mouseRadius, 1.0f, MAXMOUSERADIUS);
                 ImGui::SliderInt("Cell Wall Thickness", &cellWallThickness, 1, 8);
-                //ImGui::Checkbox("Is Paintbrush", &isPaintbrush);
+                ImGui::Checkbox("Is Paintbrush", &isPaintbrush);
+                ImGui::Checkbox("Paint Walls", &paintWalls);
 
                 ImGui::Text("Physics");
                 //ImGui::SliderFloat("Overrelaxation", &overrelazation, 1.0f, 2.0f);
@@ -470,20 +727,120 @@ int main(void)
                 ImGui::SliderFloat("Gravity", &gravity, -200.0f, 200.0f);
                 fluid.SetGravity(gravity);
 
+                ImGui::Checkbox("Adaptive Time Step", &adaptiveTimeStep);
+                ImGui::SliderFloat("CFL Number", &cflNumber, 0.1f, 3.0f);
+                ImGui::Text("dt %.4f s, %d steps this frame", lastTimeStep, lastSubsteps);
+
+                ImGui::RadioButton("FLIP", &transferMode, Fluid::Flip);
+                ImGui::SameLine();
+                ImGui::RadioButton("APIC", &transferMode, Fluid::Apic);
+                fluid.SetTransferMode((Fluid::TransferMode)transferMode);
+                ImGui::RadioButton("Euler", &advectionMode, Fluid::EulerAdvection);
+                ImGui::SameLine();
+                ImGui::RadioButton("RK2", &advectionMode, Fluid::Rk2Advection);
+                ImGui::SameLine();
+                ImGui::RadioButton("RK3", &advectionMode, Fluid::Rk3Advection);
+                fluid.SetAdvectionMode((Fluid::AdvectionMode)advectionMode);
+                ImGui::SliderFloat("PIC / FLIP Blend", &flipBlend, 0.0f, 1.0f);
+                fluid.SetFlipBlend(flipBlend);
+                ImGui::SliderInt("Extrapolation Layers", &extrapolationLayers, 0, 4);
+                fluid.SetExtrapolationLayers(extrapolationLayers);
+                ImGui::SliderInt("Max Leaf Size", &maxLeafSize, 1, 8);
+                ImGui::SliderInt("Surface Band", &surfaceBand, 1, 4);
+                fluid.SetQuadtree(maxLeafSize, surfaceBand);
+                ImGui::Text("Pressure unknowns %u", fluid.GetQuadLeafCount());
+                ImGui::SliderInt("Narrow Band", &narrowBand, 0, 8);
+                ImGui::SliderInt("Band Seeds", &bandSeeds, 1, 9);
+                fluid.SetNarrowBand(narrowBand, bandSeeds);
+                ImGui::Text("Band: culled %u, seeded %u", fluid.GetBandCulls(), fluid.GetBandSeedings());
+                ImGui::SliderInt("Sleep After Steps", &sleepSteps, 0, 240);
+                ImGui::SliderFloat("Sleep Speed", &sleepSpeed, 0.0f, 100.0f);
+                ImGui::SliderFloat("Sleep Divergence", &sleepDivergence, 0.0f, 100.0f);
+                fluid.SetSleeping(sleepSteps, sleepSpeed, sleepDivergence);
+
+                ImGui::SliderInt("Resample Every", &resampleInterval, 0, 120);
+                ImGui::SliderInt("Min Per Cell", &resampleMin, 0, 8);
+                ImGui::SliderInt("Max Per Cell", &resampleMax, 1, 32);
+                fluid.SetResampling(resampleInterval, resampleMin, resampleMax);
+                ImGui::Text("Resampled: merged %u, seeded %u", fluid.GetResampleMerges(), fluid.GetResampleSeeds());
+
+                ImGui::SliderFloat("Sort Threshold", &sortThreshold, 0.0f, 1.0f);
+                fluid.SetSortThreshold(sortThreshold);
+                ImGui::Text("Disorder %.2f, sorted %u times", fluid.GetDisorder(), fluid.GetSortCount());
+                ImGui::Text("Grid layout %s", GridLayout::GetModeName(fluid.GetLayout()));
+                ImGui::Text("Active cells %u, %u stored", fluid.GetActiveCellView().GetSize(), fluid.GetCellView().GetSize());
+                ImGui::Text("Active blocks %u / %u, %u paged, %u asleep", fluid.GetActiveBlockCount(), fluid.GetBlockCount(), fluid.GetPageCount(), fluid.GetSleepingBlockCount());
+
+                ImGui::Text("Particles %d / %d (generation %u)", fluid.GetParticleCount(), fluid.GetMaxParticleCount(), fluid.GetGeneration());
+
                 ImGui::Text("Application average %.3f ms/frame (%.1f FPS)", 1000.0f / ImGui::GetIO().Framerate, ImGui::GetIO().Framerate);
+
+                ImGui::Text("Performance");
+                ImGui::Checkbox("Fused Particle Update", &fusedParticleUpdate);
+                fluid.SetFusedParticleUpdate(fusedParticleUpdate);
+                profiler.DrawHud();
             } 
 
+            profiler.Begin(GUISTAGE);
             ImGui::Render();
             ImGui_ImplGlfwGL3_RenderDrawData(ImGui::GetDrawData());
+            profiler.End(GUISTAGE);
             #pragma endregion
 
             #pragma region FLIP Sim
-            fluid.SimulateFlip(TIMESTEP, 7, overrelazation, densityMultiplier);
+            // The brush and emitters work on whole frames 
+            profiler.Begin(EMITTERSTAGE);
+            bool paintParticles = isPaintbrush && !paintWalls;
+            if (isPaintbrush && paintWalls && (buttonState == 1 || buttonState == 2))
+            {
+                // Left paints walls, right erases them 
+                fluid.PaintObstacle(mousePosHold, mouseRadius, buttonState == 1);
+            }
 
+            Emitter& brushEmitter = emitters.Get(BRUSHEMITTER);
+            brushEmitter.enabled = paintParticles && buttonState == 1;
+            brushEmitter.start = lastMousePos;
+            brushEmitter.end = mousePosHold;
+            brushEmitter.radius = mouseRadius;
+
+            Emitter& brushSink = emitters.Get(BRUSHSINK);
+            brushSink.enabled = paintParticles && buttonState == 2;
+            brushSink.start = mousePosHold;
+            brushSink.radius = mouseRadius;
+
+            lastMousePos = mousePosHold;
+            emitters.Update(fluid, TIMESTEP);
+            profiler.End(EMITTERSTAGE);
+
+            // Steps as large as the fastest particle allows until the frame is
+            // paid for, the last one shortened to what is left. A calm scene
+            // takes one step a frame, a fast one substeps 
+            stepDebt += TIMESTEP;
+            lastSubsteps = 0;
+            while (stepDebt > 0.0f && lastSubsteps < MAXSUBSTEPS)
+            {
+                float timeStep = adaptiveTimeStep ? glm::clamp(fluid.GetStableTimeStep(cflNumber), MINTIMESTEP, MAXTIMESTEP) : TIMESTEP;
+                timeStep = glm::min(timeStep, stepDebt);
+
+                profiler.Begin(FLIPSTAGE);
+                fluid.SimulateFlip(timeStep, 7, overrelazation, densityMultiplier);
+                profiler.End(FLIPSTAGE);
 
-            fluid.SimulateParticles(TIMESTEP, MAXPARTICLECHECKS, cellWallThickness + 1, glm::vec3(mousePosHold, 0.0f), mouseRadius, 
-                isPaintbrush ? buttonState : -1,
-                STANDARDSIZE);
+                profiler.Begin(PARTICLESIMSTAGE);
+                fluid.SimulateParticles(timeStep, MAXPARTICLECHECKS, cellWallThickness + 1, glm::vec3(mousePosHold, 0.0f), mouseRadius, 
+                    isPaintbrush ? buttonState : -1);
+                profiler.End(PARTICLESIMSTAGE);
+
+                stepDebt -= timeStep;
+                lastTimeStep = timeStep;
+                lastSubsteps++;
+            }
+
+            // Too far behind to catch up, let the simulation run slow instead 
+            if (lastSubsteps == MAXSUBSTEPS)
+            {
+                stepDebt = 0.0f;
+            }
 
             #pragma endregion
 
@@ -501,6 +858,7 @@ int main(void)
         }
     }
     // Cleanup
+    Parallel::Stop();
     ImGui_ImplGlfwGL3_Shutdown();
     ImGui::DestroyContext();
     glfwTerminate();
@@ -0,0 +1,62 @@
+#pragma once
+
+/// <summary>
+/// Z-order (Morton) keys for 2D cell coordinates. Interleaving the bits of
+/// x and y keeps cells that are close in 2D mostly close in the key order
+/// </summary>
+namespace Morton
+{
+	/// <summary>
+	/// Spread the low 16 bits so there is a zero between each of them 
+	/// </summary>
+	inline unsigned int Part1By1(unsigned int value)
+	{
+		value &= 0x0000FFFF;
+		value = (value | (value << 8)) & 0x00FF00FF;
+		value = (value | (value << 4)) & 0x0F0F0F0F;
+		value = (value | (value << 2)) & 0x33333333;
+		value = (value | (value << 1)) & 0x55555555;
+		return value;
+	}
+
+	/// <summary>
+	/// Inverse of Part1By1 
+	/// </summary>
+	inline unsigned int Compact1By1(unsigned int value)
+	{
+		value &= 0x55555555;
+		value = (value | (value >> 1)) & 0x33333333;
+		value = (value | (value >> 2)) & 0x0F0F0F0F;
+		value = (value | (value >> 4)) & 0x00FF00FF;
+		value = (value | (value >> 8)) & 0x0000FFFF;
+		return value;
+	}
+
+	inline unsigned int Encode(unsigned int x, unsigned int y)
+	{
+		return Part1By1(x) | (Part1By1(y) << 1);
+	}
+
+	inline unsigned int DecodeX(unsigned int key)
+	{
+		return Compact1By1(key);
+	}
+
+	inline unsigned int DecodeY(unsigned int key)
+	{
+		return Compact1By1(key >> 1);
+	}
+
+	/// <summary>
+	/// Bits needed for one coordinate of a grid with this many cells per side 
+	/// </summary>
+	inline unsigned int BitsFor(unsigned int sideLength)
+	{
+		unsigned int bits = 0;
+		while ((1u << bits) < sideLength)
+		{
+			bits++;
+		}
+		return bits;
+	}
+}
\ No newline at end of file
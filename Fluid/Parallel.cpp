@@ -0,0 +1,142 @@
+#include "Parallel.h"
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+
+// Current loop, handed to the workers through the generation counter 
+struct ParallelJob
+{
+	void(*task)(const void*, int, int);
+	const void* context;
+	int end;
+	int grain;
+
+	std::atomic<int> next;
+};
+
+static std::vector<std::thread> s_Workers;
+static std::mutex s_Mutex;
+static std::mutex s_DispatchMutex;
+static std::condition_variable s_WakeWorkers;
+static std::condition_variable s_JobDone;
+
+static ParallelJob s_Job;
+static unsigned int s_Generation = 0;
+static unsigned int s_Active = 0;
+static bool s_Stopping = false;
+
+// Set while a thread is working on a loop so nested loops do not deadlock 
+static thread_local bool s_InsideJob = false;
+
+static void RunChunks()
+{
+	while (true)
+	{
+		int start = s_Job.next.fetch_add(s_Job.grain);
+		if (start >= s_Job.end)
+			break;
+
+		int stop = start + s_Job.grain < s_Job.end ? start + s_Job.grain : s_Job.end;
+		s_Job.task(s_Job.context, start, stop);
+	}
+}
+
+static void WorkerLoop()
+{
+	unsigned int seen = 0;
+	while (true)
+	{
+		std::unique_lock<std::mutex> lock(s_Mutex);
+		s_WakeWorkers.wait(lock, [&] { return s_Stopping || s_Generation != seen; });
+		if (s_Stopping)
+			return;
+
+		seen = s_Generation;
+		lock.unlock();
+
+		s_InsideJob = true;
+		RunChunks();
+		s_InsideJob = false;
+
+		lock.lock();
+		if (--s_Active == 0)
+		{
+			s_JobDone.notify_one();
+		}
+	}
+}
+
+void Parallel::Start(unsigned int threadCount)
+{
+	if (!s_Workers.empty())
+		return;
+
+	if (threadCount == 0)
+	{
+		threadCount = std::thread::hardware_concurrency();
+	}
+
+	// The calling thread does work too 
+	for (unsigned int i = 1; i < threadCount; i++)
+	{
+		s_Workers.push_back(std::thread(WorkerLoop));
+	}
+}
+
+void Parallel::Stop()
+{
+	{
+		std::lock_guard<std::mutex> lock(s_Mutex);
+		s_Stopping = true;
+	}
+	s_WakeWorkers.notify_all();
+
+	for (unsigned int i = 0; i < s_Workers.size(); i++)
+	{
+		s_Workers[i].join();
+	}
+
+	s_Workers.clear();
+	s_Stopping = false;
+}
+
+unsigned int Parallel::GetThreadCount()
+{
+	return s_Workers.size() + 1;
+}
+
+void Parallel::Dispatch(RangeTask task, const void* context, int begin, int end, int grain)
+{
+	// Not worth waking anyone 
+	if (s_Workers.empty() || s_InsideJob || end - begin <= grain)
+	{
+		task(context, begin, end);
+		return;
+	}
+
+	// One loop at a time 
+	std::lock_guard<std::mutex> dispatchLock(s_DispatchMutex);
+
+	{
+		std::lock_guard<std::mutex> lock(s_Mutex);
+		s_Job.task = task;
+		s_Job.context = context;
+		s_Job.end = end;
+		s_Job.grain = grain;
+		s_Job.next.store(begin);
+
+		s_Active = s_Workers.size();
+		s_Generation++;
+	}
+	s_WakeWorkers.notify_all();
+
+	s_InsideJob = true;
+	RunChunks();
+	s_InsideJob = false;
+
+	std::unique_lock<std::mutex> lock(s_Mutex);
+	s_JobDone.wait(lock, [] { return s_Active == 0; });
+}
\ No newline at end of file
@@ -0,0 +1,45 @@
+#pragma once
+
+/// <summary>
+/// Small persistent thread pool for splitting loops over particles and cells.
+/// Workers are started once, so a parallel loop costs no thread creation
+/// and no allocation. Calls made from inside a parallel loop run serially
+/// </summary>
+class Parallel
+{
+private:
+	typedef void(*RangeTask)(const void* context, int begin, int end);
+
+	static void Dispatch(RangeTask task, const void* context, int begin, int end, int grain);
+
+	template<typename Func>
+	static void Invoke(const void* context, int begin, int end)
+	{
+		(*(const Func*)context)(begin, end);
+	}
+
+public:
+	/// <summary>
+	/// Start the workers. Zero uses one thread per hardware thread 
+	/// </summary>
+	static void Start(unsigned int threadCount = 0);
+	static void Stop();
+
+	/// <summary>
+	/// Threads that take part in a loop, including the caller 
+	/// </summary>
+	static unsigned int GetThreadCount();
+
+	/// <summary>
+	/// Call func(chunkBegin, chunkEnd) for chunks of at most grain items that
+	/// together cover [begin, end). Returns once every chunk is done
+	/// </summary>
+	template<typename Func>
+	static void For(int begin, int end, int grain, const Func& func)
+	{
+		if (end <= begin)
+			return;
+
+		Dispatch(&Invoke<Func>, &func, begin, end, grain < 1 ? 1 : grain);
+	}
+};
\ No newline at end of file
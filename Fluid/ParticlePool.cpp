@@ -0,0 +1,105 @@
+#include "ParticlePool.h"
+#include "Parallel.h"
+
+ParticlePool::ParticlePool(unsigned int _capacity)
+	:count(0), capacity(_capacity)
+{
+	// Everything is allocated up front so spawning never reallocates 
+	positions = std::vector<glm::vec2>(capacity);
+	velocities = std::vector<glm::vec2>(capacity);
+	affines = std::vector<glm::mat2>(capacity, glm::mat2(0.0f));
+	masses = std::vector<float>(capacity, 1.0f);
+	cells = std::vector<int>(capacity, -1);
+	cellSlots = std::vector<unsigned int>(capacity, 0);
+
+	ids = std::vector<unsigned int>(capacity, INVALID);
+	idIndices = std::vector<unsigned int>(capacity, INVALID);
+
+	// Handed out from the back, so the first particle gets id 0 
+	freeIds = std::vector<unsigned int>(capacity);
+	freeIdCount = capacity;
+	for (unsigned int i = 0; i < capacity; i++)
+	{
+		freeIds[i] = capacity - 1 - i;
+	}
+
+	scratchPositions = std::vector<glm::vec2>(capacity);
+	scratchVelocities = std::vector<glm::vec2>(capacity);
+	scratchAffines = std::vector<glm::mat2>(capacity);
+	scratchMasses = std::vector<float>(capacity);
+	scratchCells = std::vector<int>(capacity);
+	scratchCellSlots = std::vector<unsigned int>(capacity);
+	scratchIds = std::vector<unsigned int>(capacity);
+}
+
+unsigned int ParticlePool::Spawn(glm::vec2 pos, glm::vec2 vel)
+{
+	if (count == capacity)
+	{
+		return INVALID;
+	}
+
+	unsigned int index = count++;
+	positions[index] = pos;
+	velocities[index] = vel;
+	affines[index] = glm::mat2(0.0f);
+	masses[index] = 1.0f;
+	cells[index] = -1;
+
+	unsigned int id = freeIds[--freeIdCount];
+	ids[index] = id;
+	idIndices[id] = index;
+
+	return index;
+}
+
+unsigned int ParticlePool::Kill(unsigned int index)
+{
+	unsigned int id = ids[index];
+	idIndices[id] = INVALID;
+	freeIds[freeIdCount++] = id;
+
+	unsigned int last = --count;
+	if (index == last)
+	{
+		return INVALID;
+	}
+
+	positions[index] = positions[last];
+	velocities[index] = velocities[last];
+	affines[index] = affines[last];
+	masses[index] = masses[last];
+	cells[index] = cells[last];
+	cellSlots[index] = cellSlots[last];
+	ids[index] = ids[last];
+	idIndices[ids[index]] = index;
+
+	return last;
+}
+
+void ParticlePool::Reorder(const unsigned int* order)
+{
+	Parallel::For(0, count, 4096, [&](int begin, int end)
+	{
+		for (int i = begin; i < end; i++)
+		{
+			unsigned int from = order[i];
+			scratchPositions[i] = positions[from];
+			scratchVelocities[i] = velocities[from];
+			scratchAffines[i] = affines[from];
+			scratchMasses[i] = masses[from];
+			scratchCells[i] = cells[from];
+			scratchCellSlots[i] = cellSlots[from];
+			scratchIds[i] = ids[from];
+			idIndices[ids[from]] = i;
+		}
+	});
+
+	positions.swap(scratchPositions);
+	velocities.swap(scratchVelocities);
+	affines.swap(scratchAffines);
+	masses.swap(scratchMasses);
+	cells.swap(scratchCells);
+	cellSlots.swap(scratchCellSlots);
+	ids.swap(scratchIds);
+}
\ No newline at end of file
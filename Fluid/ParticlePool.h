@@ -0,0 +1,97 @@
+#pragma once
+#include "glm/glm.hpp"
+
+#include <vector>
+
+/// <summary>
+/// Fixed capacity particle storage. Each attribute lives in its own array
+/// and particles are only ever referred to by index, so nothing can dangle
+/// when particles come and go. Removal moves the last particle into the
+/// freed slot, which keeps the arrays packed. Indices change when particles
+/// are removed or reordered, ids stay with a particle for its whole life
+/// </summary>
+class ParticlePool
+{
+private:
+	std::vector<glm::vec2> positions;
+	std::vector<glm::vec2> velocities;
+
+	// Velocity gradient carried by each particle for APIC transfers 
+	std::vector<glm::mat2> affines;
+
+	// Spawned particles weigh 1, merging and splitting moves mass around 
+	std::vector<float> masses;
+
+	// What cell this particle was listed in when the cell lists were last
+	// built and where in the cell lists it was put 
+	std::vector<int> cells;
+	std::vector<unsigned int> cellSlots;
+
+	// Id of the particle at each index, and the index of each id 
+	std::vector<unsigned int> ids;
+	std::vector<unsigned int> idIndices;
+	std::vector<unsigned int> freeIds;
+	unsigned int freeIdCount;
+
+	// Targets for Reorder, swapped with the live arrays afterwards 
+	std::vector<glm::vec2> scratchPositions;
+	std::vector<glm::vec2> scratchVelocities;
+	std::vector<glm::mat2> scratchAffines;
+	std::vector<float> scratchMasses;
+	std::vector<int> scratchCells;
+	std::vector<unsigned int> scratchCellSlots;
+	std::vector<unsigned int> scratchIds;
+
+	unsigned int count;
+	unsigned int capacity;
+
+public:
+	static const unsigned int INVALID = 0xFFFFFFFF;
+
+	ParticlePool(unsigned int _capacity);
+
+	/// <summary>
+	/// Add a particle at the end of the pool 
+	/// </summary>
+	/// <returns>Index of the new particle or INVALID when the pool is full</returns>
+	unsigned int Spawn(glm::vec2 pos, glm::vec2 vel);
+
+	/// <summary>
+	/// Remove a particle by moving the last one into its slot. The caller is
+	/// responsible for fixing any reference to the moved particle 
+	/// </summary>
+	/// <returns>Old index of the particle that now lives at index or INVALID if none moved</returns>
+	unsigned int Kill(unsigned int index);
+
+	inline unsigned int GetCount() const { return count; }
+	inline unsigned int GetCapacity() const { return capacity; }
+	inline bool IsFull() const { return count == capacity; }
+
+	inline glm::vec2& Position(unsigned int index) { return positions[index]; }
+	inline glm::vec2& Velocity(unsigned int index) { return velocities[index]; }
+	inline const glm::vec2& Position(unsigned int index) const { return positions[index]; }
+	inline const glm::vec2& Velocity(unsigned int index) const { return velocities[index]; }
+	inline glm::mat2& Affine(unsigned int index) { return affines[index]; }
+	inline const glm::mat2& Affine(unsigned int index) const { return affines[index]; }
+	inline float& Mass(unsigned int index) { return masses[index]; }
+	inline float Mass(unsigned int index) const { return masses[index]; }
+
+	/// <summary>
+	/// Move every particle at once. The particle at old index order[i] ends up
+	/// at index i, order has to hold every index below the count exactly once 
+	/// </summary>
+	void Reorder(const unsigned int* order);
+
+	inline unsigned int GetId(unsigned int index) const { return ids[index]; }
+	// Current index of the particle with this id or INVALID if it has been removed 
+	inline unsigned int GetIndex(unsigned int id) const { return idIndices[id]; }
+
+	inline int GetCell(unsigned int index) const { return cells[index]; }
+	inline void SetCell(unsigned int index, int cell) { cells[index] = cell; }
+	inline unsigned int GetCellSlot(unsigned int index) const { return cellSlots[index]; }
+	inline void SetCellSlot(unsigned int index, unsigned int slot) { cellSlots[index] = slot; }
+
+	inline const glm::vec2* GetPositions() const { return positions.data(); }
+	inline const glm::vec2* GetVelocities() const { return velocities.data(); }
+	inline const unsigned int* GetIds() const { return ids.data(); }
+};
\ No newline at end of file
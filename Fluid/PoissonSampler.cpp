@@ -0,0 +1,184 @@
+#include "PoissonSampler.h"
+#include "Parallel.h"
+
+// Grid cells per tile side. Tiles filled in the same pass are a full tile
+// apart, far more than the two cells a distance check can reach 
+static const int TILECELLS = 16;
+
+/// <summary>
+/// Tiny per tile random generator so tiles do not share state 
+/// </summary>
+struct SampleRandom
+{
+	unsigned int state;
+
+	SampleRandom(unsigned int seed)
+		: state(seed * 747796405u + 2891336453u) {}
+
+	float Next()
+	{
+		// xorshift32 
+		state ^= state << 13;
+		state ^= state >> 17;
+		state ^= state << 5;
+		return (state >> 8) * (1.0f / 16777216.0f);
+	}
+};
+
+struct SampleGrid
+{
+	glm::vec2 min;
+	glm::vec2 max;
+	float radius;
+	float cellSize;
+	int width;
+	int height;
+
+	std::vector<glm::vec2> points;
+	std::vector<unsigned char> occupied;
+
+	bool IsFree(glm::vec2 pos) const
+	{
+		int x = (int)((pos.x - min.x) / cellSize);
+		int y = (int)((pos.y - min.y) / cellSize);
+
+		// With cells of radius / sqrt(2) a conflict can be at most two cells away 
+		for (int j = glm::max(y - 2, 0); j <= glm::min(y + 2, height - 1); j++)
+		{
+			for (int i = glm::max(x - 2, 0); i <= glm::min(x + 2, width - 1); i++)
+			{
+				int cell = i + j * width;
+				if (occupied[cell] && glm::distance(points[cell], pos) < radius)
+				{
+					return false;
+				}
+			}
+		}
+
+		return true;
+	}
+
+	void Insert(glm::vec2 pos)
+	{
+		int x = (int)((pos.x - min.x) / cellSize);
+		int y = (int)((pos.y - min.y) / cellSize);
+		int cell = x + y * width;
+
+		points[cell] = pos;
+		occupied[cell] = 1;
+	}
+};
+
+/// <summary>
+/// Run Bridson's algorithm inside one tile 
+/// </summary>
+static void FillTile(SampleGrid& grid, int tileX, int tileY, unsigned int seed, int attempts, std::vector<glm::vec2>& active)
+{
+	glm::vec2 tileMin = grid.min + glm::vec2((float)(tileX * TILECELLS), (float)(tileY * TILECELLS)) * grid.cellSize;
+	glm::vec2 tileMax = glm::min(tileMin + glm::vec2(1.0f) * (TILECELLS * grid.cellSize), grid.max);
+
+	SampleRandom random(seed ^ (unsigned int)(tileX * 73856093) ^ (unsigned int)(tileY * 19349663));
+	active.clear();
+
+	// Darts thrown into the tile start the growth, neighbours filled in
+	// earlier passes may already cover parts of it 
+	for (int dart = 0; dart < attempts; dart++)
+	{
+		glm::vec2 start = tileMin + (tileMax - tileMin) * glm::vec2(random.Next(), random.Next());
+		if (!grid.IsFree(start))
+			continue;
+
+		grid.Insert(start);
+		active.push_back(start);
+
+		while (!active.empty())
+		{
+			unsigned int pick = (unsigned int)(random.Next() * active.size());
+			pick = glm::min(pick, (unsigned int)active.size() - 1);
+			glm::vec2 center = active[pick];
+
+			bool placed = false;
+			for (int k = 0; k < attempts; k++)
+			{
+				// Uniform in the annulus between r and 2r 
+				float angle = random.Next() * 6.2831853f;
+				float distance = grid.radius * glm::sqrt(1.0f + 3.0f * random.Next());
+				glm::vec2 candidate = center + glm::vec2(glm::cos(angle), glm::sin(angle)) * distance;
+
+				if (candidate.x < tileMin.x || candidate.y < tileMin.y || candidate.x >= tileMax.x || candidate.y >= tileMax.y)
+					continue;
+
+				if (grid.IsFree(candidate))
+				{
+					grid.Insert(candidate);
+					active.push_back(candidate);
+					placed = true;
+					break;
+				}
+			}
+
+			if (!placed)
+			{
+				active[pick] = active.back();
+				active.pop_back();
+			}
+		}
+	}
+}
+
+void PoissonSampler::SampleRect(glm::vec2 min, glm::vec2 max, float radius, unsigned int seed, std::vector<glm::vec2>& out, int attempts)
+{
+	if (radius <= 0.0f || max.x <= min.x || max.y <= min.y)
+		return;
+
+	SampleGrid grid;
+	grid.min = min;
+	grid.max = max;
+	grid.radius = radius;
+	grid.cellSize = radius / glm::sqrt(2.0f);
+	grid.width = (int)glm::ceil((max.x - min.x) / grid.cellSize);
+	grid.height = (int)glm::ceil((max.y - min.y) / grid.cellSize);
+	grid.points = std::vector<glm::vec2>(grid.width * grid.height);
+	grid.occupied = std::vector<unsigned char>(grid.width * grid.height, 0);
+
+	int tilesX = (grid.width + TILECELLS - 1) / TILECELLS;
+	int tilesY = (grid.height + TILECELLS - 1) / TILECELLS;
+
+	// Tiles with the same parity on both axes never touch 
+	for (int phase = 0; phase < 4; phase++)
+	{
+		int offsetX = phase & 1;
+		int offsetY = phase >> 1;
+		int phaseTilesX = (tilesX - offsetX + 1) / 2;
+		int phaseTilesY = (tilesY - offsetY + 1) / 2;
+
+		Parallel::For(0, phaseTilesX * phaseTilesY, 1, [&](int begin, int end)
+		{
+			std::vector<glm::vec2> active;
+			for (int t = begin; t < end; t++)
+			{
+				int tileX = (t % phaseTilesX) * 2 + offsetX;
+				int tileY = (t / phaseTilesX) * 2 + offsetY;
+				FillTile(grid, tileX, tileY, seed, attempts, active);
+			}
+		});
+	}
+
+	// Grid order keeps nearby points next to each other 
+	for (unsigned int i = 0; i < grid.occupied.size(); i++)
+	{
+		if (grid.occupied[i])
+		{
+			out.push_back(grid.points[i]);
+		}
+	}
+}
+
+float PoissonSampler::RadiusForCount(float area, unsigned int count)
+{
+	// A maximal Poisson-disk set covers about 0.7 / r^2 points per unit area 
+	if (count == 0)
+		return 0.0f;
+
+	return glm::sqrt(0.7f * area / count);
+}
\ No newline at end of file
@@ -0,0 +1,26 @@
+#pragma once
+#include "glm/glm.hpp"
+
+#include <vector>
+
+/// <summary>
+/// Blue noise point sets from Bridson's Poisson-disk algorithm. A background
+/// grid with one point per cell keeps each distance check to a handful of
+/// cells. Large areas are split into tiles that are filled in parallel, four
+/// passes so that neighbouring tiles are never filled at the same time
+/// </summary>
+class PoissonSampler
+{
+public:
+	/// <summary>
+	/// Fill a rectangle with points that are at least radius apart 
+	/// </summary>
+	/// <param name="out">Points are appended in a spatially coherent order</param>
+	/// <param name="attempts">Candidates tried around each point before giving up on it</param>
+	static void SampleRect(glm::vec2 min, glm::vec2 max, float radius, unsigned int seed, std::vector<glm::vec2>& out, int attempts = 30);
+
+	/// <summary>
+	/// Spacing that gives roughly count points when filling the area 
+	/// </summary>
+	static float RadiusForCount(float area, unsigned int count);
+};
\ No newline at end of file
@@ -0,0 +1,272 @@
+#include "Profiler.h"
+#include "Renderer.h"
+#include "AllocationTracker.h"
+
+#include <iostream>
+#include <fstream>
+
+#include "imgui/imgui.h"
+
+// How quickly the hud values follow new timings 
+static const float HUDSMOOTHING = 0.05f;
+
+Profiler::Profiler()
+    : m_Epoch(std::chrono::steady_clock::now()), m_Frame(0), m_IsRecording(false)
+{
+}
+
+Profiler::~Profiler()
+{
+    for (unsigned int i = 0; i < m_Stages.size(); i++)
+    {
+        if (m_Stages[i].timesGpu)
+        {
+            glDeleteQueries(2, m_Stages[i].queries);
+        }
+    }
+}
+
+double Profiler::NowMs() const
+{
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - m_Epoch).count();
+}
+
+int Profiler::AddStage(const std::string& name, bool timesGpu)
+{
+    Stage stage;
+    stage.name = name;
+    stage.timesGpu = timesGpu;
+    stage.queries[0] = stage.queries[1] = 0;
+    stage.queryPending[0] = stage.queryPending[1] = false;
+    stage.queryStart[0] = stage.queryStart[1] = 0.0;
+    stage.cpuStart = 0.0;
+    stage.cpuMs = stage.gpuMs = 0.0f;
+    stage.runs = 0;
+    stage.cpuAverageMs = stage.gpuAverageMs = 0.0f;
+    stage.allocStart = stage.bytesStart = 0;
+    stage.allocations = 0;
+    stage.allocatedBytes = 0;
+    stage.lastRuns = 0;
+    stage.lastAllocations = 0;
+    stage.lastAllocatedBytes = 0;
+
+    if (timesGpu)
+    {
+        GLCall(glGenQueries(2, stage.queries));
+    }
+
+    m_Stages.push_back(stage);
+    return m_Stages.size() - 1;
+}
+
+/// <summary>
+/// Collect any finished query without waiting for unfinished ones 
+/// </summary>
+void Profiler::ReadQueries(int index)
+{
+    Stage& stage = m_Stages[index];
+
+    for (unsigned int i = 0; i < 2; i++)
+    {
+        if (!stage.queryPending[i])
+            continue;
+
+        int available = GL_FALSE;
+        glGetQueryObjectiv(stage.queries[i], GL_QUERY_RESULT_AVAILABLE, &available);
+        if (available == GL_FALSE)
+            continue;
+
+        GLuint64 elapsed = 0;
+        glGetQueryObjectui64v(stage.queries[i], GL_QUERY_RESULT, &elapsed);
+        stage.queryPending[i] = false;
+
+        stage.gpuMs = (float)(elapsed / 1000000.0);
+        stage.gpuAverageMs += (stage.gpuMs - stage.gpuAverageMs) * HUDSMOOTHING;
+
+        if (m_IsRecording)
+        {
+            // GPU work has no CPU timestamp, line it up with when it was submitted 
+            Record({ index, true, stage.queryStart[i], stage.gpuMs });
+        }
+    }
+}
+
+void Profiler::BeginFrame()
+{
+    // Frames where a stage did not run count as zero, so a substepped stage
+    // averages to its cost per frame 
+    if (m_Frame > 0)
+    {
+        for (unsigned int i = 0; i < m_Stages.size(); i++)
+        {
+            Stage& stage = m_Stages[i];
+            stage.cpuAverageMs += (stage.cpuMs - stage.cpuAverageMs) * HUDSMOOTHING;
+            stage.lastRuns = stage.runs;
+            stage.lastAllocations = stage.allocations;
+            stage.lastAllocatedBytes = stage.allocatedBytes;
+
+            stage.cpuMs = 0.0f;
+            stage.runs = 0;
+            stage.allocations = 0;
+            stage.allocatedBytes = 0;
+        }
+    }
+
+    m_Frame++;
+
+    for (unsigned int i = 0; i < m_Stages.size(); i++)
+    {
+        if (m_Stages[i].timesGpu)
+        {
+            ReadQueries(i);
+        }
+    }
+}
+
+void Profiler::Begin(int stage)
+{
+    Stage& current = m_Stages[stage];
+    current.cpuStart = NowMs();
+    current.allocStart = AllocationTracker::GetCount();
+    current.bytesStart = AllocationTracker::GetBytes();
+
+    if (current.timesGpu)
+    {
+        // A result that never arrived is simply dropped when the query is reused 
+        unsigned int set = m_Frame & 1;
+        current.queryPending[set] = false;
+        current.queryStart[set] = current.cpuStart;
+        glBeginQuery(GL_TIME_ELAPSED, current.queries[set]);
+    }
+}
+
+void Profiler::End(int stage)
+{
+    Stage& current = m_Stages[stage];
+
+    if (current.timesGpu)
+    {
+        glEndQuery(GL_TIME_ELAPSED);
+        current.queryPending[m_Frame & 1] = true;
+    }
+
+    float cpuMs = (float)(NowMs() - current.cpuStart);
+    current.cpuMs += cpuMs;
+    current.runs++;
+    current.allocations += (unsigned int)(AllocationTracker::GetCount() - current.allocStart);
+    current.allocatedBytes += AllocationTracker::GetBytes() - current.bytesStart;
+
+    // After the allocation counts were taken, so the trace is never measured 
+    if (m_IsRecording)
+    {
+        Record({ stage, false, current.cpuStart, cpuMs });
+    }
+}
+
+/// <summary>
+/// Store an event in the reserved trace, or stop recording when it is full
+/// and keep what was recorded until it is saved 
+/// </summary>
+void Profiler::Record(const TraceEvent& event)
+{
+    if (m_Trace.size() == TRACECAPACITY)
+    {
+        m_IsRecording = false;
+        return;
+    }
+
+    m_Trace.push_back(event);
+}
+
+/// <summary>
+/// Table of every stage with its CPU and GPU time per frame and how many
+/// times it ran in the last frame 
+/// </summary>
+void Profiler::DrawHud()
+{
+    ImGui::Text("Stage            CPU ms    GPU ms  Runs");
+    for (unsigned int i = 0; i < m_Stages.size(); i++)
+    {
+        const Stage& stage = m_Stages[i];
+        if (stage.timesGpu)
+        {
+            ImGui::Text("%-16s %6.3f    %6.3f  %4u", stage.name.c_str(), stage.cpuAverageMs, stage.gpuAverageMs, stage.lastRuns);
+        }
+        else
+        {
+            ImGui::Text("%-16s %6.3f         -  %4u", stage.name.c_str(), stage.cpuAverageMs, stage.lastRuns);
+        }
+    }
+
+    if (AllocationTracker::IsEnabled())
+    {
+        // Last frame only, anything above zero in a steady frame is a regression 
+        ImGui::Text("Stage            Allocs     Bytes");
+        for (unsigned int i = 0; i < m_Stages.size(); i++)
+        {
+            const Stage& stage = m_Stages[i];
+            ImGui::Text("%-16s %6u %9llu", stage.name.c_str(), stage.lastAllocations, stage.lastAllocatedBytes);
+        }
+    }
+
+    if (m_IsRecording || !m_Trace.empty())
+    {
+        if (!m_IsRecording)
+        {
+            ImGui::Text("Trace full after %u events", (unsigned int)m_Trace.size());
+        }
+
+        if (ImGui::Button("Save Trace"))
+        {
+            WriteTrace("trace.json");
+        }
+    }
+    else if (ImGui::Button("Record Trace"))
+    {
+        StartTrace();
+    }
+}
+
+void Profiler::StartTrace()
+{
+    m_Trace.clear();
+    m_Trace.reserve(TRACECAPACITY);
+    m_IsRecording = true;
+}
+
+/// <summary>
+/// Write everything recorded since StartTrace in the Trace Event format.
+/// CPU and GPU timings end up on separate rows 
+/// </summary>
+bool Profiler::WriteTrace(const std::string& filepath)
+{
+    m_IsRecording = false;
+
+    std::ofstream stream(filepath, std::ios::out | std::ios::trunc);
+    if (!stream)
+    {
+        std::cout << "[Profiler] Could not write " << filepath << std::endl;
+        return false;
+    }
+
+    stream << "{\"traceEvents\":[\n";
+    stream << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,\"tid\":0,\"args\":{\"name\":\"CPU\"}},\n";
+    stream << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,\"tid\":1,\"args\":{\"name\":\"GPU\"}}";
+
+    for (unsigned int i = 0; i < m_Trace.size(); i++)
+    {
+        const TraceEvent& event = m_Trace[i];
+
+        // Trace timestamps are in microseconds 
+        stream << ",\n{\"name\":\"" << m_Stages[event.stage].name
+            << "\",\"ph\":\"X\",\"pid\":0,\"tid\":" << (event.gpu ? 1 : 0)
+            << ",\"ts\":" << (unsigned long long)(event.startMs * 1000.0)
+            << ",\"dur\":" << (unsigned long long)(event.durationMs * 1000.0) << "}";
+    }
+
+    stream << "\n]}\n";
+
+    std::cout << "[Profiler] Wrote " << m_Trace.size() << " events to " << filepath << std::endl;
+    m_Trace.clear();
+    return true;
+}
\ No newline at end of file
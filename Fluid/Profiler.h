@@ -0,0 +1,128 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <chrono>
+
+/// <summary>
+/// Per-stage frame timings. Every stage is timed on the CPU and stages that
+/// issue draw calls can also be timed on the GPU with GL_TIME_ELAPSED queries.
+/// Queries are double buffered and read back a frame later so the CPU never
+/// waits on them
+/// </summary>
+class Profiler
+{
+private:
+	struct Stage
+	{
+		std::string name;
+		bool timesGpu;
+
+		// One query per frame in flight 
+		unsigned int queries[2];
+		bool queryPending[2];
+		double queryStart[2];
+
+		double cpuStart;
+		float gpuMs;
+
+		// Totals over every run of the stage this frame, a stage can run
+		// several times a frame or not at all. Reset by BeginFrame 
+		float cpuMs;
+		unsigned int runs;
+
+		// Smoothed per frame totals for the hud 
+		float cpuAverageMs;
+		float gpuAverageMs;
+
+		// Heap use during the stage, only counted in allocation tracking builds 
+		unsigned long long allocStart;
+		unsigned long long bytesStart;
+		unsigned int allocations;
+		unsigned long long allocatedBytes;
+
+		// Totals of the last finished frame, what the hud shows 
+		unsigned int lastRuns;
+		unsigned int lastAllocations;
+		unsigned long long lastAllocatedBytes;
+	};
+
+	struct TraceEvent
+	{
+		int stage;
+		bool gpu;
+		double startMs;
+		float durationMs;
+	};
+
+	std::vector<Stage> m_Stages;
+	std::vector<TraceEvent> m_Trace;
+
+	std::chrono::steady_clock::time_point m_Epoch;
+	unsigned int m_Frame;
+	bool m_IsRecording;
+
+	// Recording stops once this many events are stored, so the trace never
+	// allocates inside a measured stage 
+	static const unsigned int TRACECAPACITY = 1 << 16;
+
+	double NowMs() const;
+	void ReadQueries(int index);
+	void Record(const TraceEvent& event);
+public:
+	Profiler();
+	~Profiler();
+
+	/// <summary>
+	/// Register a stage once during setup 
+	/// </summary>
+	/// <param name="timesGpu">Wrap the stage in a GPU timer query as well</param>
+	/// <returns>Id that is passed to Begin and End</returns>
+	int AddStage(const std::string& name, bool timesGpu);
+
+	/// <summary>
+	/// Finish the totals of the last frame and start new ones 
+	/// </summary>
+	void BeginFrame();
+
+	// GPU timed stages can not be nested inside each other 
+	void Begin(int stage);
+	void End(int stage);
+
+	// Totals of the frame so far 
+	inline float GetCpuMs(int stage) const { return m_Stages[stage].cpuMs; }
+	inline float GetGpuMs(int stage) const { return m_Stages[stage].gpuMs; }
+	inline unsigned int GetRuns(int stage) const { return m_Stages[stage].runs; }
+	inline unsigned int GetAllocations(int stage) const { return m_Stages[stage].allocations; }
+	inline unsigned long long GetAllocatedBytes(int stage) const { return m_Stages[stage].allocatedBytes; }
+	inline const std::string& GetName(int stage) const { return m_Stages[stage].name; }
+	inline int GetStageCount() const { return m_Stages.size(); }
+
+	void DrawHud();
+
+	// Chrome trace (chrome://tracing) export of recorded frames 
+	void StartTrace();
+	bool WriteTrace(const std::string& filepath);
+	inline bool IsRecording() const { return m_IsRecording; }
+};
+
+/// <summary>
+/// Times the enclosing scope as the given stage 
+/// </summary>
+class ProfileScope
+{
+private:
+	Profiler& m_Profiler;
+	int m_Stage;
+public:
+	ProfileScope(Profiler& profiler, int stage)
+		: m_Profiler(profiler), m_Stage(stage)
+	{
+		m_Profiler.Begin(m_Stage);
+	}
+
+	~ProfileScope()
+	{
+		m_Profiler.End(m_Stage);
+	}
+};
\ No newline at end of file
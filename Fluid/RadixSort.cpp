@@ -0,0 +1,93 @@
+#include "RadixSort.h"
+#include "Parallel.h"
+
+#include <algorithm>
+
+// Small inputs are not worth splitting up 
+static const unsigned int MINCHUNKSIZE = 2048;
+
+RadixSort::RadixSort(unsigned int capacity)
+{
+	scratchKeys = std::vector<unsigned int>(capacity);
+	scratchValues = std::vector<unsigned int>(capacity);
+	histograms = std::vector<unsigned int>(MAXCHUNKS * BUCKETS);
+}
+
+void RadixSort::Sort(unsigned int* keys, unsigned int* values, unsigned int count, unsigned int keyBits)
+{
+	if (count < 2 || keyBits == 0)
+		return;
+
+	unsigned int chunks = (count + MINCHUNKSIZE - 1) / MINCHUNKSIZE;
+	chunks = std::min(chunks, std::min(MAXCHUNKS, Parallel::GetThreadCount() * 4));
+	chunks = std::max(chunks, 1u);
+	unsigned int chunkSize = (count + chunks - 1) / chunks;
+
+	unsigned int* srcKeys = keys;
+	unsigned int* srcValues = values;
+	unsigned int* dstKeys = scratchKeys.data();
+	unsigned int* dstValues = scratchValues.data();
+	unsigned int* counts = histograms.data();
+
+	unsigned int passes = (keyBits + DIGITBITS - 1) / DIGITBITS;
+	for (unsigned int pass = 0; pass < passes; pass++)
+	{
+		unsigned int shift = pass * DIGITBITS;
+
+		// Count digits in every chunk 
+		Parallel::For(0, chunks, 1, [&](int chunkBegin, int chunkEnd)
+		{
+			for (int chunk = chunkBegin; chunk < chunkEnd; chunk++)
+			{
+				unsigned int* chunkCounts = counts + chunk * BUCKETS;
+				std::fill(chunkCounts, chunkCounts + BUCKETS, 0);
+
+				unsigned int begin = chunk * chunkSize;
+				unsigned int end = std::min(count, begin + chunkSize);
+				for (unsigned int i = begin; i < end; i++)
+				{
+					chunkCounts[(srcKeys[i] >> shift) & (BUCKETS - 1)]++;
+				}
+			}
+		});
+
+		// Digit major, chunk minor, so equal digits keep their input order 
+		unsigned int offset = 0;
+		for (unsigned int digit = 0; digit < BUCKETS; digit++)
+		{
+			for (unsigned int chunk = 0; chunk < chunks; chunk++)
+			{
+				unsigned int digitCount = counts[chunk * BUCKETS + digit];
+				counts[chunk * BUCKETS + digit] = offset;
+				offset += digitCount;
+			}
+		}
+
+		Parallel::For(0, chunks, 1, [&](int chunkBegin, int chunkEnd)
+		{
+			for (int chunk = chunkBegin; chunk < chunkEnd; chunk++)
+			{
+				unsigned int* chunkOffsets = counts + chunk * BUCKETS;
+
+				unsigned int begin = chunk * chunkSize;
+				unsigned int end = std::min(count, begin + chunkSize);
+				for (unsigned int i = begin; i < end; i++)
+				{
+					unsigned int target = chunkOffsets[(srcKeys[i] >> shift) & (BUCKETS - 1)]++;
+					dstKeys[target] = srcKeys[i];
+					dstValues[target] = srcValues[i];
+				}
+			}
+		});
+
+		std::swap(srcKeys, dstKeys);
+		std::swap(srcValues, dstValues);
+	}
+
+	// An odd number of passes leaves the result in scratch 
+	if (srcKeys != keys)
+	{
+		std::copy(srcKeys, srcKeys + count, keys);
+		std::copy(srcValues, srcValues + count, values);
+	}
+}
\ No newline at end of file
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <vector>
+
+/// <summary>
+/// Stable least significant digit radix sort of 32 bit keys carrying a 32 bit
+/// value each. Digits are 8 bits wide and only as many passes are run as the
+/// key width needs. Each pass histograms and scatters chunks of the input on
+/// the Parallel workers. Scratch space is allocated once for the capacity
+/// </summary>
+class RadixSort
+{
+private:
+	static const unsigned int DIGITBITS = 8;
+	static const unsigned int BUCKETS = 1 << DIGITBITS;
+	static const unsigned int MAXCHUNKS = 64;
+
+	std::vector<unsigned int> scratchKeys;
+	std::vector<unsigned int> scratchValues;
+
+	// BUCKETS counts per chunk, turned into output offsets before scattering 
+	std::vector<unsigned int> histograms;
+
+public:
+	RadixSort(unsigned int capacity);
+
+	/// <summary>
+	/// Sort both arrays by key. Only the low keyBits of every key are looked at 
+	/// </summary>
+	/// <param name="count">At most the capacity given on construction</param>
+	void Sort(unsigned int* keys, unsigned int* values, unsigned int count, unsigned int keyBits);
+};
\ No newline at end of file
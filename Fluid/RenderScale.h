@@ -0,0 +1,57 @@
+#pragma once
+
+#include "glm/glm.hpp"
+
+/// <summary>
+/// Fraction of the window resolution the scene is drawn at. In dynamic
+/// mode the scale follows the measured GPU time of the scene towards a target
+/// </summary>
+class RenderScale
+{
+private:
+	float m_Scale;
+	float m_MinScale;
+	float m_MaxScale;
+
+	float m_TargetMs;
+	float m_AverageMs;
+public:
+	RenderScale(float scale, float minScale, float maxScale, float targetMs)
+		: m_Scale(scale), m_MinScale(minScale), m_MaxScale(maxScale), m_TargetMs(targetMs), m_AverageMs(targetMs) {}
+
+	/// <summary>
+	/// Feed the GPU time the scene last took and move the scale towards the target 
+	/// </summary>
+	/// <returns>The scale to use for the next frame</returns>
+	float Update(float frameMs)
+	{
+		// Smooth out single slow frames 
+		m_AverageMs += (frameMs - m_AverageMs) * 0.1f;
+
+		if (m_AverageMs > m_TargetMs * 1.05f)
+		{
+			// Fill cost grows with the area, so shrink each side by the square root 
+			float ratio = glm::sqrt(m_TargetMs / m_AverageMs);
+			m_Scale *= glm::max(ratio, 0.95f);
+		}
+		else if (m_AverageMs < m_TargetMs * 0.85f)
+		{
+			// Creep back up slowly so the scale does not oscillate 
+			m_Scale *= 1.01f;
+		}
+
+		m_Scale = glm::clamp(m_Scale, m_MinScale, m_MaxScale);
+		return m_Scale;
+	}
+
+	inline void SetScale(float scale) { m_Scale = glm::clamp(scale, m_MinScale, m_MaxScale); }
+	inline float GetScale() const { return m_Scale; }
+
+	inline void SetTargetMs(float targetMs) { m_TargetMs = targetMs; }
+	inline float GetTargetMs() const { return m_TargetMs; }
+
+	/// <summary>
+	/// Size of one side after scaling, never less than a pixel 
+	/// </summary>
+	inline int Apply(int size) const { return glm::max(1, (int)(size * m_Scale)); }
+};
\ No newline at end of file
@@ -37,3 +37,13 @@ void Renderer::Draw(const VertexArray& va, const IndexBuffer& ib, const Shader&
     GLCall(glDrawElements(GL_TRIANGLES, ib.GetCount(), GL_UNSIGNED_INT, nullptr));
 }
 
+/// <summary>
+/// Draw without an index buffer. The vertex shader is expected to build
+/// its vertices from gl_VertexID 
+/// </summary>
+void Renderer::DrawArrays(const VertexArray& va, unsigned int vertexCount, const Shader& shader) const
+{
+    shader.Bind();
+    va.Bind();
+    GLCall(glDrawArrays(GL_TRIANGLES, 0, vertexCount));
+}
@@ -19,4 +19,5 @@ class Renderer
 public:
     void Clear() const;
     void Draw(const VertexArray& va, const IndexBuffer& ib, const Shader& shader) const;
+    void DrawArrays(const VertexArray& va, unsigned int vertexCount, const Shader& shader) const;
 };
@@ -3,16 +3,33 @@
 #include <iostream>
 #include <fstream>
 #include <string>
-#include <sstream>
 
 #include "Renderer.h"
+#include "ShaderCache.h"
 
+std::unordered_map<std::string, unsigned int> Shader::s_UniformBlockBindings;
 
-Shader::Shader(const std::string& filepath)
-	:m_FilePath(filepath), m_rendererID(0)
+Shader::Shader(const std::string& filepath, bool deferLink)
+	:m_FilePath(filepath), m_rendererID(0), m_VertexID(0), m_FragmentID(0), m_CacheKey(0), m_IsPending(false), m_FromCache(false)
 {
     ShaderProgramSource source = ParseShader(filepath);
-    m_rendererID = CreateShader(source.VertexSource, source.FragmentSource);
+    m_CacheKey = ShaderCache::MakeKey(source.VertexSource, source.FragmentSource);
+
+    // Skip compiling entirely if this driver has already seen the same source 
+    m_rendererID = glCreateProgram();
+    if (ShaderCache::Load(m_CacheKey, m_rendererID))
+    {
+        m_FromCache = true;
+        ReflectProgram();
+        return;
+    }
+
+    CreateShader(source.VertexSource, source.FragmentSource);
+
+    if (!deferLink)
+    {
+        Finish();
+    }
 }
 
 Shader::~Shader()
@@ -23,40 +40,65 @@ Shader::~Shader()
 
 ShaderProgramSource Shader::ParseShader(const std::string& filepath)
 {
-    std::ifstream stream(filepath);
+    // Read the whole file in one go and split it on the "#shader" markers 
+    std::ifstream stream(filepath, std::ios::in | std::ios::binary);
+    std::string file;
+    if (stream)
+    {
+        stream.seekg(0, std::ios::end);
+        file.resize((size_t)stream.tellg());
+        stream.seekg(0, std::ios::beg);
+        stream.read(&file[0], file.size());
+    }
 
     enum class ShaderType
     {
         NONE = -1, VERTEX = 0, FRAGMENT = 1
     };
 
-    std::string line;
-    std::stringstream ss[2];
+    std::string sources[2];
     ShaderType type = ShaderType::NONE;
-    while (getline(stream, line))
+
+    size_t lineStart = 0;
+    while (lineStart < file.size())
     {
-        if (line.find("#shader") != std::string::npos)
+        size_t lineEnd = file.find('\n', lineStart);
+        if (lineEnd == std::string::npos)
+            lineEnd = file.size();
+
+        size_t marker = file.find("#shader", lineStart);
+        if (marker != std::string::npos && marker < lineEnd)
         {
-            if (line.find("vertex") != std::string::npos)
+            size_t vertex = file.find("vertex", marker);
+            size_t fragment = file.find("fragment", marker);
+
+            if (vertex != std::string::npos && vertex < lineEnd)
             {
                 // mode vertex 
                 type = ShaderType::VERTEX;
             }
-            else if (line.find("fragment") != std::string::npos)
+            else if (fragment != std::string::npos && fragment < lineEnd)
             {
                 // mode fragment 
                 type = ShaderType::FRAGMENT;
             }
         }
-        else
+        else if (type != ShaderType::NONE)
         {
-            ss[(int)type] << line << '\n';
+            sources[(int)type].append(file, lineStart, lineEnd - lineStart);
+            sources[(int)type] += '\n';
         }
+
+        lineStart = lineEnd + 1;
     }
 
-    return { ss[0].str(), ss[1].str() };
+    return { sources[0], sources[1] };
 }
 
+/// <summary>
+/// Only queues the compile. The status is checked in Finish so the driver
+/// is free to work on it in the background
+/// </summary>
 unsigned int Shader::CompileShader(unsigned int type, const std::string& source)
 {
     unsigned int id = glCreateShader(type);
@@ -64,6 +106,11 @@ unsigned int Shader::CompileShader(unsigned int type, const std::string& source)
     glShaderSource(id, 1, &src, nullptr);
     glCompileShader(id);
 
+    return id;
+}
+
+bool Shader::CheckShader(unsigned int id, unsigned int type)
+{
     int result;
     glGetShaderiv(id, GL_COMPILE_STATUS, &result);
     if (result == GL_FALSE)
@@ -75,29 +122,156 @@ unsigned int Shader::CompileShader(unsigned int type, const std::string& source)
         glGetShaderInfoLog(id, length, &length, message);
         std::cout << "Failed to compile " << (type == GL_VERTEX_SHADER ? "vertex" : "fragment") << " shader!" << std::endl;
         std::cout << message << std::endl;
-        glDeleteShader(id);
-        return 0;
+        return false;
     }
 
-    return id;
+    return true;
 }
 
-unsigned int Shader::CreateShader(const std::string& vertexShader, const std::string& fragmentShader)
+void Shader::CreateShader(const std::string& vertexShader, const std::string& fragmentShader)
 {
-    unsigned int program = glCreateProgram();
-    unsigned int vs = CompileShader(GL_VERTEX_SHADER, vertexShader);
-    unsigned int fs = CompileShader(GL_FRAGMENT_SHADER, fragmentShader);
+    m_VertexID = CompileShader(GL_VERTEX_SHADER, vertexShader);
+    m_FragmentID = CompileShader(GL_FRAGMENT_SHADER, fragmentShader);
 
     // Link both programs together 
-    glAttachShader(program, vs);
-    glAttachShader(program, fs);
-    glLinkProgram(program);
-    glValidateProgram(program);
+    glAttachShader(m_rendererID, m_VertexID);
+    glAttachShader(m_rendererID, m_FragmentID);
+
+    if (ShaderCache::IsSupported())
+    {
+        glProgramParameteri(m_rendererID, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+    }
+
+    glLinkProgram(m_rendererID);
+    m_IsPending = true;
+}
+
+/// <summary>
+/// Wait for a deferred compile and link to be done, then report errors,
+/// store the binary and resolve the uniforms 
+/// </summary>
+void Shader::Finish()
+{
+    if (!m_IsPending)
+        return;
+
+    m_IsPending = false;
+
+    bool compiled = CheckShader(m_VertexID, GL_VERTEX_SHADER);
+    compiled = CheckShader(m_FragmentID, GL_FRAGMENT_SHADER) && compiled;
+
+    int linked = GL_FALSE;
+    glGetProgramiv(m_rendererID, GL_LINK_STATUS, &linked);
+    if (compiled && linked == GL_FALSE)
+    {
+        int length;
+        glGetProgramiv(m_rendererID, GL_INFO_LOG_LENGTH, &length);
+        char* message = (char*)_malloca(length * sizeof(char));
+        glGetProgramInfoLog(m_rendererID, length, &length, message);
+        std::cout << "Failed to link " << m_FilePath << "!" << std::endl;
+        std::cout << message << std::endl;
+    }
+
+    glDetachShader(m_rendererID, m_VertexID);
+    glDetachShader(m_rendererID, m_FragmentID);
+    glDeleteShader(m_VertexID);
+    glDeleteShader(m_FragmentID);
+    m_VertexID = 0;
+    m_FragmentID = 0;
+
+    if (compiled && linked == GL_TRUE)
+    {
+        glValidateProgram(m_rendererID);
+        ShaderCache::Store(m_CacheKey, m_rendererID);
+    }
+
+    ReflectProgram();
+}
+
+/// <summary>
+/// Whether a deferred compile is done. Never blocks when the driver
+/// supports parallel compiling 
+/// </summary>
+bool Shader::IsReady() const
+{
+    if (!m_IsPending)
+        return true;
 
-    glDeleteShader(vs);
-    glDeleteShader(fs);
+    if (GLEW_KHR_parallel_shader_compile || GLEW_ARB_parallel_shader_compile)
+    {
+        int complete = GL_FALSE;
+        glGetProgramiv(m_rendererID, GL_COMPLETION_STATUS_KHR, &complete);
+        return complete == GL_TRUE;
+    }
 
-    return program;
+    return false;
+}
+
+/// <summary>
+/// Let the driver compile deferred programs on its own threads 
+/// </summary>
+void Shader::EnableParallelCompile()
+{
+    if (GLEW_KHR_parallel_shader_compile)
+    {
+        glMaxShaderCompilerThreadsKHR(0xFFFFFFFF);
+    }
+    else if (GLEW_ARB_parallel_shader_compile)
+    {
+        glMaxShaderCompilerThreadsARB(0xFFFFFFFF);
+    }
+}
+
+/// <summary>
+/// Resolve every active uniform once after linking so the render loop
+/// never has to ask the driver, and attach declared uniform blocks
+/// </summary>
+void Shader::ReflectProgram()
+{
+    int uniformCount = 0;
+    GLCall(glGetProgramiv(m_rendererID, GL_ACTIVE_UNIFORMS, &uniformCount));
+
+    char name[256];
+    for (int i = 0; i < uniformCount; i++)
+    {
+        int length = 0;
+        int size = 0;
+        unsigned int type = 0;
+        glGetActiveUniform(m_rendererID, i, sizeof(name), &length, &size, &type, name);
+
+        // Uniforms inside blocks have no location 
+        int location = glGetUniformLocation(m_rendererID, name);
+        if (location == -1)
+            continue;
+
+        // Arrays are reported as "name[0]" 
+        std::string uniformName(name, length);
+        size_t bracket = uniformName.find('[');
+        if (bracket != std::string::npos)
+            uniformName = uniformName.substr(0, bracket);
+
+        m_UniformLocationCache[uniformName] = location;
+    }
+
+    int blockCount = 0;
+    GLCall(glGetProgramiv(m_rendererID, GL_ACTIVE_UNIFORM_BLOCKS, &blockCount));
+
+    for (int i = 0; i < blockCount; i++)
+    {
+        int length = 0;
+        glGetActiveUniformBlockName(m_rendererID, i, sizeof(name), &length, name);
+
+        auto binding = s_UniformBlockBindings.find(std::string(name, length));
+        if (binding != s_UniformBlockBindings.end())
+        {
+            GLCall(glUniformBlockBinding(m_rendererID, i, binding->second));
+        }
+    }
+}
+
+void Shader::DeclareUniformBlock(const std::string& blockName, unsigned int binding)
+{
+    s_UniformBlockBindings[blockName] = binding;
 }
 
 void Shader::Bind() const
@@ -110,6 +284,26 @@ void Shader::Unbind() const
     GLCall(glUseProgram(0));
 }
 
+void Shader::SetUniform(Uniform<int> uniform, int value) const
+{
+    glUniform1i(uniform.GetLocation(), value);
+}
+
+void Shader::SetUniform(Uniform<float> uniform, float value) const
+{
+    glUniform1f(uniform.GetLocation(), value);
+}
+
+void Shader::SetUniform(Uniform<glm::vec4> uniform, const glm::vec4& value) const
+{
+    glUniform4f(uniform.GetLocation(), value.x, value.y, value.z, value.w);
+}
+
+void Shader::SetUniform(Uniform<glm::mat4> uniform, const glm::mat4& matrix) const
+{
+    glUniformMatrix4fv(uniform.GetLocation(), 1, GL_FALSE, &matrix[0][0]);
+}
+
 void Shader::SetUniform1i(const std::string& name, int value)
 {
     GLCall(glUniform1i(GetUinformLocation(name), value));
@@ -130,17 +324,19 @@ void Shader::SetUniformMat4f(const std::string& name, const glm::mat4& matrix)
     glUniformMatrix4fv(GetUinformLocation(name), 1, GL_FALSE, &matrix[0][0]);
 }
 
-unsigned int Shader::GetUinformLocation(const std::string& name)
+int Shader::GetUinformLocation(const std::string& name)
 {
-    if (m_UniformLocationCache.find(name) != m_UniformLocationCache.end())
+    auto cached = m_UniformLocationCache.find(name);
+    if (cached != m_UniformLocationCache.end())
     {
-        return m_UniformLocationCache[name];
+        return cached->second;
     }
 
-    GLCall(unsigned int location = glGetUniformLocation(m_rendererID, name.c_str()));
+    // Not an active uniform, most likely optimized out by the driver 
+    GLCall(int location = glGetUniformLocation(m_rendererID, name.c_str()));
     if (location == -1)
     {
-
+        std::cout << "[Shader] Uniform " << name << " does not exist in " << m_FilePath << std::endl;
     }
 
     m_UniformLocationCache[name] = location;
@@ -11,29 +11,93 @@ struct ShaderProgramSource
 	std::string FragmentSource;
 };
 
+/// <summary>
+/// Handle to a uniform that was resolved when the program was linked.
+/// The type only exists so the matching SetUniform overload is picked
+/// at compile time
+/// </summary>
+template<typename T>
+class Uniform
+{
+private:
+	int m_Location;
+public:
+	Uniform()
+		: m_Location(-1) {}
+	explicit Uniform(int location)
+		: m_Location(location) {}
+
+	inline int GetLocation() const { return m_Location; }
+	inline bool IsValid() const { return m_Location != -1; }
+};
+
 class Shader
 {
 private:
 	std::unordered_map<std::string, int> m_UniformLocationCache;
 	std::string m_FilePath;
 	unsigned int m_rendererID;
-	// caching for uniforms 
+
+	// Shaders of a deferred compile that has not been finished yet 
+	unsigned int m_VertexID;
+	unsigned int m_FragmentID;
+	unsigned long long m_CacheKey;
+	bool m_IsPending;
+	bool m_FromCache;
+
+	// Uniform block names and the binding points they are attached to for every program
+	static std::unordered_map<std::string, unsigned int> s_UniformBlockBindings;
 public:
-	Shader(const std::string& filepath);
+	/// <summary>
+	/// Loads the program from the binary cache when possible, otherwise compiles it.
+	/// With deferLink the compile is only started and Finish has to be called before use,
+	/// which lets several programs compile at the same time
+	/// </summary>
+	Shader(const std::string& filepath, bool deferLink = false);
 	~Shader();
 
+	void Finish();
+	bool IsReady() const;
+	inline bool WasLoadedFromCache() const { return m_FromCache; }
+
+	static void EnableParallelCompile();
+
 	void Bind() const;
 	void Unbind() const;
 
-	// Set uniforms 
+	/// <summary>
+	/// Look up a uniform that was resolved at link time. Meant to be called once
+	/// during setup and the handle kept around for the render loop
+	/// </summary>
+	template<typename T>
+	Uniform<T> GetUniform(const std::string& name)
+	{
+		return Uniform<T>(GetUinformLocation(name));
+	}
+
+	// Set uniforms through resolved handles (no lookups)
+	void SetUniform(Uniform<int> uniform, int value) const;
+	void SetUniform(Uniform<float> uniform, float value) const;
+	void SetUniform(Uniform<glm::vec4> uniform, const glm::vec4& value) const;
+	void SetUniform(Uniform<glm::mat4> uniform, const glm::mat4& matrix) const;
+
+	// Set uniforms by name
 	void SetUniform1i(const std::string& name, int value);
 	void SetUniform1f(const std::string& name, float value);
 	void SetUniform4f(const std::string& name, float v0, float v1, float v2, float v3);
 	void SetUniformMat4f(const std::string& name, const glm::mat4& matrix);
 
+	/// <summary>
+	/// Any program created afterwards that declares a uniform block with this
+	/// name gets it attached to the given binding point
+	/// </summary>
+	static void DeclareUniformBlock(const std::string& blockName, unsigned int binding);
+
 private:
 	ShaderProgramSource ParseShader(const std::string& filepath);
 	unsigned int CompileShader(unsigned int type, const std::string& source);
-	unsigned int CreateShader(const std::string& vertexShader, const std::string& fragmentShader);
-	unsigned int GetUinformLocation(const std::string& name);
+	bool CheckShader(unsigned int id, unsigned int type);
+	void CreateShader(const std::string& vertexShader, const std::string& fragmentShader);
+	void ReflectProgram();
+	int GetUinformLocation(const std::string& name);
 };
\ No newline at end of file
@@ -0,0 +1,122 @@
+#include "ShaderCache.h"
+
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <direct.h>
+
+#include "Renderer.h"
+
+std::string ShaderCache::s_Directory = "res/shadercache/";
+std::string ShaderCache::s_DriverString;
+
+// Written at the start of each cache file 
+static const unsigned int CACHEMAGIC = 0x31435346; // "FSC1"
+
+/// <summary>
+/// 64 bit FNV-1a, good enough to tell sources apart 
+/// </summary>
+static unsigned long long HashString(const std::string& str, unsigned long long hash = 14695981039346656037ull)
+{
+    for (size_t i = 0; i < str.size(); i++)
+    {
+        hash ^= (unsigned char)str[i];
+        hash *= 1099511628211ull;
+    }
+
+    return hash;
+}
+
+bool ShaderCache::IsSupported()
+{
+    if (!GLEW_ARB_get_program_binary)
+        return false;
+
+    int formats = 0;
+    glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+    return formats > 0;
+}
+
+void ShaderCache::SetDirectory(const std::string& directory)
+{
+    s_Directory = directory;
+}
+
+unsigned long long ShaderCache::MakeKey(const std::string& vertexSource, const std::string& fragmentSource)
+{
+    if (s_DriverString.empty())
+    {
+        // Binaries are only valid for the exact driver that made them 
+        const char* vendor = (const char*)glGetString(GL_VENDOR);
+        const char* renderer = (const char*)glGetString(GL_RENDERER);
+        const char* version = (const char*)glGetString(GL_VERSION);
+
+        s_DriverString = std::string(vendor ? vendor : "") + "|" + (renderer ? renderer : "") + "|" + (version ? version : "");
+    }
+
+    unsigned long long hash = HashString(s_DriverString);
+    hash = HashString(vertexSource, hash);
+    hash = HashString("#shader fragment", hash);
+    return HashString(fragmentSource, hash);
+}
+
+std::string ShaderCache::GetPath(unsigned long long key)
+{
+    char name[17];
+    snprintf(name, sizeof(name), "%016llx", key);
+    return s_Directory + name + ".bin";
+}
+
+bool ShaderCache::Load(unsigned long long key, unsigned int program)
+{
+    if (!IsSupported())
+        return false;
+
+    std::ifstream stream(GetPath(key), std::ios::in | std::ios::binary);
+    if (!stream)
+        return false;
+
+    unsigned int header[3] = { 0, 0, 0 }; // magic, format, length 
+    stream.read((char*)header, sizeof(header));
+    if (!stream || header[0] != CACHEMAGIC || header[2] == 0)
+        return false;
+
+    std::vector<char> binary(header[2]);
+    stream.read(&binary[0], binary.size());
+    if (!stream)
+        return false;
+
+    glProgramBinary(program, header[1], &binary[0], (int)binary.size());
+
+    // Drivers are allowed to reject binaries for any reason 
+    int linked = GL_FALSE;
+    glGetProgramiv(program, GL_LINK_STATUS, &linked);
+    return linked == GL_TRUE;
+}
+
+void ShaderCache::Store(unsigned long long key, unsigned int program)
+{
+    if (!IsSupported())
+        return;
+
+    int length = 0;
+    glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &length);
+    if (length <= 0)
+        return;
+
+    std::vector<char> binary(length);
+    unsigned int format = 0;
+    glGetProgramBinary(program, length, &length, &format, &binary[0]);
+
+    _mkdir(s_Directory.c_str());
+    std::ofstream stream(GetPath(key), std::ios::out | std::ios::binary | std::ios::trunc);
+    if (!stream)
+    {
+        std::cout << "[ShaderCache] Could not write to " << s_Directory << std::endl;
+        return;
+    }
+
+    unsigned int header[3] = { CACHEMAGIC, format, (unsigned int)length };
+    stream.write((const char*)header, sizeof(header));
+    stream.write(&binary[0], length);
+}
\ No newline at end of file
@@ -0,0 +1,29 @@
+#pragma once
+
+#include <string>
+
+/// <summary>
+/// Keeps linked program binaries on disk so later launches can skip compiling.
+/// Entries are keyed by the shader source and the driver that produced them,
+/// a driver update simply misses the cache
+/// </summary>
+class ShaderCache
+{
+private:
+	static std::string s_Directory;
+	static std::string s_DriverString;
+
+	static std::string GetPath(unsigned long long key);
+public:
+	static bool IsSupported();
+	static void SetDirectory(const std::string& directory);
+
+	static unsigned long long MakeKey(const std::string& vertexSource, const std::string& fragmentSource);
+
+	/// <summary>
+	/// Try to fill the program with a cached binary 
+	/// </summary>
+	/// <returns>False if nothing was cached or the driver rejected it</returns>
+	static bool Load(unsigned long long key, unsigned int program);
+	static void Store(unsigned long long key, unsigned int program);
+};
\ No newline at end of file
@@ -0,0 +1,69 @@
+#include "TextureBuffer.h"
+#include "Renderer.h"
+
+TextureBuffer::TextureBuffer(unsigned int internalFormat)
+    : m_InternalFormat(internalFormat), m_Size(0)
+{
+    GLCall(glGenBuffers(1, &m_BufferID));
+    GLCall(glGenTextures(1, &m_TextureID));
+
+    // The texture only views the buffer so it can be attached once 
+    GLCall(glBindBuffer(GL_TEXTURE_BUFFER, m_BufferID));
+    GLCall(glBufferData(GL_TEXTURE_BUFFER, 0, nullptr, GL_STREAM_DRAW));
+    GLCall(glBindTexture(GL_TEXTURE_BUFFER, m_TextureID));
+    GLCall(glTexBuffer(GL_TEXTURE_BUFFER, m_InternalFormat, m_BufferID));
+    GLCall(glBindTexture(GL_TEXTURE_BUFFER, 0));
+    GLCall(glBindBuffer(GL_TEXTURE_BUFFER, 0));
+}
+
+TextureBuffer::~TextureBuffer()
+{
+    GLCall(glDeleteTextures(1, &m_TextureID));
+    GLCall(glDeleteBuffers(1, &m_BufferID));
+}
+
+/// <summary>
+/// Replace the contents. Storage is orphaned each time so a frame still
+/// being drawn from the old data does not stall the upload 
+/// </summary>
+void TextureBuffer::SetData(const void* data, unsigned int size)
+{
+    GLCall(glBindBuffer(GL_TEXTURE_BUFFER, m_BufferID));
+    if (size > m_Size)
+    {
+        GLCall(glBufferData(GL_TEXTURE_BUFFER, size, data, GL_STREAM_DRAW));
+        m_Size = size;
+    }
+    else
+    {
+        // Keep the larger storage so a changing particle count does not reallocate 
+        GLCall(glBufferData(GL_TEXTURE_BUFFER, m_Size, nullptr, GL_STREAM_DRAW));
+        GLCall(glBufferSubData(GL_TEXTURE_BUFFER, 0, size, data));
+    }
+    GLCall(glBindBuffer(GL_TEXTURE_BUFFER, 0));
+}
+
+/// <summary>
+/// Allocate storage up front so later uploads up to this size never grow it 
+/// </summary>
+void TextureBuffer::Reserve(unsigned int size)
+{
+    if (size <= m_Size)
+        return;
+
+    GLCall(glBindBuffer(GL_TEXTURE_BUFFER, m_BufferID));
+    GLCall(glBufferData(GL_TEXTURE_BUFFER, size, nullptr, GL_STREAM_DRAW));
+    GLCall(glBindBuffer(GL_TEXTURE_BUFFER, 0));
+    m_Size = size;
+}
+
+void TextureBuffer::Bind(unsigned int slot) const
+{
+    GLCall(glActiveTexture(GL_TEXTURE0 + slot));
+    GLCall(glBindTexture(GL_TEXTURE_BUFFER, m_TextureID));
+}
+
+void TextureBuffer::Unbind() const
+{
+    GLCall(glBindTexture(GL_TEXTURE_BUFFER, 0));
+}
\ No newline at end of file
@@ -0,0 +1,24 @@
+#pragma once
+
+/// <summary>
+/// Buffer that shaders read through a samplerBuffer with texelFetch.
+/// Used to pull per-particle data in the vertex shader instead of
+/// building a vertex buffer for every particle
+/// </summary>
+class TextureBuffer
+{
+private:
+	unsigned int m_BufferID;
+	unsigned int m_TextureID;
+	unsigned int m_InternalFormat;
+	unsigned int m_Size;
+public:
+	TextureBuffer(unsigned int internalFormat);
+	~TextureBuffer();
+
+	void SetData(const void* data, unsigned int size);
+	void Reserve(unsigned int size);
+
+	void Bind(unsigned int slot = 0) const;
+	void Unbind() const;
+};
\ No newline at end of file
@@ -0,0 +1,46 @@
+#include "UniformBuffer.h"
+#include "Renderer.h"
+
+UniformBuffer::UniformBuffer(unsigned int size, unsigned int binding)
+    : m_Size(size), m_Binding(binding)
+{
+    GLCall(glGenBuffers(1, &m_RendererID));
+    GLCall(glBindBuffer(GL_UNIFORM_BUFFER, m_RendererID));
+    GLCall(glBufferData(GL_UNIFORM_BUFFER, size, nullptr, GL_DYNAMIC_DRAW));
+
+    // Stays attached to its binding point so every program sees it 
+    GLCall(glBindBufferBase(GL_UNIFORM_BUFFER, binding, m_RendererID));
+    GLCall(glBindBuffer(GL_UNIFORM_BUFFER, 0));
+}
+
+UniformBuffer::~UniformBuffer()
+{
+    GLCall(glDeleteBuffers(1, &m_RendererID));
+}
+
+/// <summary>
+/// Upload new contents in a single call. Orphans the old storage when the
+/// whole buffer is replaced so the driver does not have to wait on it
+/// </summary>
+void UniformBuffer::SetData(const void* data, unsigned int size, unsigned int offset) const
+{
+    Bind();
+    if (offset == 0 && size == m_Size)
+    {
+        GLCall(glBufferData(GL_UNIFORM_BUFFER, m_Size, data, GL_DYNAMIC_DRAW));
+    }
+    else
+    {
+        GLCall(glBufferSubData(GL_UNIFORM_BUFFER, offset, size, data));
+    }
+}
+
+void UniformBuffer::Bind() const
+{
+    GLCall(glBindBuffer(GL_UNIFORM_BUFFER, m_RendererID));
+}
+
+void UniformBuffer::Unbind() const
+{
+    GLCall(glBindBuffer(GL_UNIFORM_BUFFER, 0));
+}
\ No newline at end of file
@@ -0,0 +1,49 @@
+#pragma once
+
+#include "glm/glm.hpp"
+
+/// <summary>
+/// Data shared by every program for one frame. Laid out to match
+/// the std140 "FrameData" block:
+/// 
+/// layout(std140) uniform FrameData
+/// {
+///     mat4 u_Proj;
+///     mat4 u_View;
+///     vec4 u_CellColor;
+///     vec4 u_OccupiedCellColor;
+///     vec4 u_BarrierColor;
+///     vec4 u_ParticleColor;
+/// };
+/// </summary>
+struct FrameUniforms
+{
+	glm::mat4 proj;
+	glm::mat4 view;
+
+	glm::vec4 cellColor;
+	glm::vec4 occupiedCellColor;
+	glm::vec4 barrierColor;
+	glm::vec4 particleColor;
+};
+
+class UniformBuffer
+{
+private:
+	unsigned int m_RendererID;
+	unsigned int m_Size;
+	unsigned int m_Binding;
+public:
+	UniformBuffer(unsigned int size, unsigned int binding);
+	~UniformBuffer();
+
+	void SetData(const void* data, unsigned int size, unsigned int offset = 0) const;
+
+	void Bind() const;
+	void Unbind() const;
+
+	inline unsigned int GetBinding() const { return m_Binding; }
+
+	// Binding point used by FrameUniforms 
+	static const unsigned int FRAMEBINDING = 0;
+};
\ No newline at end of file
@@ -0,0 +1,36 @@
+#pragma once
+
+/// <summary>
+/// Read only range over an array that is owned elsewhere. Taking or copying
+/// a view never copies the elements. The generation is the owners change
+/// counter from when the view was taken, comparing it with the owners
+/// current counter tells if the data has changed since
+/// </summary>
+template<typename T>
+class View
+{
+private:
+	const T* m_Data;
+	unsigned int m_Size;
+	unsigned int m_Generation;
+public:
+	View()
+		: m_Data(nullptr), m_Size(0), m_Generation(0) {}
+	View(const T* data, unsigned int size, unsigned int generation)
+		: m_Data(data), m_Size(size), m_Generation(generation) {}
+
+	inline const T& operator[](unsigned int index) const { return m_Data[index]; }
+
+	inline const T* GetData() const { return m_Data; }
+	inline unsigned int GetSize() const { return m_Size; }
+	inline bool IsEmpty() const { return m_Size == 0; }
+
+	inline unsigned int GetGeneration() const { return m_Generation; }
+
+	// The owner was part way through a change when the view was taken 
+	inline bool IsTorn() const { return (m_Generation & 1) != 0; }
+
+	// Range based for 
+	inline const T* begin() const { return m_Data; }
+	inline const T* end() const { return m_Data + m_Size; }
+};
\ No newline at end of file
@@ -0,0 +1,66 @@
+#shader vertex
+#version 330 core
+
+layout(std140) uniform FrameData
+{
+    mat4 u_Proj;
+    mat4 u_View;
+    vec4 u_CellColor;
+    vec4 u_OccupiedCellColor;
+    vec4 u_BarrierColor;
+    vec4 u_ParticleColor;
+};
+
+// One texel per drawn cell, x and y in the low 15 bits each and what the
+// cell shows in the top two bits
+uniform usamplerBuffer u_Cells;
+uniform float u_CellSpacing;
+uniform float u_HalfSize;
+
+out vec2 v_TexCoord;
+flat out uint v_Kind;
+
+// Two triangles per cell, no vertex buffer needed 
+const vec2 CORNERS[6] = vec2[6](
+    vec2(-1.0, -1.0), vec2( 1.0, -1.0), vec2( 1.0,  1.0),
+    vec2( 1.0,  1.0), vec2(-1.0,  1.0), vec2(-1.0, -1.0)
+);
+
+void main()
+{
+    uint cell = texelFetch(u_Cells, gl_VertexID / 6).r;
+    vec2 corner = CORNERS[gl_VertexID % 6];
+
+    vec2 center = (vec2(cell & 0x7FFFu, (cell >> 15) & 0x7FFFu) + 0.5) * u_CellSpacing;
+
+    v_TexCoord = corner * 0.5 + 0.5;
+    v_Kind = cell >> 30;
+    gl_Position = u_Proj * u_View * vec4(center + corner * u_HalfSize, 0.0, 1.0);
+}
+
+#shader fragment
+#version 330 core
+
+layout(std140) uniform FrameData
+{
+    mat4 u_Proj;
+    mat4 u_View;
+    vec4 u_CellColor;
+    vec4 u_OccupiedCellColor;
+    vec4 u_BarrierColor;
+    vec4 u_ParticleColor;
+};
+
+uniform sampler2D u_Texture;
+
+in vec2 v_TexCoord;
+flat in uint v_Kind;
+
+layout(location = 0) out vec4 color;
+
+void main()
+{
+    // 0 empty, 1 holds fluid, 2 wall or under the mouse 
+    vec4 tint = v_Kind == 0u ? u_CellColor : (v_Kind == 1u ? u_OccupiedCellColor : u_BarrierColor);
+    color = texture(u_Texture, v_TexCoord) * tint;
+}
@@ -0,0 +1,66 @@
+#shader vertex
+#version 330 core
+
+layout(std140) uniform FrameData
+{
+    mat4 u_Proj;
+    mat4 u_View;
+    vec4 u_CellColor;
+    vec4 u_OccupiedCellColor;
+    vec4 u_BarrierColor;
+    vec4 u_ParticleColor;
+};
+
+// Particle centres, one RG texel per particle 
+uniform samplerBuffer u_Positions;
+uniform float u_HalfSize;
+
+out vec2 v_Local;
+
+// Two triangles per particle, no vertex buffer needed 
+const vec2 CORNERS[6] = vec2[6](
+    vec2(-1.0, -1.0), vec2( 1.0, -1.0), vec2( 1.0,  1.0),
+    vec2( 1.0,  1.0), vec2(-1.0,  1.0), vec2(-1.0, -1.0)
+);
+
+void main()
+{
+    int particle = gl_VertexID / 6;
+    vec2 corner = CORNERS[gl_VertexID % 6];
+
+    vec2 center = texelFetch(u_Positions, particle).rg;
+
+    v_Local = corner;
+    gl_Position = u_Proj * u_View * vec4(center + corner * u_HalfSize, 0.0, 1.0);
+}
+
+#shader fragment
+#version 330 core
+
+layout(std140) uniform FrameData
+{
+    mat4 u_Proj;
+    mat4 u_View;
+    vec4 u_CellColor;
+    vec4 u_OccupiedCellColor;
+    vec4 u_BarrierColor;
+    vec4 u_ParticleColor;
+};
+
+in vec2 v_Local;
+
+layout(location = 0) out vec4 color;
+
+void main()
+{
+    // Signed distance to the edge of the particle, negative inside 
+    float dist = length(v_Local) - 1.0;
+
+    // Antialias over about one pixel 
+    float edge = fwidth(dist);
+    float alpha = 1.0 - smoothstep(-edge, edge, dist);
+    if (alpha <= 0.0)
+        discard;
+
+    color = vec4(u_ParticleColor.rgb, u_ParticleColor.a * alpha);
+}